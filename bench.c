@@ -0,0 +1,1083 @@
+/*
+ * Allocator micro-benchmarks.
+ *
+ * `make bench` builds this driver once per engine: `bench` with the default
+ * in-page free lists, `bench-oob` with -DBUDDY_OOB_FREELIST, `bench-nb`
+ * against the lock-free engine in buddy_nb.c, `bench-tree` against the
+ * tree engine in buddy_tree.c, `bench-tlsf` against the TLSF engine in
+ * buddy_tlsf.c and `bench-arena` against per-CPU arenas in buddy_arena.c.
+ * Run them side by side and compare the per-scenario columns.
+ *
+ * Usage: bench [scenario] [arg]
+ *   scatter [rounds]       free-list locality (default 20 rounds)
+ *   threads [max_threads]  alloc/free throughput from 1 to max_threads
+ *                          threads: one global mutex, per-rank locks, and
+ *                          per-rank locks with per-thread page caches
+ *                          (the lock-free and tree engines have no caches)
+ *   remote [pairs]         producer threads allocate rank-1 pages and hand
+ *                          them to consumer threads that free them, without
+ *                          and with per-thread page caches
+ *   contend [max_threads]  every thread allocates and frees one rank-1 page
+ *                          in a tight loop; reports per-pair latency
+ *                          percentiles under a global mutex and under the
+ *                          engine's own synchronization
+ *   bulk [rounds]          fill and tear down the pool with rank-1 pages
+ *                          one call at a time vs alloc_pages_bulk() and
+ *                          return_pages_bulk()
+ *   small [rounds]         replace random live blocks of ranks 1 to 4, with
+ *                          small chunks off and on
+ *   slab [rounds]          allocate and free 64 to 2048 byte objects from a
+ *                          slab cache and from glibc malloc()
+ *   malloc [rounds]        replace random live allocations of 4 bytes to
+ *                          16 KiB, through buddy_malloc() and glibc malloc()
+ *   npages [rounds]        fill the pool with requests of 1 to 64 pages
+ *                          through alloc_npages() until it runs out; reports
+ *                          how much of the pool the requests themselves use
+ *   pingpong [rounds]      allocate and free a burst of rank-1 or rank-4
+ *                          blocks in an otherwise empty pool, with eager
+ *                          and lazy coalescing
+ *   suite [rounds]         per-operation latency of five single-threaded
+ *                          workloads: sequential rank-1 fill, random mixed
+ *                          ranks, alloc/free ping-pong without merging,
+ *                          full-depth split and merge cascades, and a
+ *                          half-full fragmented pool; prints CSV with
+ *                          ops/sec and p50/p99/p99.9/max latency
+ * With no scenario every one is run with its default argument; an unknown
+ * one prints the usage and exits with status 2.
+ */
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "slab.h"
+
+#define PAGE_SIZE 4096
+#define POOL_PAGES (128 * 1024 / 4)
+
+#ifndef BUDDY_DEFAULT_ENGINE
+#define BUDDY_DEFAULT_ENGINE BUDDY_ENGINE_LIST
+#endif
+
+#if BUDDY_DEFAULT_ENGINE == BUDDY_ENGINE_NB
+#define VARIANT "nb"
+#define NATIVE_MODE "lock-free"
+#define FREE_PAGES_UNTOUCHED
+#elif BUDDY_DEFAULT_ENGINE == BUDDY_ENGINE_TREE
+#define VARIANT "tree"
+#define NATIVE_MODE "tree-lock"
+#define FREE_PAGES_UNTOUCHED
+#elif BUDDY_DEFAULT_ENGINE == BUDDY_ENGINE_TLSF
+#define VARIANT "tlsf"
+#define NATIVE_MODE "tlsf-lock"
+#define FREE_PAGES_UNTOUCHED
+#elif BUDDY_DEFAULT_ENGINE == BUDDY_ENGINE_ARENA
+#define VARIANT "arena"
+#define NATIVE_MODE "arenas"
+#elif defined(BUDDY_OOB_FREELIST)
+#define VARIANT "oob"
+#define NATIVE_MODE "rank-locks"
+#define FREE_PAGES_UNTOUCHED
+#else
+#define VARIANT "inpage"
+#define NATIVE_MODE "rank-locks"
+#endif
+
+struct counters {
+    double seconds;
+    long minor_faults;
+    long long cache_misses;  // -1 when perf events are unavailable
+    long long dtlb_misses;
+};
+
+static int perf_open(unsigned int type, unsigned long long config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int cache_fd = -1, dtlb_fd = -1;
+
+static long minor_faults(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void counters_start(struct counters *c) {
+    if (cache_fd >= 0) {
+        ioctl(cache_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(cache_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    if (dtlb_fd >= 0) {
+        ioctl(dtlb_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(dtlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    c->minor_faults = minor_faults();
+    c->seconds = now_sec();
+}
+
+static long long read_counter(int fd) {
+    long long value;
+    if (fd < 0) {
+        return -1;
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return -1;
+    }
+    return value;
+}
+
+static void counters_stop(struct counters *c) {
+    c->seconds = now_sec() - c->seconds;
+    c->minor_faults = minor_faults() - c->minor_faults;
+    c->cache_misses = read_counter(cache_fd);
+    c->dtlb_misses = read_counter(dtlb_fd);
+}
+
+static void report(const char *scenario, long ops, const struct counters *c) {
+    printf("%-8s %-14s %9ld ops %8.3f ms %10ld faults", VARIANT,
+           scenario, ops, c->seconds * 1e3, c->minor_faults);
+    if (c->cache_misses >= 0) {
+        printf(" %12lld cache-misses", c->cache_misses);
+    } else {
+        printf(" %12s cache-misses", "n/a");
+    }
+    if (c->dtlb_misses >= 0) {
+        printf(" %12lld dtlb-misses", c->dtlb_misses);
+    } else {
+        printf(" %12s dtlb-misses", "n/a");
+    }
+    printf("\n");
+}
+
+static void shuffle(void **v, int n, unsigned int *seed) {
+    for (int i = n - 1; i > 0; i--) {
+        int j = rand_r(seed) % (i + 1);
+        void *t = v[i];
+        v[i] = v[j];
+        v[j] = t;
+    }
+}
+
+/*
+ * Fill the pool with rank-1 pages, then repeatedly free every other page in
+ * random order and allocate them back.  Buddies stay allocated, so every
+ * free and alloc is a pure list operation on a scattered, cold page.  When
+ * release is set the freed pages are handed back to the OS first, the way a
+ * caller reclaiming free memory would; that is only safe when the engine
+ * keeps no state inside free pages.
+ */
+static void bench_scatter(int rounds, int release) {
+    char *pool = mmap(NULL, (size_t)POOL_PAGES * PAGE_SIZE,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (pool == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    void **pages = malloc(sizeof(void*) * POOL_PAGES);
+    void **odd = malloc(sizeof(void*) * (POOL_PAGES / 2));
+    unsigned int seed = 1;
+    struct counters c;
+    
+    init_page(pool, POOL_PAGES);
+    counters_start(&c);
+    for (int i = 0; i < POOL_PAGES; i++) {
+        pages[i] = alloc_pages(1);
+    }
+    counters_stop(&c);
+    report("fill", POOL_PAGES, &c);
+    
+    for (int i = 0; i < POOL_PAGES / 2; i++) {
+        odd[i] = pages[2 * i + 1];
+    }
+    
+    long ops = 0;
+    struct counters total = {0, 0, 0, 0};
+    for (int r = 0; r < rounds; r++) {
+        shuffle(odd, POOL_PAGES / 2, &seed);
+        counters_start(&c);
+        for (int i = 0; i < POOL_PAGES / 2; i++) {
+            return_pages(odd[i]);
+        }
+        counters_stop(&c);
+        total.seconds += c.seconds;
+        total.minor_faults += c.minor_faults;
+        total.cache_misses += c.cache_misses;
+        total.dtlb_misses += c.dtlb_misses;
+        
+        if (release) {
+            for (int i = 0; i < POOL_PAGES / 2; i++) {
+                madvise(odd[i], PAGE_SIZE, MADV_DONTNEED);
+            }
+        }
+        
+        counters_start(&c);
+        for (int i = 0; i < POOL_PAGES / 2; i++) {
+            odd[i] = alloc_pages(1);
+        }
+        counters_stop(&c);
+        total.seconds += c.seconds;
+        total.minor_faults += c.minor_faults;
+        total.cache_misses += c.cache_misses;
+        total.dtlb_misses += c.dtlb_misses;
+        ops += POOL_PAGES;
+    }
+    if (cache_fd < 0) {
+        total.cache_misses = -1;
+    }
+    if (dtlb_fd < 0) {
+        total.dtlb_misses = -1;
+    }
+    report(release ? "scatter+release" : "scatter", ops, &total);
+    
+    free(odd);
+    free(pages);
+    munmap(pool, (size_t)POOL_PAGES * PAGE_SIZE);
+}
+
+#define THREAD_OPS 1000000
+#define THREAD_LIVE 32
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static int use_global_lock;
+
+// Random rank 1-4 alloc/free churn over a small per-thread live set
+static void *thread_churn(void *arg) {
+    unsigned int seed = (unsigned int)(long)arg;
+    void *live[THREAD_LIVE];
+    int n = 0;
+    
+    for (int i = 0; i < THREAD_OPS; i++) {
+        if (n == 0 || (n < THREAD_LIVE && rand_r(&seed) % 2)) {
+            int rank = 1 + rand_r(&seed) % 4;
+            if (use_global_lock) {
+                pthread_mutex_lock(&global_lock);
+            }
+            void *p = alloc_pages(rank);
+            if (use_global_lock) {
+                pthread_mutex_unlock(&global_lock);
+            }
+            if (!IS_ERR(p)) {
+                live[n++] = p;
+            }
+        } else {
+            int k = rand_r(&seed) % n;
+            if (use_global_lock) {
+                pthread_mutex_lock(&global_lock);
+            }
+            return_pages(live[k]);
+            if (use_global_lock) {
+                pthread_mutex_unlock(&global_lock);
+            }
+            live[k] = live[--n];
+        }
+    }
+    while (n > 0) {
+        return_pages(live[--n]);
+    }
+    return NULL;
+}
+
+static void bench_threads(int max_threads) {
+    char *pool = malloc((size_t)POOL_PAGES * PAGE_SIZE);
+    pthread_t *threads = malloc(sizeof(pthread_t) * max_threads);
+    
+    static const char *const modes[] = {"global-mutex", NATIVE_MODE, "pcp"};
+    for (int mode = 0; mode < 3; mode++) {
+        init_page(pool, POOL_PAGES);
+        use_global_lock = mode == 0;
+        if (buddy_set_pcp(mode == 2 ? 64 : 0, 16) != OK) {
+            printf("%-8s %-14s skipped: not supported by this engine\n",
+                   VARIANT, modes[mode]);
+            continue;
+        }
+        // 1, 2, 4, ... threads, finishing with max_threads itself
+        for (int n = 1; n <= max_threads;
+             n = (n < max_threads && n * 2 > max_threads) ? max_threads
+                                                          : n * 2) {
+            double start = now_sec();
+            for (long i = 0; i < n; i++) {
+                pthread_create(&threads[i], NULL, thread_churn,
+                               (void*)(i + 1));
+            }
+            for (int i = 0; i < n; i++) {
+                pthread_join(threads[i], NULL);
+            }
+            double seconds = now_sec() - start;
+            printf("%-8s %-14s %3d threads %10ld ops %8.3f ms %8.2f Mops/s\n",
+                   VARIANT,
+                   modes[mode], n,
+                   (long)n * THREAD_OPS, seconds * 1e3,
+                   n * THREAD_OPS / seconds / 1e6);
+        }
+    }
+    
+    free(threads);
+    free(pool);
+}
+
+/*
+ * Each producer allocates rank-1 pages and passes them through a ring to
+ * its consumer, which frees them.  Every block is freed by a thread other
+ * than the one that allocated it; with per-thread caches those frees go
+ * back to the producer through its remote-free queue.
+ */
+#define REMOTE_RING 256
+#define REMOTE_OPS 1000000
+
+struct remote_pair {
+    void *ring[REMOTE_RING];
+    long head;                      // Written by the producer only
+    long tail;                      // Written by the consumer only
+};
+
+static void *remote_producer(void *arg) {
+    struct remote_pair *pair = arg;
+    for (long i = 0; i < REMOTE_OPS; i++) {
+        void *p;
+        while (IS_ERR(p = alloc_pages(1))) {
+            sched_yield();
+        }
+        while (i - __atomic_load_n(&pair->tail, __ATOMIC_ACQUIRE) >=
+               REMOTE_RING) {
+            sched_yield();
+        }
+        pair->ring[i % REMOTE_RING] = p;
+        __atomic_store_n(&pair->head, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *remote_consumer(void *arg) {
+    struct remote_pair *pair = arg;
+    for (long i = 0; i < REMOTE_OPS; i++) {
+        while (__atomic_load_n(&pair->head, __ATOMIC_ACQUIRE) == i) {
+            sched_yield();
+        }
+        return_pages(pair->ring[i % REMOTE_RING]);
+        __atomic_store_n(&pair->tail, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void bench_remote(int pairs) {
+    char *pool = malloc((size_t)POOL_PAGES * PAGE_SIZE);
+    struct remote_pair *pair = malloc(sizeof(*pair) * pairs);
+    pthread_t *threads = malloc(sizeof(pthread_t) * 2 * pairs);
+    
+    static const char *const modes[] = {NATIVE_MODE, "pcp"};
+    for (int mode = 0; mode < 2; mode++) {
+        init_page(pool, POOL_PAGES);
+        if (buddy_set_pcp(mode == 1 ? 64 : 0, 16) != OK) {
+            printf("%-8s %-14s skipped: not supported by this engine\n",
+                   VARIANT, modes[mode]);
+            continue;
+        }
+        double start = now_sec();
+        for (int i = 0; i < pairs; i++) {
+            pair[i].head = 0;
+            pair[i].tail = 0;
+            pthread_create(&threads[2 * i], NULL, remote_producer, &pair[i]);
+            pthread_create(&threads[2 * i + 1], NULL, remote_consumer,
+                           &pair[i]);
+        }
+        for (int i = 0; i < 2 * pairs; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double seconds = now_sec() - start;
+        printf("%-8s %-14s %3d pairs   %10ld ops %8.3f ms %8.2f Mops/s\n",
+               VARIANT, modes[mode], pairs, 2L * pairs * REMOTE_OPS,
+               seconds * 1e3, 2.0 * pairs * REMOTE_OPS / seconds / 1e6);
+    }
+    buddy_set_pcp(0, 0);
+    
+    free(threads);
+    free(pair);
+    free(pool);
+}
+
+#define CONTEND_PAIRS 200000
+
+// Allocate and immediately free one rank-1 page, timing every pair.  All
+// threads fight over the same few pages at the front of the pool.
+static void *thread_contend(void *arg) {
+    unsigned int *lat = arg;
+    
+    for (int i = 0; i < CONTEND_PAIRS; i++) {
+        double start = now_sec();
+        if (use_global_lock) {
+            pthread_mutex_lock(&global_lock);
+        }
+        void *p = alloc_pages(1);
+        if (use_global_lock) {
+            pthread_mutex_unlock(&global_lock);
+        }
+        if (!IS_ERR(p)) {
+            if (use_global_lock) {
+                pthread_mutex_lock(&global_lock);
+            }
+            return_pages(p);
+            if (use_global_lock) {
+                pthread_mutex_unlock(&global_lock);
+            }
+        }
+        lat[i] = (unsigned int)((now_sec() - start) * 1e9);
+    }
+    return NULL;
+}
+
+static int uint_cmp(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int*)a;
+    unsigned int y = *(const unsigned int*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_contend(int max_threads) {
+    char *pool = malloc((size_t)POOL_PAGES * PAGE_SIZE);
+    pthread_t *threads = malloc(sizeof(pthread_t) * max_threads);
+    unsigned int *lat = malloc(sizeof(unsigned int) * CONTEND_PAIRS *
+                               max_threads);
+    
+    static const char *const modes[] = {"global-mutex", NATIVE_MODE};
+    for (int mode = 0; mode < 2; mode++) {
+        init_page(pool, POOL_PAGES);
+        use_global_lock = mode == 0;
+        for (int n = 1; n <= max_threads;
+             n = (n < max_threads && n * 2 > max_threads) ? max_threads
+                                                          : n * 2) {
+            double start = now_sec();
+            for (long i = 0; i < n; i++) {
+                pthread_create(&threads[i], NULL, thread_contend,
+                               lat + i * CONTEND_PAIRS);
+            }
+            for (int i = 0; i < n; i++) {
+                pthread_join(threads[i], NULL);
+            }
+            double seconds = now_sec() - start;
+            
+            long pairs = (long)n * CONTEND_PAIRS;
+            qsort(lat, pairs, sizeof(unsigned int), uint_cmp);
+            printf("%-8s %-14s %3d threads %8.2f Mpairs/s  p50 %6u ns  "
+                   "p99 %7u ns  p99.9 %8u ns  max %9u ns\n",
+                   VARIANT, modes[mode], n, pairs / seconds / 1e6,
+                   lat[pairs / 2], lat[pairs * 99 / 100],
+                   lat[pairs * 999 / 1000], lat[pairs - 1]);
+        }
+    }
+    
+    free(lat);
+    free(threads);
+    free(pool);
+}
+
+static void bench_bulk(int rounds) {
+    char *pool = malloc((size_t)POOL_PAGES * PAGE_SIZE);
+    void **pages = malloc(sizeof(void*) * POOL_PAGES);
+    unsigned int seed = 1;
+    double single = 0, bulk = 0, free_single = 0, free_bulk = 0;
+    
+    for (int r = 0; r < rounds; r++) {
+        init_page(pool, POOL_PAGES);
+        double start = now_sec();
+        for (int i = 0; i < POOL_PAGES; i++) {
+            pages[i] = alloc_pages(1);
+        }
+        single += now_sec() - start;
+        shuffle(pages, POOL_PAGES, &seed);
+        start = now_sec();
+        for (int i = 0; i < POOL_PAGES; i++) {
+            return_pages(pages[i]);
+        }
+        free_single += now_sec() - start;
+        
+        init_page(pool, POOL_PAGES);
+        start = now_sec();
+        alloc_pages_bulk(1, POOL_PAGES, pages);
+        bulk += now_sec() - start;
+        shuffle(pages, POOL_PAGES, &seed);
+        start = now_sec();
+        return_pages_bulk(pages, POOL_PAGES);
+        free_bulk += now_sec() - start;
+    }
+    printf("%-8s %-14s %9ld ops %8.3f ms\n", VARIANT, "fill-single",
+           (long)rounds * POOL_PAGES, single * 1e3);
+    printf("%-8s %-14s %9ld ops %8.3f ms\n", VARIANT, "fill-bulk",
+           (long)rounds * POOL_PAGES, bulk * 1e3);
+    printf("%-8s %-14s %9ld ops %8.3f ms\n", VARIANT, "free-single",
+           (long)rounds * POOL_PAGES, free_single * 1e3);
+    printf("%-8s %-14s %9ld ops %8.3f ms\n", VARIANT, "free-bulk",
+           (long)rounds * POOL_PAGES, free_bulk * 1e3);
+    
+    free(pages);
+    free(pool);
+}
+
+/*
+ * Keep SMALL_LIVE blocks of ranks 1..BUDDY_CHUNK_MAX_RANK allocated and
+ * replace a random one at a time, once through the buddy lists and once
+ * through small chunks.
+ */
+#define SMALL_LIVE 4096
+#define SMALL_OPS 1000000
+
+static void bench_small(int rounds) {
+    char *pool = malloc((size_t)POOL_PAGES * PAGE_SIZE);
+    void **live = malloc(sizeof(void*) * SMALL_LIVE);
+    static const char *const modes[] = {"small-buddy", "small-chunks"};
+    
+    for (int mode = 0; mode < 2; mode++) {
+        init_page(pool, POOL_PAGES);
+        if (buddy_set_chunks(mode) != OK) {
+            printf("%-8s %-14s skipped: engine has no small chunks\n",
+                   VARIANT, modes[mode]);
+            continue;
+        }
+        unsigned int seed = 1;
+        struct counters c, total = {0, 0, 0, 0};
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < SMALL_LIVE; i++) {
+                live[i] = alloc_pages(1 + rand_r(&seed) % BUDDY_CHUNK_MAX_RANK);
+            }
+            counters_start(&c);
+            for (int i = 0; i < SMALL_OPS; i++) {
+                int j = rand_r(&seed) % SMALL_LIVE;
+                return_pages(live[j]);
+                live[j] = alloc_pages(1 + rand_r(&seed) % BUDDY_CHUNK_MAX_RANK);
+            }
+            counters_stop(&c);
+            return_pages_bulk(live, SMALL_LIVE);
+            total.seconds += c.seconds;
+            total.minor_faults += c.minor_faults;
+            total.cache_misses += c.cache_misses;
+            total.dtlb_misses += c.dtlb_misses;
+        }
+        if (cache_fd < 0) {
+            total.cache_misses = -1;
+        }
+        if (dtlb_fd < 0) {
+            total.dtlb_misses = -1;
+        }
+        report(modes[mode], 2L * rounds * SMALL_OPS, &total);
+    }
+    buddy_set_chunks(0);
+    
+    free(live);
+    free(pool);
+}
+
+/*
+ * For each object size, allocate SLAB_OBJS objects, then free them in
+ * random order, through a slab cache and through malloc().
+ */
+#define SLAB_OBJS 16384
+
+static void bench_slab(int rounds) {
+    char *pool = malloc((size_t)POOL_PAGES * PAGE_SIZE);
+    void **objs = malloc(sizeof(void*) * SLAB_OBJS);
+    init_page(pool, POOL_PAGES);
+    
+    for (size_t size = 64; size <= 2048; size *= 2) {
+        slab_cache_t *cache = slab_cache_create("bench", size, 0);
+        unsigned int seed = 1;
+        double slab = 0, libc = 0;
+        for (int r = 0; r < rounds; r++) {
+            double start = now_sec();
+            for (int i = 0; i < SLAB_OBJS; i++) {
+                objs[i] = slab_alloc(cache);
+            }
+            shuffle(objs, SLAB_OBJS, &seed);
+            for (int i = 0; i < SLAB_OBJS; i++) {
+                slab_free(cache, objs[i]);
+            }
+            slab += now_sec() - start;
+            
+            start = now_sec();
+            for (int i = 0; i < SLAB_OBJS; i++) {
+                objs[i] = malloc(size);
+            }
+            shuffle(objs, SLAB_OBJS, &seed);
+            for (int i = 0; i < SLAB_OBJS; i++) {
+                free(objs[i]);
+            }
+            libc += now_sec() - start;
+        }
+        
+        struct slab_cache_stats st;
+        slab_cache_get_stats(cache, &st);
+        char name[16];
+        snprintf(name, sizeof(name), "slab-%zu", size);
+        printf("%-8s %-14s %9ld ops %8.3f ms %8.3f ms malloc %6lu slabs\n",
+               VARIANT, name, 2L * rounds * SLAB_OBJS, slab * 1e3, libc * 1e3,
+               st.slabs_created);
+        slab_cache_destroy(cache);
+    }
+    
+    free(objs);
+    free(pool);
+}
+
+/*
+ * Keep MALLOC_LIVE allocations live and replace a random one at a time.
+ * Sizes are log-uniform from 4 bytes to 16 KiB, so most stay in the slab
+ * size classes and some take whole pages.
+ */
+#define MALLOC_LIVE 4096
+#define MALLOC_OPS 500000
+
+static size_t malloc_size(unsigned int *seed) {
+    int shift = 3 + rand_r(seed) % 12;
+    return (1 + rand_r(seed) % (1 << shift) + (1 << shift)) / 2;
+}
+
+static void bench_malloc(int rounds) {
+    char *pool = malloc((size_t)POOL_PAGES * PAGE_SIZE);
+    void **live = malloc(sizeof(void*) * MALLOC_LIVE);
+    double seconds[2] = {0, 0};
+    init_page(pool, POOL_PAGES);
+    
+    for (int r = 0; r < rounds; r++) {
+        for (int libc = 0; libc < 2; libc++) {
+            unsigned int seed = r + 1;
+            for (int i = 0; i < MALLOC_LIVE; i++) {
+                size_t size = malloc_size(&seed);
+                live[i] = libc ? malloc(size) : buddy_malloc(size);
+            }
+            double start = now_sec();
+            for (int i = 0; i < MALLOC_OPS; i++) {
+                int j = rand_r(&seed) % MALLOC_LIVE;
+                size_t size = malloc_size(&seed);
+                if (libc) {
+                    free(live[j]);
+                    live[j] = malloc(size);
+                } else {
+                    buddy_free(live[j]);
+                    live[j] = buddy_malloc(size);
+                }
+            }
+            seconds[libc] += now_sec() - start;
+            for (int i = 0; i < MALLOC_LIVE; i++) {
+                if (libc) {
+                    free(live[i]);
+                } else {
+                    buddy_free(live[i]);
+                }
+            }
+        }
+    }
+    printf("%-8s %-14s %9ld ops %8.3f ms %8.3f ms malloc\n", VARIANT,
+           "buddy_malloc", 2L * rounds * MALLOC_OPS, seconds[0] * 1e3,
+           seconds[1] * 1e3);
+    buddy_malloc_trim();
+    
+    free(live);
+    free(pool);
+}
+
+/*
+ * Power-of-two engines round every request up to a whole rank, so a pool
+ * filled with odd-sized requests runs out while much of it is still slack
+ * inside the blocks.  Utilization is requested pages over pool pages at the
+ * first failure.
+ */
+static void bench_npages(int rounds) {
+    char *pool = malloc((size_t)POOL_PAGES * PAGE_SIZE);
+    void **blocks = malloc(sizeof(void*) * POOL_PAGES);
+    unsigned int seed = 1;
+    long ops = 0, used = 0;
+    double seconds = 0;
+    
+    for (int r = 0; r < rounds; r++) {
+        init_page(pool, POOL_PAGES);
+        int n = 0;
+        double start = now_sec();
+        for (;;) {
+            long npages = 1 + rand_r(&seed) % 64;
+            void *p = alloc_npages(npages);
+            if (IS_ERR(p)) {
+                break;
+            }
+            blocks[n++] = p;
+            used += npages;
+        }
+        for (int i = 0; i < n; i++) {
+            return_pages(blocks[i]);
+        }
+        seconds += now_sec() - start;
+        ops += 2 * n;
+    }
+    printf("%-8s %-14s %9ld ops %8.3f ms %9.1f%% used\n", VARIANT, "npages",
+           ops, seconds * 1e3, 100.0 * used / ((double)rounds * POOL_PAGES));
+    
+    free(blocks);
+    free(pool);
+}
+
+/*
+ * Allocate PINGPONG_BURST blocks of one rank and free them all, over and
+ * over, in an otherwise empty pool.  Eager coalescing splits a MAX_RANK
+ * block down to the burst on every allocation and merges it all the way
+ * back on every free; lazy coalescing keeps the freed blocks at their rank.
+ */
+#define PINGPONG_BURST 8
+#define PINGPONG_OPS 1000000
+#define PINGPONG_LAZY 16
+
+static void bench_pingpong(int rounds) {
+    char *pool = malloc((size_t)POOL_PAGES * PAGE_SIZE);
+    void *burst[PINGPONG_BURST];
+    static const int ranks[] = {1, 4};
+    static const char *const modes[][2] = {
+        {"ping1-eager", "ping1-lazy"},
+        {"ping4-eager", "ping4-lazy"},
+    };
+    
+    for (int k = 0; k < 2; k++) {
+        for (int mode = 0; mode < 2; mode++) {
+            init_page(pool, POOL_PAGES);
+            if (buddy_set_lazy(mode ? PINGPONG_LAZY : 0) != OK) {
+                printf("%-8s %-14s skipped: engine has no lazy coalescing\n",
+                       VARIANT, modes[k][mode]);
+                continue;
+            }
+            struct counters c, total = {0, 0, 0, 0};
+            for (int r = 0; r < rounds; r++) {
+                counters_start(&c);
+                for (int i = 0; i < PINGPONG_OPS / PINGPONG_BURST; i++) {
+                    for (int j = 0; j < PINGPONG_BURST; j++) {
+                        burst[j] = alloc_pages(ranks[k]);
+                    }
+                    for (int j = 0; j < PINGPONG_BURST; j++) {
+                        return_pages(burst[j]);
+                    }
+                }
+                counters_stop(&c);
+                total.seconds += c.seconds;
+                total.minor_faults += c.minor_faults;
+                total.cache_misses += c.cache_misses;
+                total.dtlb_misses += c.dtlb_misses;
+            }
+            if (cache_fd < 0) {
+                total.cache_misses = -1;
+            }
+            if (dtlb_fd < 0) {
+                total.dtlb_misses = -1;
+            }
+            report(modes[k][mode], 2L * rounds * PINGPONG_OPS, &total);
+        }
+    }
+    buddy_set_lazy(0);
+    
+    free(pool);
+}
+
+/*
+ * The suite runs every workload twice from the same seed: once for
+ * throughput, with the clock read only around the whole loop, and once
+ * reading it around every single call for latency percentiles, so that the
+ * clock itself does not count against ops/sec.  Setup such as filling the
+ * pool is not measured.  Each workload prints one CSV row; calls that fail
+ * with -ENOSPC count as operations and are reported in the failed column.
+ */
+#define SUITE_OPS 1000000
+#define SUITE_LIVE 4096
+
+static int suite_timing;            // Set on the latency pass
+static unsigned int *suite_lat;
+static long suite_nlat, suite_cap;
+static long suite_failed;
+static double suite_seconds;
+
+static inline double op_start(void) {
+    return suite_timing ? now_sec() : 0;
+}
+
+static inline void op_end(double start) {
+    if (!suite_timing) {
+        return;
+    }
+    unsigned int ns = (unsigned int)((now_sec() - start) * 1e9);
+    if (suite_nlat == suite_cap) {
+        suite_cap = suite_cap ? 2 * suite_cap : SUITE_OPS;
+        suite_lat = realloc(suite_lat, sizeof(unsigned int) * suite_cap);
+    }
+    suite_lat[suite_nlat++] = ns;
+}
+
+static void *timed_alloc(int rank) {
+    double start = op_start();
+    void *p = alloc_pages(rank);
+    op_end(start);
+    if (IS_ERR(p)) {
+        suite_failed++;
+    }
+    return p;
+}
+
+static void timed_free(void *p) {
+    double start = op_start();
+    return_pages(p);
+    op_end(start);
+}
+
+// Fill the empty pool with rank-1 pages, lowest address first
+static long suite_seq_fill(char *pool, int rounds, void **pages) {
+    for (int r = 0; r < rounds; r++) {
+        init_page(pool, POOL_PAGES);
+        double start = now_sec();
+        for (int i = 0; i < POOL_PAGES; i++) {
+            pages[i] = timed_alloc(1);
+        }
+        suite_seconds += now_sec() - start;
+    }
+    return (long)rounds * POOL_PAGES;
+}
+
+// Allocate or free at random, keeping up to SUITE_LIVE blocks of ranks 1
+// to 6, each rank half as likely as the one below
+static long suite_random(char *pool, int rounds, void **pages) {
+    unsigned int seed = 1;
+    long ops = 0;
+    for (int r = 0; r < rounds; r++) {
+        init_page(pool, POOL_PAGES);
+        int n = 0;
+        double start = now_sec();
+        for (int i = 0; i < SUITE_OPS; i++) {
+            if (n == 0 || (n < SUITE_LIVE && rand_r(&seed) % 2)) {
+                void *p = timed_alloc(1 + __builtin_ctz(rand_r(&seed) | 0x20));
+                if (!IS_ERR(p)) {
+                    pages[n++] = p;
+                }
+            } else {
+                int k = rand_r(&seed) % n;
+                timed_free(pages[k]);
+                pages[k] = pages[--n];
+            }
+        }
+        suite_seconds += now_sec() - start;
+        ops += SUITE_OPS;
+    }
+    return ops;
+}
+
+// Allocate and free one rank-1 page in a full pool with a single free page,
+// whose buddy stays allocated: no split and no merge
+static long suite_pingpong(char *pool, int rounds, void **pages) {
+    for (int r = 0; r < rounds; r++) {
+        init_page(pool, POOL_PAGES);
+        for (int i = 0; i < POOL_PAGES; i++) {
+            pages[i] = alloc_pages(1);
+        }
+        return_pages(pages[0]);
+        double start = now_sec();
+        for (int i = 0; i < SUITE_OPS / 2; i++) {
+            timed_free(timed_alloc(1));
+        }
+        suite_seconds += now_sec() - start;
+    }
+    return (long)rounds * SUITE_OPS;
+}
+
+// Allocate and free one rank-1 page in an empty pool: every allocation
+// splits the whole pool down to one page and every free merges it back up
+static long suite_cascade(char *pool, int rounds, void **pages) {
+    (void)pages;
+    for (int r = 0; r < rounds; r++) {
+        init_page(pool, POOL_PAGES);
+        double start = now_sec();
+        for (int i = 0; i < SUITE_OPS / 2; i++) {
+            timed_free(timed_alloc(1));
+        }
+        suite_seconds += now_sec() - start;
+    }
+    return (long)rounds * SUITE_OPS;
+}
+
+// Start from every other page allocated, then hold the pool at half full
+// by freeing random live blocks and allocating blocks of ranks 1 to 3,
+// which only fit where scattered frees happened to leave room
+static long suite_fragment(char *pool, int rounds, void **pages) {
+    static unsigned char ranks[POOL_PAGES];
+    unsigned int seed = 1;
+    long ops = 0;
+    for (int r = 0; r < rounds; r++) {
+        init_page(pool, POOL_PAGES);
+        for (int i = 0; i < POOL_PAGES; i++) {
+            pages[i] = alloc_pages(1);
+        }
+        int n = 0;
+        for (int i = 0; i < POOL_PAGES; i++) {
+            if (i % 2) {
+                ranks[n] = 1;
+                pages[n++] = pages[i];
+            } else {
+                return_pages(pages[i]);
+            }
+        }
+        long live = n;
+        double start = now_sec();
+        for (int i = 0; i < SUITE_OPS; i++) {
+            if (n > 0 && live >= POOL_PAGES / 2) {
+                int k = rand_r(&seed) % n;
+                live -= 1L << (ranks[k] - 1);
+                timed_free(pages[k]);
+                ranks[k] = ranks[--n];
+                pages[k] = pages[n];
+            } else {
+                int rank = 1 + rand_r(&seed) % 3;
+                void *p = timed_alloc(rank);
+                if (!IS_ERR(p)) {
+                    ranks[n] = rank;
+                    pages[n++] = p;
+                    live += 1L << (rank - 1);
+                }
+            }
+        }
+        suite_seconds += now_sec() - start;
+        ops += SUITE_OPS;
+    }
+    return ops;
+}
+
+static void bench_suite(int rounds) {
+    static const struct {
+        const char *name;
+        long (*run)(char *pool, int rounds, void **pages);
+    } workloads[] = {
+        {"seq-fill", suite_seq_fill},
+        {"random-mixed", suite_random},
+        {"pingpong", suite_pingpong},
+        {"merge-cascade", suite_cascade},
+        {"fragment", suite_fragment},
+    };
+    char *pool = malloc((size_t)POOL_PAGES * PAGE_SIZE);
+    void **pages = malloc(sizeof(void*) * POOL_PAGES);
+    memset(pool, 1, (size_t)POOL_PAGES * PAGE_SIZE);    // Fault it in now
+    
+    printf("variant,workload,ops,failed,ops_per_sec,p50_ns,p99_ns,p999_ns,"
+           "max_ns\n");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        suite_timing = 0;
+        suite_seconds = 0;
+        long ops = workloads[w].run(pool, rounds, pages);
+        double seconds = suite_seconds;
+        
+        suite_timing = 1;
+        suite_nlat = 0;
+        suite_failed = 0;
+        workloads[w].run(pool, rounds, pages);
+        qsort(suite_lat, suite_nlat, sizeof(unsigned int), uint_cmp);
+        printf("%s,%s,%ld,%ld,%.0f,%u,%u,%u,%u\n", VARIANT, workloads[w].name,
+               ops, suite_failed, ops / seconds, suite_lat[suite_nlat / 2],
+               suite_lat[suite_nlat * 99 / 100],
+               suite_lat[suite_nlat * 999 / 1000], suite_lat[suite_nlat - 1]);
+    }
+    
+    free(suite_lat);
+    suite_lat = NULL;
+    suite_cap = 0;
+    free(pages);
+    free(pool);
+}
+
+static const char *const scenarios[] = {
+    "scatter", "bulk", "small", "slab", "malloc", "npages", "pingpong",
+    "suite", "threads", "remote", "contend",
+};
+
+static void usage(void) {
+    fprintf(stderr, "usage: bench [scenario] [arg]\nscenarios:");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        fprintf(stderr, " %s", scenarios[i]);
+    }
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *scenario = argc > 1 ? argv[1] : NULL;
+    int arg = argc > 2 ? atoi(argv[2]) : 0;
+    if (scenario != NULL) {
+        size_t i = 0;
+        while (i < sizeof(scenarios) / sizeof(scenarios[0]) &&
+               strcmp(scenario, scenarios[i]) != 0) {
+            i++;
+        }
+        if (i == sizeof(scenarios) / sizeof(scenarios[0])) {
+            usage();
+        }
+    }
+    
+    cache_fd = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    dtlb_fd = perf_open(PERF_TYPE_HW_CACHE,
+                        PERF_COUNT_HW_CACHE_DTLB |
+                        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    
+    if (scenario == NULL || strcmp(scenario, "scatter") == 0) {
+        int rounds = arg > 0 ? arg : 20;
+        bench_scatter(rounds, 0);
+#ifdef FREE_PAGES_UNTOUCHED
+        bench_scatter(rounds, 1);
+#else
+        printf("%-8s %-14s skipped: free pages hold the list links\n",
+               VARIANT, "scatter+release");
+#endif
+    }
+    if (scenario == NULL || strcmp(scenario, "bulk") == 0) {
+        bench_bulk(arg > 0 ? arg : 20);
+    }
+    if (scenario == NULL || strcmp(scenario, "small") == 0) {
+        bench_small(arg > 0 ? arg : 5);
+    }
+    if (scenario == NULL || strcmp(scenario, "slab") == 0) {
+        bench_slab(arg > 0 ? arg : 20);
+    }
+    if (scenario == NULL || strcmp(scenario, "malloc") == 0) {
+        bench_malloc(arg > 0 ? arg : 5);
+    }
+    if (scenario == NULL || strcmp(scenario, "npages") == 0) {
+        bench_npages(arg > 0 ? arg : 20);
+    }
+    if (scenario == NULL || strcmp(scenario, "pingpong") == 0) {
+        bench_pingpong(arg > 0 ? arg : 5);
+    }
+    if (scenario == NULL || strcmp(scenario, "suite") == 0) {
+        bench_suite(arg > 0 ? arg : 3);
+    }
+    if (scenario == NULL || strcmp(scenario, "threads") == 0) {
+        bench_threads(arg > 0 ? arg : 2 * (int)sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    if (scenario == NULL || strcmp(scenario, "remote") == 0) {
+        int pairs = (int)sysconf(_SC_NPROCESSORS_ONLN) / 2;
+        bench_remote(arg > 0 ? arg : pairs > 0 ? pairs : 1);
+    }
+    if (scenario == NULL || strcmp(scenario, "contend") == 0) {
+        bench_contend(arg > 0 ? arg : 2 * (int)sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    return 0;
+}
@@ -1,246 +1,661 @@
-#include "buddy.h"
-#define NULL ((void *)0)
+#include "buddy_engine.h"
+#include "buddy_trace.h"
 
-#define MAX_RANK 16
-#define PAGE_SIZE 4096
-#define MAX_PAGES (128 * 1024 / 4)  // Maximum possible pages
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-// Free list for each rank
-typedef struct free_block {
-    struct free_block *next;
-    struct free_block *prev;
-} free_block_t;
+#ifndef BUDDY_DEFAULT_ENGINE
+#define BUDDY_DEFAULT_ENGINE BUDDY_ENGINE_LIST
+#endif
 
-static free_block_t *free_lists[MAX_RANK + 1];
-static void *base_addr = NULL;
-static int total_pages = 0;
-static unsigned char page_rank_map[MAX_PAGES];
-static unsigned char page_allocated[MAX_PAGES];
+// Indexed by BUDDY_ENGINE_*
+static const struct buddy_engine *const engines[] = {
+    [BUDDY_ENGINE_LIST] = &buddy_list_engine,
+    [BUDDY_ENGINE_NB] = &buddy_nb_engine,
+    [BUDDY_ENGINE_TREE] = &buddy_tree_engine,
+    [BUDDY_ENGINE_TLSF] = &buddy_tlsf_engine,
+    [BUDDY_ENGINE_ARENA] = &buddy_arena_engine,
+};
 
-static inline int pages_for_rank(int rank) {
-    return 1 << (rank - 1);
-}
+#define NR_ENGINES ((int)(sizeof(engines) / sizeof(engines[0])))
+
+// With BUDDY_TRACE every call to the default-pool interface below is
+// recorded, see buddy_trace.h; otherwise the arguments are not evaluated
+#if BUDDY_TRACE
+#define trace_pool(p, pgcount) buddy_trace_pool(p, pgcount)
+#define trace_op(op, arg, ret) buddy_trace_record(op, arg, ret)
+#define trace_begin(op, arg, ret) buddy_trace_begin(op, arg, ret)
+#define trace_item(arg, ret) buddy_trace_item(arg, ret)
+#define trace_end() buddy_trace_end()
+#define trace_page(p) buddy_trace_page(p)
+#else
+#define trace_pool(p, pgcount) ((void)0)
+#define trace_op(op, arg, ret) ((void)0)
+#define trace_begin(op, arg, ret) ((void)0)
+#define trace_item(arg, ret) ((void)0)
+#define trace_end() ((void)0)
+#endif
+
+#if BUDDY_STATS
+// Counter slot of the calling thread, 0 while unassigned.  Threads past
+// the owned slots get BUDDY_STATS_SLOTS, which stat_slot() maps to 0.
+__thread unsigned int buddy_stats_slot;
+static unsigned int next_stats_slot;
 
-static inline int page_index(void *p) {
-    return ((char*)p - (char*)base_addr) / PAGE_SIZE;
+unsigned int buddy_stats_slot_assign(void) {
+    unsigned int slot = __atomic_add_fetch(&next_stats_slot, 1,
+                                           __ATOMIC_RELAXED);
+    buddy_stats_slot = slot < BUDDY_STATS_SLOTS ? slot : BUDDY_STATS_SLOTS;
+    return buddy_stats_slot;
 }
+#endif
 
-static inline void *page_addr(int idx) {
-    return (char*)base_addr + idx * PAGE_SIZE;
+void buddy_stats_init(buddy_pool_t *pool, int shared) {
+#if BUDDY_STATS
+    pool->stats_shared = shared;
+    memset(pool->stats, 0, sizeof(pool->stats));
+#else
+    (void)pool;
+    (void)shared;
+#endif
 }
 
-static inline int get_buddy_index(int idx, int rank) {
-    int pages = pages_for_rank(rank);
-    int block_num = idx / pages;
-    if (block_num % 2 == 0) {
-        return idx + pages;
-    } else {
-        return idx - pages;
+void buddy_stats_add(buddy_pool_t *pool, struct buddy_stats *st) {
+#if BUDDY_STATS
+    for (int i = 0; i < BUDDY_STATS_SLOTS; i++) {
+        const struct buddy_stats *slot = &pool->stats[i].st;
+        for (int rank = 0; rank <= MAX_RANK; rank++) {
+            st->allocs[rank] += __atomic_load_n(&slot->allocs[rank],
+                                                __ATOMIC_RELAXED);
+            st->enospc[rank] += __atomic_load_n(&slot->enospc[rank],
+                                                __ATOMIC_RELAXED);
+        }
+        st->einval += __atomic_load_n(&slot->einval, __ATOMIC_RELAXED);
+        buddy_stats_add_engine(slot, st);
     }
+#else
+    (void)pool;
+    (void)st;
+#endif
 }
 
-static void list_add(free_block_t **head, free_block_t *node) {
-    node->next = *head;
-    node->prev = NULL;
-    if (*head) {
-        (*head)->prev = node;
+void buddy_stats_add_engine(const struct buddy_stats *from,
+                            struct buddy_stats *st) {
+    for (int rank = 0; rank <= MAX_RANK; rank++) {
+        st->frees[rank] += __atomic_load_n(&from->frees[rank],
+                                           __ATOMIC_RELAXED);
+        st->splits[rank] += __atomic_load_n(&from->splits[rank],
+                                            __ATOMIC_RELAXED);
+        st->merges[rank] += __atomic_load_n(&from->merges[rank],
+                                            __ATOMIC_RELAXED);
+    }
+    int depth = __atomic_load_n(&from->max_merge_depth, __ATOMIC_RELAXED);
+    if (depth > st->max_merge_depth) {
+        st->max_merge_depth = depth;
     }
-    *head = node;
 }
 
-static void list_remove(free_block_t **head, free_block_t *node) {
-    if (node->prev) {
-        node->prev->next = node->next;
-    } else {
-        *head = node->next;
+// Count the outcome of an allocation of the given rank
+static void count_alloc(buddy_pool_t *pool, int rank, void *p) {
+    (void)rank;                 // Unused when BUDDY_STATS is 0
+    if (!IS_ERR(p)) {
+        stat_add(pool, allocs[rank], 1);
+    } else if (PTR_ERR(p) == -ENOSPC) {
+        stat_add(pool, enospc[rank], 1);
+    } else if (PTR_ERR(p) == -EINVAL) {
+        stat_add(pool, einval, 1);
     }
-    if (node->next) {
-        node->next->prev = node->prev;
+}
+
+static inline int count_einval(buddy_pool_t *pool, int ret) {
+    if (ret == -EINVAL) {
+        stat_add(pool, einval, 1);
     }
+    return ret;
 }
 
-int init_page(void *p, int pgcount) {
-    base_addr = p;
-    total_pages = pgcount;
-    
-    // Initialize free lists
-    for (int i = 0; i <= MAX_RANK; i++) {
-        free_lists[i] = NULL;
+// Backs the init_page()/alloc_pages()/... interface.  Created by the first
+// init_page() and reset in place by later ones.
+static buddy_pool_t *default_pool;
+
+buddy_pool_t *buddy_pool_create_engine(void *p, long pgcount, int flags,
+                                       int engine) {
+    if (p == NULL || pgcount <= 0 ||
+        (flags & ~(BUDDY_POOL_CARVE_METADATA | BUDDY_POOL_SHARED)) ||
+        engine < 0 || engine >= NR_ENGINES) {
+        return ERR_PTR(-EINVAL);
     }
     
-    // Initialize page rank map
-    for (int i = 0; i < pgcount; i++) {
-        page_rank_map[i] = 0;
-        page_allocated[i] = 0;
+    // Only a carved list pool keeps nothing process-local in the region
+    if ((flags & BUDDY_POOL_SHARED) &&
+        (engine != BUDDY_ENGINE_LIST || !(flags & BUDDY_POOL_CARVE_METADATA))) {
+        return ERR_PTR(-EINVAL);
     }
     
-    // Build free blocks from largest to smallest
-    int idx = 0;
-    while (idx < pgcount) {
-        // Find largest rank that fits
-        int rank = MAX_RANK;
-        int pages = pages_for_rank(rank);
-        while (pages > pgcount - idx) {
-            rank--;
-            pages = pages_for_rank(rank);
-        }
-        
-        // Add this block to free list
-        free_block_t *block = (free_block_t*)page_addr(idx);
-        list_add(&free_lists[rank], block);
-        
-        // Mark pages
-        for (int i = 0; i < pages; i++) {
-            page_rank_map[idx + i] = rank;
-            page_allocated[idx + i] = 0;
-        }
-        
-        idx += pages;
+    buddy_pool_t *pool = engines[engine]->create(p, pgcount, flags);
+    if (!IS_ERR(pool)) {
+        pool->engine = engines[engine];
+        buddy_stats_init(pool, 0);
+    }
+    return pool;
+}
+
+buddy_pool_t *buddy_pool_create_arenas(void *p, long pgcount, int flags,
+                                       int narenas) {
+    if (p == NULL || pgcount <= 0 ||
+        (flags & ~BUDDY_POOL_CARVE_METADATA) ||
+        narenas < 1 || narenas > BUDDY_MAX_ARENAS) {
+        return ERR_PTR(-EINVAL);
     }
     
-    return OK;
+    buddy_pool_t *pool = buddy_arena_create(p, pgcount, flags, narenas);
+    if (!IS_ERR(pool)) {
+        pool->engine = &buddy_arena_engine;
+        buddy_stats_init(pool, 0);
+    }
+    return pool;
 }
 
-void *alloc_pages(int rank) {
+buddy_pool_t *buddy_pool_create(void *p, long pgcount, int flags) {
+    return buddy_pool_create_engine(p, pgcount, flags, BUDDY_DEFAULT_ENGINE);
+}
+
+void buddy_pool_destroy(buddy_pool_t *pool) {
+    pool->engine->destroy(pool);
+}
+
+const char *buddy_pool_engine_name(buddy_pool_t *pool) {
+    return pool->engine->name;
+}
+
+static void *pool_alloc(buddy_pool_t *pool, int rank) {
+    if (pool->engine->alloc == NULL) {
+        return pool->engine->alloc_npages(pool, pages_for_rank(rank));
+    }
+    return pool->engine->alloc(pool, rank);
+}
+
+void *buddy_pool_alloc(buddy_pool_t *pool, int rank) {
     if (rank < 1 || rank > MAX_RANK) {
+        count_einval(pool, -EINVAL);
         return ERR_PTR(-EINVAL);
     }
     
-    // Find the smallest available block >= rank
-    int current_rank = rank;
-    while (current_rank <= MAX_RANK && free_lists[current_rank] == NULL) {
-        current_rank++;
+    void *p = pool_alloc(pool, rank);
+    count_alloc(pool, rank, p);
+    return p;
+}
+
+void *buddy_pool_alloc_npages(buddy_pool_t *pool, long npages) {
+    if (npages < 1) {
+        count_einval(pool, -EINVAL);
+        return ERR_PTR(-EINVAL);
+    }
+    
+    // Round up to the smallest rank that holds npages
+    int rank = 1;
+    while (rank < MAX_RANK && pages_for_rank(rank) < npages) {
+        rank++;
+    }
+    
+    void *p;
+    if (pool->engine->alloc_npages != NULL) {
+        p = pool->engine->alloc_npages(pool, npages);
+    } else if (pages_for_rank(rank) < npages) {
+        p = ERR_PTR(-EINVAL);
+    } else {
+        p = pool->engine->alloc(pool, rank);
+    }
+    count_alloc(pool, rank, p);
+    return p;
+}
+
+int buddy_pool_alloc_bulk(buddy_pool_t *pool, int rank, int n, void **out) {
+    if (rank < 1 || rank > MAX_RANK || n < 0) {
+        return count_einval(pool, -EINVAL);
+    }
+    
+    int got = 0;
+    if (pool->engine->alloc_bulk != NULL) {
+        got = pool->engine->alloc_bulk(pool, rank, n, out);
+    } else {
+        while (got < n) {
+            void *p = pool_alloc(pool, rank);
+            if (IS_ERR(p)) {
+                break;
+            }
+            out[got++] = p;
+        }
+    }
+    stat_add(pool, allocs[rank], got);
+    if (got < n) {
+        stat_add(pool, enospc[rank], 1);
+    }
+    return got;
+}
+
+int buddy_pool_free(buddy_pool_t *pool, void *p) {
+    return count_einval(pool, pool->engine->free(pool, p));
+}
+
+int buddy_pool_free_bulk(buddy_pool_t *pool, void **ptrs, int n) {
+    if (n < 0) {
+        return count_einval(pool, -EINVAL);
     }
     
-    if (current_rank > MAX_RANK) {
-        return ERR_PTR(-ENOSPC);
+    return count_einval(pool, pool->engine->free_bulk(pool, ptrs, n));
+}
+
+int buddy_pool_query_ranks(buddy_pool_t *pool, void *p) {
+    return count_einval(pool, pool->engine->query_ranks(pool, p));
+}
+
+int buddy_pool_query_page_counts(buddy_pool_t *pool, int rank) {
+    if (rank < 1 || rank > MAX_RANK) {
+        return count_einval(pool, -EINVAL);
     }
     
-    // Remove block from free list
-    free_block_t *block = free_lists[current_rank];
-    list_remove(&free_lists[current_rank], block);
+    int counts[MAX_RANK + 1];
+    pool->engine->query_counts(pool, counts);
+    return counts[rank];
+}
+
+int buddy_pool_query_all_page_counts(buddy_pool_t *pool,
+                                     int out[MAX_RANK + 1]) {
+    pool->engine->query_counts(pool, out);
     
-    int idx = page_index(block);
+    return OK;
+}
+
+int buddy_pool_query_largest_free_rank(buddy_pool_t *pool) {
+    if (pool->engine->largest_rank != NULL) {
+        return pool->engine->largest_rank(pool);
+    }
     
-    // Split block if necessary
-    while (current_rank > rank) {
-        current_rank--;
-        int buddy_idx = idx + pages_for_rank(current_rank);
-        free_block_t *buddy = (free_block_t*)page_addr(buddy_idx);
-        list_add(&free_lists[current_rank], buddy);
-        
-        // Mark buddy pages as free with the new rank
-        int buddy_pages = pages_for_rank(current_rank);
-        for (int i = 0; i < buddy_pages; i++) {
-            page_rank_map[buddy_idx + i] = current_rank;
-            page_allocated[buddy_idx + i] = 0;
+    int counts[MAX_RANK + 1];
+    pool->engine->query_counts(pool, counts);
+    for (int rank = MAX_RANK; rank >= 1; rank--) {
+        if (counts[rank] > 0) {
+            return rank;
         }
     }
+    return 0;
+}
+
+int buddy_pool_get_stats(buddy_pool_t *pool, struct buddy_pool_stats *st) {
+    pool->engine->stats(pool, st);
     
-    // Mark allocated pages
-    int pages = pages_for_rank(rank);
-    for (int i = 0; i < pages; i++) {
-        page_rank_map[idx + i] = rank;
-        page_allocated[idx + i] = 1;
+    return OK;
+}
+
+// Unusable free space and Linux's fragmentation index, in thousandths, for
+// every rank from the free block counts
+static void frag_from_counts(const int counts[MAX_RANK + 1],
+                             struct buddy_frag_info *fi) {
+    long free_pages = 0, free_blocks = 0;
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        free_pages += counts[rank] * pages_for_rank(rank);
+        free_blocks += counts[rank];
     }
     
-    return block;
+    fi->unusable[0] = 0;
+    fi->frag_index[0] = 0;
+    long fit_pages = 0, fit_blocks = 0;
+    for (int rank = MAX_RANK; rank >= 1; rank--) {
+        fit_pages += counts[rank] * pages_for_rank(rank);
+        fit_blocks += counts[rank];
+        if (free_pages == 0) {
+            fi->unusable[rank] = 0;
+            fi->frag_index[rank] = 0;
+            continue;
+        }
+        fi->unusable[rank] = (free_pages - fit_pages) * 1000 / free_pages;
+        if (fit_blocks > 0) {
+            fi->frag_index[rank] = -1000;
+        } else {
+            fi->frag_index[rank] = 1000 - (1000 + free_pages * 1000 /
+                                           pages_for_rank(rank)) / free_blocks;
+        }
+    }
 }
 
-int return_pages(void *p) {
-    if (p == NULL || (char*)p < (char*)base_addr || 
-        (char*)p >= (char*)base_addr + total_pages * PAGE_SIZE) {
+int buddy_pool_get_frag_info(buddy_pool_t *pool, struct buddy_frag_info *fi) {
+    struct buddy_pool_stats st;
+    int counts[MAX_RANK + 1];
+    pool->engine->stats(pool, &st);
+    pool->engine->query_counts(pool, counts);
+    fi->free_pages = st.free_pages;
+    fi->largest_free_pages = st.largest_free_pages;
+    frag_from_counts(counts, fi);
+    
+    return OK;
+}
+
+static int format_buddyinfo(const char *name, const int counts[MAX_RANK + 1],
+                            char *buf, size_t size) {
+    char line[32 + MAX_RANK * 12];
+    int len = sprintf(line, "%-5.16s", name);
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        len += sprintf(line + len, " %6d", counts[rank]);
+    }
+    return snprintf(buf, size, "%s\n", line);
+}
+
+int buddy_pool_format_buddyinfo(buddy_pool_t *pool, char *buf, size_t size) {
+    int counts[MAX_RANK + 1];
+    pool->engine->query_counts(pool, counts);
+    return format_buddyinfo(pool->engine->name, counts, buf, size);
+}
+
+int buddy_pool_set_pcp(buddy_pool_t *pool, int high, int low) {
+    if (high < 0 || (high > 0 && (low < 1 || low > high))) {
         return -EINVAL;
     }
     
-    int idx = page_index(p);
-    if (idx < 0 || idx >= total_pages) {
+    if (pool->engine->set_pcp == NULL) {
+        return high == 0 ? OK : -EINVAL;
+    }
+    return pool->engine->set_pcp(pool, high, low);
+}
+
+void buddy_pool_drain_pcp(buddy_pool_t *pool) {
+    if (pool->engine->drain_pcp != NULL) {
+        pool->engine->drain_pcp(pool);
+    }
+}
+
+int buddy_pool_set_chunks(buddy_pool_t *pool, int on) {
+    if (pool->engine->set_chunks == NULL) {
+        return on ? -EINVAL : OK;
+    }
+    return pool->engine->set_chunks(pool, on);
+}
+
+int buddy_pool_set_lazy(buddy_pool_t *pool, int high) {
+    if (high < 0) {
         return -EINVAL;
     }
     
-    // Check if page is aligned
-    if (((char*)p - (char*)base_addr) % PAGE_SIZE != 0) {
-        return -EINVAL;
+    if (pool->engine->set_lazy == NULL) {
+        return high == 0 ? OK : -EINVAL;
+    }
+    return pool->engine->set_lazy(pool, high);
+}
+
+int buddy_pool_coalesce_all(buddy_pool_t *pool) {
+    if (pool->engine->coalesce != NULL) {
+        pool->engine->coalesce(pool);
     }
     
-    if (!page_allocated[idx]) {
-        return -EINVAL;
+    return OK;
+}
+
+int buddy_pool_get_counters(buddy_pool_t *pool, struct buddy_stats *st) {
+    memset(st, 0, sizeof(*st));
+#if BUDDY_STATS
+    buddy_stats_add(pool, st);
+    if (pool->engine->counters != NULL) {
+        pool->engine->counters(pool, st);
     }
     
-    int rank = page_rank_map[idx];
-    if (rank < 1 || rank > MAX_RANK) {
+    return OK;
+#else
+    (void)pool;
+    return -EINVAL;
+#endif
+}
+
+static int init_default(void *p, int pgcount) {
+    if (pgcount < 0) {
         return -EINVAL;
     }
     
-    // Merge with buddy if possible
-    while (rank < MAX_RANK) {
-        int buddy_idx = get_buddy_index(idx, rank);
-        
-        // Check if buddy exists
-        if (buddy_idx < 0 || buddy_idx >= total_pages) {
-            break;
-        }
-        
-        int pages = pages_for_rank(rank);
-        if (buddy_idx + pages > total_pages) {
-            break;
-        }
-        
-        // Check if buddy is free and has same rank
-        if (page_allocated[buddy_idx] || page_rank_map[buddy_idx] != rank) {
-            break;
-        }
-        
-        // Remove buddy from free list
-        free_block_t *buddy = (free_block_t*)page_addr(buddy_idx);
-        list_remove(&free_lists[rank], buddy);
-        
-        // Merge with buddy
-        if (buddy_idx < idx) {
-            idx = buddy_idx;
-        }
-        rank++;
+    const struct buddy_engine *engine = engines[BUDDY_DEFAULT_ENGINE];
+    if (default_pool != NULL && default_pool->engine == engine) {
+        buddy_stats_init(default_pool, 0);
+        return default_pool->engine->reset(default_pool, p, pgcount);
     }
     
-    // Add to free list
-    free_block_t *block = (free_block_t*)page_addr(idx);
-    list_add(&free_lists[rank], block);
+    // Leave a shared default pool for a private one
+    if (default_pool != NULL) {
+        buddy_pool_destroy(default_pool);
+        default_pool = NULL;
+    }
     
-    // Mark as free
-    int pages = pages_for_rank(rank);
-    for (int i = 0; i < pages; i++) {
-        page_rank_map[idx + i] = rank;
-        page_allocated[idx + i] = 0;
+    buddy_pool_t *pool = engine->create(p, pgcount, 0);
+    if (IS_ERR(pool)) {
+        return PTR_ERR(pool);
     }
+    pool->engine = engine;
+    buddy_stats_init(pool, 0);
+    default_pool = pool;
     
     return OK;
 }
 
-int query_ranks(void *p) {
-    if (p == NULL || (char*)p < (char*)base_addr || 
-        (char*)p >= (char*)base_addr + total_pages * PAGE_SIZE) {
+int init_page(void *p, int pgcount) {
+    int ret = init_default(p, pgcount);
+    if (ret == OK) {
+        trace_pool(p, pgcount);
+    }
+    trace_op(BUDDY_TRACE_INIT, pgcount, ret);
+    return ret;
+}
+
+int init_page_shared(const char *name, int pgcount) {
+    if (pgcount < 0) {
         return -EINVAL;
     }
     
-    int idx = page_index(p);
-    if (idx < 0 || idx >= total_pages) {
-        return -EINVAL;
+    buddy_pool_t *pool = pgcount > 0 ? buddy_pool_create_shared(name, pgcount)
+                                     : buddy_pool_attach_shared(name);
+    if (IS_ERR(pool)) {
+        return PTR_ERR(pool);
+    }
+    if (default_pool != NULL) {
+        buddy_pool_destroy(default_pool);
     }
+    default_pool = pool;
     
-    return page_rank_map[idx];
+    return OK;
+}
+
+// Before the first init_page() the default pool is empty
+void *alloc_pages(int rank) {
+    void *p;
+    if (default_pool == NULL) {
+        p = ERR_PTR(rank < 1 || rank > MAX_RANK ? -EINVAL : -ENOSPC);
+    } else {
+        p = buddy_pool_alloc(default_pool, rank);
+    }
+    trace_op(BUDDY_TRACE_ALLOC, rank, IS_ERR(p) ? PTR_ERR(p) : trace_page(p));
+    return p;
+}
+
+void *alloc_npages(long npages) {
+    void *p;
+    if (default_pool == NULL) {
+        p = ERR_PTR(npages < 1 ? -EINVAL : -ENOSPC);
+    } else {
+        p = buddy_pool_alloc_npages(default_pool, npages);
+    }
+    trace_op(BUDDY_TRACE_ALLOC_NPAGES, npages,
+             IS_ERR(p) ? PTR_ERR(p) : trace_page(p));
+    return p;
+}
+
+int alloc_pages_bulk(int rank, int n, void **out) {
+    int ret;
+    if (default_pool == NULL) {
+        ret = rank < 1 || rank > MAX_RANK || n < 0 ? -EINVAL : 0;
+    } else {
+        ret = buddy_pool_alloc_bulk(default_pool, rank, n, out);
+    }
+    trace_begin(BUDDY_TRACE_ALLOC_BULK, rank, ret);
+    trace_item(n, 0);
+    for (int i = 0; i < ret; i++) {
+        trace_item(i, trace_page(out[i]));
+    }
+    trace_end();
+    return ret;
+}
+
+int return_pages(void *p) {
+    int ret = default_pool == NULL ? -EINVAL : buddy_pool_free(default_pool, p);
+    trace_op(BUDDY_TRACE_FREE, trace_page(p), ret);
+    return ret;
+}
+
+int return_pages_bulk(void **ptrs, int n) {
+    int ret;
+    if (default_pool == NULL) {
+        ret = n == 0 ? OK : -EINVAL;
+    } else {
+        ret = buddy_pool_free_bulk(default_pool, ptrs, n);
+    }
+    trace_begin(BUDDY_TRACE_FREE_BULK, n, ret);
+    for (int i = 0; i < n; i++) {
+        trace_item(trace_page(ptrs[i]), 0);
+    }
+    trace_end();
+    return ret;
+}
+
+int query_ranks(void *p) {
+    int ret = default_pool == NULL ? -EINVAL
+                                   : buddy_pool_query_ranks(default_pool, p);
+    trace_op(BUDDY_TRACE_QRANK, trace_page(p), ret);
+    return ret;
 }
 
 int query_page_counts(int rank) {
-    if (rank < 1 || rank > MAX_RANK) {
-        return -EINVAL;
+    int ret;
+    if (default_pool == NULL) {
+        ret = rank < 1 || rank > MAX_RANK ? -EINVAL : 0;
+    } else {
+        ret = buddy_pool_query_page_counts(default_pool, rank);
     }
-    
-    int count = 0;
-    free_block_t *current = free_lists[rank];
-    while (current != NULL) {
-        count++;
-        current = current->next;
+    trace_op(BUDDY_TRACE_QCOUNT, rank, ret);
+    return ret;
+}
+
+int query_all_page_counts(int out[MAX_RANK + 1]) {
+    if (default_pool == NULL) {
+        for (int i = 0; i <= MAX_RANK; i++) {
+            out[i] = 0;
+        }
+    } else {
+        buddy_pool_query_all_page_counts(default_pool, out);
     }
-    
-    return count;
+    trace_begin(BUDDY_TRACE_QALL, 0, OK);
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        trace_item(rank, out[rank]);
+    }
+    trace_end();
+    return OK;
+}
+
+int query_largest_free_rank(void) {
+    int ret = 0;
+    if (default_pool != NULL) {
+        ret = buddy_pool_query_largest_free_rank(default_pool);
+    }
+    trace_op(BUDDY_TRACE_QLARGEST, 0, ret);
+    return ret;
+}
+
+long query_free_pages(void) {
+    long ret = 0;
+    if (default_pool != NULL) {
+        struct buddy_pool_stats st;
+        buddy_pool_get_stats(default_pool, &st);
+        ret = st.free_pages;
+    }
+    trace_op(BUDDY_TRACE_QFREE, 0, ret);
+    return ret;
+}
+
+// Before the first init_page() nothing is free
+int buddy_get_frag_info(struct buddy_frag_info *fi) {
+    int ret;
+    if (default_pool == NULL) {
+        memset(fi, 0, sizeof(*fi));
+        ret = OK;
+    } else {
+        ret = buddy_pool_get_frag_info(default_pool, fi);
+    }
+    trace_op(BUDDY_TRACE_FRAG, 0, ret);
+    return ret;
+}
+
+int buddy_format_buddyinfo(char *buf, size_t size) {
+    int ret;
+    if (default_pool == NULL) {
+        int counts[MAX_RANK + 1] = {0};
+        ret = format_buddyinfo(engines[BUDDY_DEFAULT_ENGINE]->name, counts,
+                               buf, size);
+    } else {
+        ret = buddy_pool_format_buddyinfo(default_pool, buf, size);
+    }
+    trace_op(BUDDY_TRACE_BUDDYINFO, size, ret);
+    return ret;
+}
+
+int buddy_set_pcp(int high, int low) {
+    int ret = -EINVAL;
+    if (default_pool != NULL) {
+        ret = buddy_pool_set_pcp(default_pool, high, low);
+    }
+    trace_begin(BUDDY_TRACE_SET_PCP, high, ret);
+    trace_item(low, 0);
+    trace_end();
+    return ret;
+}
+
+void buddy_drain_pcp(void) {
+    if (default_pool != NULL) {
+        buddy_pool_drain_pcp(default_pool);
+    }
+    trace_op(BUDDY_TRACE_DRAIN_PCP, 0, 0);
+}
+
+int buddy_set_chunks(int on) {
+    int ret = -EINVAL;
+    if (default_pool != NULL) {
+        ret = buddy_pool_set_chunks(default_pool, on);
+    }
+    trace_op(BUDDY_TRACE_SET_CHUNKS, on, ret);
+    return ret;
+}
+
+int buddy_set_lazy(int high) {
+    int ret = -EINVAL;
+    if (default_pool != NULL) {
+        ret = buddy_pool_set_lazy(default_pool, high);
+    }
+    trace_op(BUDDY_TRACE_SET_LAZY, high, ret);
+    return ret;
+}
+
+int buddy_coalesce_all(void) {
+    int ret = OK;
+    if (default_pool != NULL) {
+        ret = buddy_pool_coalesce_all(default_pool);
+    }
+    trace_op(BUDDY_TRACE_COALESCE, 0, ret);
+    return ret;
+}
+
+// Before the first init_page() nothing has been counted
+int buddy_get_stats(struct buddy_stats *st) {
+    int ret;
+    if (default_pool == NULL) {
+        memset(st, 0, sizeof(*st));
+        ret = BUDDY_STATS ? OK : -EINVAL;
+    } else {
+        ret = buddy_pool_get_counters(default_pool, st);
+    }
+    trace_op(BUDDY_TRACE_STATS, 0, ret);
+    return ret;
 }
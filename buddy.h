@@ -1,8 +1,13 @@
 #ifndef OS_MM_H
 #define OS_MM_H
+#include <stddef.h>
+
 #define MAX_ERRNO 4095
 
+#define MAX_RANK    16
+
 #define OK          0
+#define ENOMEM      12  /* Out of memory for allocator metadata */
 #define EINVAL      22  /* Invalid argument */    
 #define ENOSPC      28  /* No page left */  
 
@@ -18,5 +23,308 @@ void *alloc_pages(int rank);
 int return_pages(void *p);
 int query_ranks(void *p);
 int query_page_counts(int rank);
+/* Snapshot of query_page_counts() for every rank; out[0] is always 0. */
+int query_all_page_counts(int out[MAX_RANK + 1]);
+/* Largest rank alloc_pages() can currently satisfy, or 0 if no page is free. */
+int query_largest_free_rank(void);
+/* Free pages in the default pool, whatever blocks they are in. */
+long query_free_pages(void);
+/*
+ * Allocate up to n blocks of the given rank in one pass and store their
+ * addresses in out[0..].  Returns how many were allocated, which is less
+ * than n only when the pool runs out, or -EINVAL for a bad rank or n.
+ * Bulk allocations always come straight from the buddy lists.
+ */
+int alloc_pages_bulk(int rank, int n, void **out);
+/*
+ * Free n blocks at once.  ptrs is sorted in place by address.  Either every
+ * pointer is valid and all blocks are freed, or -EINVAL is returned and none
+ * are.  The resulting free lists hold the same blocks as freeing them one by
+ * one with return_pages().  Bulk frees bypass the per-thread caches.
+ */
+int return_pages_bulk(void **ptrs, int n);
+/*
+ * Allocate at least npages contiguous pages.  The power-of-two engines
+ * round npages up to the smallest rank that holds it and hand out a whole
+ * block of that rank, which query_ranks() reports and return_pages() frees
+ * as any other; more than 2^(MAX_RANK-1) pages is -EINVAL.  The TLSF engine
+ * hands out exactly npages pages.  Returns ERR_PTR(-EINVAL) for npages <= 0
+ * and ERR_PTR(-ENOSPC) when no free block is large enough, which is always
+ * the case before the first init_page().
+ */
+void *alloc_npages(long npages);
+
+/*
+ * Independent pools.  Each pool manages its own pgcount pages starting at p
+ * with the same semantics as the functions above, which operate on a single
+ * built-in default pool.  buddy_pool_create() returns ERR_PTR(-EINVAL) or
+ * ERR_PTR(-ENOMEM) on failure.
+ *
+ * Page indices are 64-bit, so a pool may span many GiB.  Metadata is sized
+ * from pgcount and malloc()ed unless BUDDY_POOL_CARVE_METADATA is given, in
+ * which case the pool and its metadata are placed in the first pages of the
+ * region; those pages are never handed out and belong to no block.
+ * BUDDY_POOL_SHARED, only valid together with it and on the list engine,
+ * makes the pool's locks process-shared and robust, so a pool carved out
+ * of a MAP_SHARED region can be used from processes forked after it was
+ * created.
+ *
+ * Every pool runs on one engine, chosen when it is created:
+ *   BUDDY_ENGINE_LIST  free lists with per-rank locks and per-thread caches
+ *   BUDDY_ENGINE_NB    lock-free status trees; always the lowest free block
+ *   BUDDY_ENGINE_TREE  largest-free-rank tree; best fit, one lock per pool
+ *   BUDDY_ENGINE_TLSF  two-level segregated fit over runs of any page count
+ *   BUDDY_ENGINE_ARENA list-engine arenas, one per CPU; see below
+ * buddy_pool_create() and the default pool use BUDDY_DEFAULT_ENGINE, which
+ * is BUDDY_ENGINE_LIST unless the library is built with another.
+ *
+ * The TLSF engine does not split blocks into powers of two.  An allocation
+ * of rank r is simply 2^(r-1) pages, not aligned to its size.  It reports a
+ * free run under the largest rank that fits in it, and an allocated block
+ * under the smallest rank that holds it.  query_ranks() only knows about
+ * the first page of a block and returns -EINVAL for any other page.
+ * Allocation takes constant time while a larger size bin has a free run;
+ * when only runs of the request's own bin are left, that bin is walked for
+ * one long enough, so the worst case is linear in the free runs of a bin.
+ * These per-rank semantics differ from the other engines', so TLSF is not
+ * a drop-in default for callers that rely on them.
+ *
+ * The arena engine cuts the pool into up to K address-disjoint arenas of
+ * equal power-of-two size, each a list-engine pool with its own free lists
+ * and locks, so threads in different arenas never contend.  A thread
+ * allocates from the arena of the CPU it runs on, sched_getcpu() modulo K,
+ * and only takes blocks from the others when that one cannot satisfy the
+ * rank; frees find their arena from the address.  Counts are summed over
+ * all arenas.  No block spans two arenas, so the largest allocation is one
+ * arena's size.  K is the number of online CPUs, lowered so that each
+ * arena holds a MAX_RANK block, or narenas with buddy_pool_create_arenas(),
+ * which returns ERR_PTR(-EINVAL) unless 1 <= narenas <= BUDDY_MAX_ARENAS.
+ * BUDDY_POOL_CARVE_METADATA is not supported.
+ */
+typedef struct buddy_pool buddy_pool_t;
+
+#define BUDDY_POOL_CARVE_METADATA 0x1
+#define BUDDY_POOL_SHARED         0x2
+
+#define BUDDY_ENGINE_LIST 0
+#define BUDDY_ENGINE_NB   1
+#define BUDDY_ENGINE_TREE 2
+#define BUDDY_ENGINE_TLSF 3
+#define BUDDY_ENGINE_ARENA 4
+
+#define BUDDY_MAX_ARENAS 64
+
+struct buddy_pool_stats {
+    long total_pages;           /* Pages that can be handed out */
+    long free_pages;
+    long largest_free_pages;    /* Largest block one call can allocate */
+};
+
+buddy_pool_t *buddy_pool_create(void *p, long pgcount, int flags);
+buddy_pool_t *buddy_pool_create_engine(void *p, long pgcount, int flags,
+                                       int engine);
+buddy_pool_t *buddy_pool_create_arenas(void *p, long pgcount, int flags,
+                                       int narenas);
+void buddy_pool_destroy(buddy_pool_t *pool);
+const char *buddy_pool_engine_name(buddy_pool_t *pool);
+void *buddy_pool_alloc(buddy_pool_t *pool, int rank);
+/*
+ * Allocate npages pages.  Power-of-two engines round up to the next rank
+ * and fail with -EINVAL past MAX_RANK; TLSF hands out exactly npages.
+ */
+void *buddy_pool_alloc_npages(buddy_pool_t *pool, long npages);
+int buddy_pool_alloc_bulk(buddy_pool_t *pool, int rank, int n, void **out);
+int buddy_pool_free(buddy_pool_t *pool, void *p);
+int buddy_pool_free_bulk(buddy_pool_t *pool, void **ptrs, int n);
+int buddy_pool_query_ranks(buddy_pool_t *pool, void *p);
+int buddy_pool_query_page_counts(buddy_pool_t *pool, int rank);
+int buddy_pool_query_all_page_counts(buddy_pool_t *pool,
+                                     int out[MAX_RANK + 1]);
+int buddy_pool_query_largest_free_rank(buddy_pool_t *pool);
+int buddy_pool_get_stats(buddy_pool_t *pool, struct buddy_pool_stats *st);
+
+/*
+ * Per-thread page caches for ranks 1..BUDDY_PCP_MAX_RANK.  When enabled,
+ * each thread keeps a private stack of free blocks per small rank.  An empty
+ * cache is refilled with low blocks from the buddy lists in one batch, and a
+ * cache that grows past high blocks is drained back down to low.  A thread's
+ * caches are drained automatically when it exits.  high == 0 turns caching
+ * off (blocks already cached stay put until drained); otherwise
+ * 1 <= low <= high is required.
+ *
+ * A block handed out from one thread's cache and freed by another goes
+ * onto a lock-free remote-free queue of the thread that allocated it, not
+ * into the freeing thread's cache.  The owner takes the whole queue into
+ * its cache on its next allocation, so a producer thread that allocates
+ * and a consumer thread that frees exchange blocks without taking any
+ * lock.  Queues of threads that have exited or stopped caching are emptied
+ * into the buddy lists before an allocation fails.
+ *
+ * Counting rule: a block sitting in a per-thread cache or a remote-free
+ * queue is counted as allocated.  query_page_counts() and
+ * query_all_page_counts() only report it again once it has been drained:
+ * a cached block past the high mark, by buddy_drain_pcp() in the owning
+ * thread, or at thread exit, and a queued block when its owner next
+ * allocates or exits, or when any thread calls buddy_drain_pcp() or
+ * buddy_coalesce_all(), which empty every queue.  query_ranks() reports
+ * the block's own rank.
+ *
+ * Only the list and arena engines have caches; the others reject high > 0
+ * with -EINVAL.
+ */
+#define BUDDY_PCP_MAX_RANK 3
+
+int buddy_pool_set_pcp(buddy_pool_t *pool, int high, int low);
+void buddy_pool_drain_pcp(buddy_pool_t *pool);  /* Calling thread only */
+int buddy_set_pcp(int high, int low);
+void buddy_drain_pcp(void);
+
+/*
+ * Small chunks.  When on, blocks of rank 1..BUDDY_CHUNK_MAX_RANK are carved
+ * out of rank-BUDDY_CHUNK_RANK chunks taken off the buddy lists, using a
+ * bitmap per chunk instead of splitting and merging buddies.  A block goes
+ * to a chunk whose largest free slot fits it most tightly, at the lowest
+ * slot there; a new chunk is reserved only when no chunk has room, and a
+ * chunk goes back to the buddy lists as soon as its last block is freed.
+ * When no whole chunk is free, small blocks come from the buddy lists as
+ * usual.
+ *
+ * Counting rule: a reserved chunk is one allocated rank-BUDDY_CHUNK_RANK
+ * block, free pages inside it included.  query_ranks() reports a block's own
+ * rank, and BUDDY_CHUNK_RANK for a free page inside a chunk.  Per-thread
+ * caches take precedence for the ranks they cover, and bulk allocations
+ * still come from the buddy lists.  Turning chunks off only stops new
+ * blocks from being carved; reserved chunks drain as their blocks are freed.
+ *
+ * Only the list and arena engines have chunks; the others reject on != 0
+ * with -EINVAL.
+ */
+#define BUDDY_CHUNK_RANK     7
+#define BUDDY_CHUNK_MAX_RANK 4
+
+int buddy_pool_set_chunks(buddy_pool_t *pool, int on);
+int buddy_set_chunks(int on);
+
+/*
+ * Lazy coalescing.  With high > 0 a freed block is put back on its free
+ * list unmerged as long as fewer than high blocks of its rank are free, so
+ * a free followed by an allocation of the same rank costs no merge and no
+ * split.  Past that watermark frees merge as usual, also with unmerged
+ * buddies.  An allocation that finds nothing large enough merges every
+ * free pair of buddies before it fails, and buddy_coalesce_all() does so on
+ * demand.  high == 0, the default, merges every free right away; blocks
+ * left unmerged before stay so until coalesced.  return_pages_bulk()
+ * always merges.
+ *
+ * Counting rule: an unmerged free block is counted at its own rank, so
+ * query_page_counts() and query_largest_free_rank() see it as smaller than
+ * the block it would merge into until it is coalesced.
+ *
+ * Only the list and arena engines are lazy; the others reject high > 0
+ * with -EINVAL.
+ */
+int buddy_pool_set_lazy(buddy_pool_t *pool, int high);
+int buddy_pool_coalesce_all(buddy_pool_t *pool);
+int buddy_set_lazy(int high);
+int buddy_coalesce_all(void);
+
+/*
+ * Pools in POSIX shared memory, for processes that exchange page buffers
+ * without copying.  buddy_pool_create_shared() creates the segment name
+ * (as for shm_open(), e.g. "/pages") holding a list-engine pool of pgcount
+ * pages, with its metadata carved from the first of them, plus one header
+ * page.  Any process can then buddy_pool_attach_shared() it and use the
+ * handle like any other pool.  The pool refers to its pages by offsets
+ * only, so every process may map it at a different address; blocks are
+ * passed between processes as buddy_shared_offset() and turned back into
+ * local pointers with buddy_shared_ptr().  Locks are robust: if a process
+ * dies holding one, the next process to take it carries on instead of
+ * waiting forever.  The operation the dead process was in the middle of is
+ * not rolled back, though, so its block may be lost and the free lists it
+ * was changing may be left inconsistent; only processes that die outside
+ * the allocator leave the pool intact.
+ *
+ * buddy_pool_destroy() on a shared pool only detaches this process;
+ * buddy_pool_unlink_shared() removes the name, and the memory goes once
+ * every process has detached.  Shared pools have no per-thread caches.
+ * init_page_shared() makes the segment the default pool, creating it when
+ * pgcount > 0 and attaching to it when pgcount == 0; alloc_pages() and
+ * friends then work on it in every process that did so.
+ *
+ * Creating or attaching returns ERR_PTR(-EINVAL) if the segment already
+ * exists or does not, or is not a pool, and ERR_PTR(-ENOMEM) if it cannot
+ * be sized or mapped.  The offset functions return -EINVAL, or
+ * ERR_PTR(-EINVAL), for a pool that is not shared or an address or offset
+ * outside it.
+ */
+buddy_pool_t *buddy_pool_create_shared(const char *name, long pgcount);
+buddy_pool_t *buddy_pool_attach_shared(const char *name);
+int buddy_pool_unlink_shared(const char *name);
+long buddy_shared_offset(buddy_pool_t *pool, void *p);
+void *buddy_shared_ptr(buddy_pool_t *pool, long offset);
+int init_page_shared(const char *name, int pgcount);
+
+/*
+ * Operation counters.  Every pool counts what is done to it: allocations
+ * and -ENOSPC failures by the rank asked for, frees by the rank of the
+ * block freed, and calls rejected with -EINVAL.  Engines also count the
+ * free blocks they split in two and the blocks they form by merging two
+ * buddies, both by the rank of the block split or formed, and the most
+ * merges a single free has made.  The TLSF engine counts runs by the rank
+ * that holds them, with MAX_RANK standing for every larger run.  The
+ * counters start at zero when a pool is created and when init_page() sets
+ * up the default pool again.  Threads count into slots of their own, and
+ * the slots are summed on reading, so a snapshot taken while other threads
+ * work is not atomic.
+ *
+ * In a shared pool allocations and failures are counted per process, and
+ * frees, splits and merges across all processes.
+ *
+ * Building with -DBUDDY_STATS=0 (`make STATS=0`) compiles the counters
+ * out; the functions then zero st and return -EINVAL.
+ */
+#ifndef BUDDY_STATS
+#define BUDDY_STATS 1
+#endif
+
+struct buddy_stats {
+    unsigned long allocs[MAX_RANK + 1];
+    unsigned long frees[MAX_RANK + 1];
+    unsigned long splits[MAX_RANK + 1];
+    unsigned long merges[MAX_RANK + 1];
+    unsigned long enospc[MAX_RANK + 1];
+    unsigned long einval;
+    int max_merge_depth;
+};
+
+int buddy_pool_get_counters(buddy_pool_t *pool, struct buddy_stats *st);
+int buddy_get_stats(struct buddy_stats *st);
+
+/*
+ * Fragmentation, computed from the per-rank free block counts in the style
+ * of Linux's extfrag debugfs files.  For every rank r, in thousandths:
+ *   unusable[r]    the share of free pages that lie in blocks smaller than
+ *                  rank r, and so cannot serve an allocation of rank r
+ *   frag_index[r]  why an allocation of rank r would fail: towards 0 for
+ *                  lack of memory, towards 1000 for fragmentation, and
+ *                  -1000 when a large enough block is free
+ * Both are 0 when nothing is free.  TLSF runs count as the largest
+ * power-of-two block they hold, so its figures are approximate.
+ *
+ * buddy_pool_format_buddyinfo() writes one line like /proc/buddyinfo, the
+ * engine name followed by the free block count of every rank from 1 up,
+ * and returns its length as snprintf() does.  Neither function allocates.
+ */
+struct buddy_frag_info {
+    long free_pages;
+    long largest_free_pages;
+    int unusable[MAX_RANK + 1];
+    int frag_index[MAX_RANK + 1];
+};
+
+int buddy_pool_get_frag_info(buddy_pool_t *pool, struct buddy_frag_info *fi);
+int buddy_pool_format_buddyinfo(buddy_pool_t *pool, char *buf, size_t size);
+int buddy_get_frag_info(struct buddy_frag_info *fi);
+int buddy_format_buddyinfo(char *buf, size_t size);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+#include "buddy_engine.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Arena engine.  The pool is cut into address-disjoint arenas of
+// 2^arena_shift pages each (the last one may be shorter), and every arena
+// is a free-list pool of its own, with its own free lists and locks.  Since
+// arenas are power-of-two sized and aligned, no buddy pair ever straddles
+// two of them, and the arena of a page is its index >> arena_shift.
+//
+// A thread allocates from the home arena of the CPU it is running on, the
+// CPU number modulo the arena count.  Only when its home arena cannot
+// satisfy a request does it try the others in turn.  Frees, queries
+// and per-arena settings go straight to the arena that holds the address.
+typedef struct arena_pool {
+    struct buddy_pool common;
+    void *base_addr;
+    long total_pages;
+    int arena_shift;
+    int max_arenas;                 // As asked for at creation
+    int nr_arenas;
+    buddy_pool_t *arena[BUDDY_MAX_ARENAS];
+} arena_pool_t;
+
+// Home of the calling thread where the CPU is unknown, bound round robin
+// and 1-based so that 0 means not yet assigned
+static __thread unsigned int thread_home;
+static unsigned int next_home;
+
+static inline arena_pool_t *to_arena(buddy_pool_t *pool) {
+    return (arena_pool_t*)pool;
+}
+
+static int home_arena(arena_pool_t *pool) {
+    int cpu = sched_getcpu();
+    if (cpu >= 0) {
+        return cpu % pool->nr_arenas;
+    }
+    
+    if (thread_home == 0) {
+        thread_home = __atomic_add_fetch(&next_home, 1, __ATOMIC_RELAXED);
+    }
+    return (thread_home - 1) % pool->nr_arenas;
+}
+
+// Arena holding p, or -1 if p lies outside the pool
+static int arena_of(arena_pool_t *pool, void *p) {
+    if (p == NULL || (char*)p < (char*)pool->base_addr ||
+        (char*)p >= (char*)pool->base_addr + pool->total_pages * PAGE_SIZE) {
+        return -1;
+    }
+    long idx = ((char*)p - (char*)pool->base_addr) / PAGE_SIZE;
+    return idx >> pool->arena_shift;
+}
+
+// Cut pgcount pages at p into at most narenas arenas and create them
+static int arenas_build(arena_pool_t *pool, void *p, long pgcount,
+                        int narenas) {
+    int shift = 0;
+    while ((1L << shift) * narenas < pgcount) {
+        shift++;
+    }
+    pool->base_addr = p;
+    pool->total_pages = pgcount;
+    pool->arena_shift = shift;
+    pool->max_arenas = narenas;
+    pool->nr_arenas = 0;
+    for (long start = 0; start < pgcount; start += 1L << shift) {
+        long pages = pgcount - start < (1L << shift) ? pgcount - start
+                                                     : 1L << shift;
+        buddy_pool_t *arena = buddy_pool_create_engine(
+            (char*)p + start * PAGE_SIZE, pages, 0, BUDDY_ENGINE_LIST);
+        if (IS_ERR(arena)) {
+            while (pool->nr_arenas > 0) {
+                buddy_pool_destroy(pool->arena[--pool->nr_arenas]);
+            }
+            return PTR_ERR(arena);
+        }
+        pool->arena[pool->nr_arenas++] = arena;
+    }
+    return OK;
+}
+
+static void arenas_destroy(arena_pool_t *pool) {
+    for (int i = 0; i < pool->nr_arenas; i++) {
+        buddy_pool_destroy(pool->arena[i]);
+    }
+    pool->nr_arenas = 0;
+}
+
+buddy_pool_t *buddy_arena_create(void *p, long pgcount, int flags,
+                                 int narenas) {
+    // Each arena keeps its metadata apart from the pages it manages
+    if (flags & BUDDY_POOL_CARVE_METADATA) {
+        return ERR_PTR(-EINVAL);
+    }
+    
+    arena_pool_t *pool = malloc(sizeof(*pool));
+    if (pool == NULL) {
+        return ERR_PTR(-ENOMEM);
+    }
+    int err = arenas_build(pool, p, pgcount, narenas);
+    if (err != OK) {
+        free(pool);
+        return ERR_PTR(err);
+    }
+    return &pool->common;
+}
+
+// One arena per online CPU, but no more than leaves room in each for a
+// block of MAX_RANK
+static buddy_pool_t *arena_create(void *p, long pgcount, int flags) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > BUDDY_MAX_ARENAS) {
+        cpus = BUDDY_MAX_ARENAS;
+    }
+    if (cpus > pgcount >> (MAX_RANK - 1)) {
+        cpus = pgcount >> (MAX_RANK - 1);
+    }
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    return buddy_arena_create(p, pgcount, flags, cpus);
+}
+
+static int arena_reset(buddy_pool_t *bp, void *p, long pgcount) {
+    arena_pool_t *pool = to_arena(bp);
+    arenas_destroy(pool);
+    
+    return arenas_build(pool, p, pgcount, pool->max_arenas);
+}
+
+static void arena_destroy(buddy_pool_t *bp) {
+    arena_pool_t *pool = to_arena(bp);
+    arenas_destroy(pool);
+    free(pool);
+}
+
+static void *arena_alloc(buddy_pool_t *bp, int rank) {
+    arena_pool_t *pool = to_arena(bp);
+    if (pool->nr_arenas == 0) {
+        return ERR_PTR(-ENOSPC);
+    }
+    
+    // Home arena first, then steal from the others in turn
+    int home = home_arena(pool);
+    void *p = ERR_PTR(-ENOSPC);
+    for (int i = 0; i < pool->nr_arenas; i++) {
+        p = buddy_pool_alloc(pool->arena[(home + i) % pool->nr_arenas], rank);
+        if (!IS_ERR(p)) {
+            break;
+        }
+    }
+    return p;
+}
+
+static int arena_alloc_bulk(buddy_pool_t *bp, int rank, int n, void **out) {
+    arena_pool_t *pool = to_arena(bp);
+    if (pool->nr_arenas == 0) {
+        return 0;
+    }
+    
+    int home = home_arena(pool);
+    int got = 0;
+    for (int i = 0; i < pool->nr_arenas && got < n; i++) {
+        got += buddy_pool_alloc_bulk(pool->arena[(home + i) % pool->nr_arenas],
+                                     rank, n - got, out + got);
+    }
+    return got;
+}
+
+static int arena_free(buddy_pool_t *bp, void *p) {
+    arena_pool_t *pool = to_arena(bp);
+    int a = arena_of(pool, p);
+    if (a < 0) {
+        return -EINVAL;
+    }
+    return buddy_pool_free(pool->arena[a], p);
+}
+
+// Sorted by address, the pointers of each arena form one run.  Every run is
+// checked, with its arena locked, before any is freed, and arenas are
+// locked in address order like the runs.
+static int arena_free_bulk(buddy_pool_t *bp, void **ptrs, int n) {
+    arena_pool_t *pool = to_arena(bp);
+    for (int i = 0; i < n; i++) {
+        if (arena_of(pool, ptrs[i]) < 0) {
+            return -EINVAL;
+        }
+    }
+    qsort(ptrs, n, sizeof(void*), ptr_cmp);
+    
+    buddy_pool_t *arena[BUDDY_MAX_ARENAS];
+    int start[BUDDY_MAX_ARENAS + 1];
+    int runs = 0;
+    for (int i = 0; i < n; i++) {
+        int a = arena_of(pool, ptrs[i]);
+        if (runs == 0 || arena[runs - 1] != pool->arena[a]) {
+            arena[runs] = pool->arena[a];
+            start[runs++] = i;
+        }
+    }
+    start[runs] = n;
+    
+    for (int r = 0; r < runs; r++) {
+        int ret = buddy_list_free_bulk_begin(arena[r], ptrs + start[r],
+                                             start[r + 1] - start[r]);
+        if (ret != OK) {
+            while (r > 0) {
+                buddy_list_free_bulk_cancel(arena[--r]);
+            }
+            return ret;
+        }
+    }
+    for (int r = 0; r < runs; r++) {
+        buddy_list_free_bulk_commit(arena[r], ptrs + start[r],
+                                    start[r + 1] - start[r]);
+    }
+    return OK;
+}
+
+static int arena_query_ranks(buddy_pool_t *bp, void *p) {
+    arena_pool_t *pool = to_arena(bp);
+    int a = arena_of(pool, p);
+    if (a < 0) {
+        return -EINVAL;
+    }
+    return buddy_pool_query_ranks(pool->arena[a], p);
+}
+
+static void arena_query_counts(buddy_pool_t *bp, int out[MAX_RANK + 1]) {
+    arena_pool_t *pool = to_arena(bp);
+    for (int r = 0; r <= MAX_RANK; r++) {
+        out[r] = 0;
+    }
+    for (int i = 0; i < pool->nr_arenas; i++) {
+        int counts[MAX_RANK + 1];
+        buddy_pool_query_all_page_counts(pool->arena[i], counts);
+        for (int r = 1; r <= MAX_RANK; r++) {
+            out[r] += counts[r];
+        }
+    }
+}
+
+static int arena_largest_rank(buddy_pool_t *bp) {
+    arena_pool_t *pool = to_arena(bp);
+    int largest = 0;
+    for (int i = 0; i < pool->nr_arenas; i++) {
+        int rank = buddy_pool_query_largest_free_rank(pool->arena[i]);
+        if (rank > largest) {
+            largest = rank;
+        }
+    }
+    return largest;
+}
+
+static void arena_stats(buddy_pool_t *bp, struct buddy_pool_stats *st) {
+    arena_pool_t *pool = to_arena(bp);
+    int counts[MAX_RANK + 1];
+    arena_query_counts(bp, counts);
+    stats_from_counts(counts, st);
+    st->total_pages = 0;
+    for (int i = 0; i < pool->nr_arenas; i++) {
+        struct buddy_pool_stats arena_st;
+        buddy_pool_get_stats(pool->arena[i], &arena_st);
+        st->total_pages += arena_st.total_pages;
+    }
+}
+
+static int arena_set_pcp(buddy_pool_t *bp, int high, int low) {
+    arena_pool_t *pool = to_arena(bp);
+    for (int i = 0; i < pool->nr_arenas; i++) {
+        int ret = buddy_pool_set_pcp(pool->arena[i], high, low);
+        if (ret != OK) {
+            return ret;
+        }
+    }
+    return OK;
+}
+
+static void arena_drain_pcp(buddy_pool_t *bp) {
+    arena_pool_t *pool = to_arena(bp);
+    for (int i = 0; i < pool->nr_arenas; i++) {
+        buddy_pool_drain_pcp(pool->arena[i]);
+    }
+}
+
+static int arena_set_chunks(buddy_pool_t *bp, int on) {
+    arena_pool_t *pool = to_arena(bp);
+    for (int i = 0; i < pool->nr_arenas; i++) {
+        buddy_pool_set_chunks(pool->arena[i], on);
+    }
+    return OK;
+}
+
+static int arena_set_lazy(buddy_pool_t *bp, int high) {
+    arena_pool_t *pool = to_arena(bp);
+    for (int i = 0; i < pool->nr_arenas; i++) {
+        buddy_pool_set_lazy(pool->arena[i], high);
+    }
+    return OK;
+}
+
+static void arena_coalesce(buddy_pool_t *bp) {
+    arena_pool_t *pool = to_arena(bp);
+    for (int i = 0; i < pool->nr_arenas; i++) {
+        buddy_pool_coalesce_all(pool->arena[i]);
+    }
+}
+
+// Frees, splits and merges happen in the arenas
+static void arena_counters(buddy_pool_t *bp, struct buddy_stats *st) {
+    arena_pool_t *pool = to_arena(bp);
+    for (int i = 0; i < pool->nr_arenas; i++) {
+        struct buddy_stats arena;
+        buddy_pool_get_counters(pool->arena[i], &arena);
+        buddy_stats_add_engine(&arena, st);
+    }
+}
+
+const struct buddy_engine buddy_arena_engine = {
+    .name = "arena",
+    .create = arena_create,
+    .reset = arena_reset,
+    .destroy = arena_destroy,
+    .alloc = arena_alloc,
+    .alloc_bulk = arena_alloc_bulk,
+    .free = arena_free,
+    .free_bulk = arena_free_bulk,
+    .query_ranks = arena_query_ranks,
+    .query_counts = arena_query_counts,
+    .largest_rank = arena_largest_rank,
+    .stats = arena_stats,
+    .set_pcp = arena_set_pcp,
+    .drain_pcp = arena_drain_pcp,
+    .set_chunks = arena_set_chunks,
+    .set_lazy = arena_set_lazy,
+    .coalesce = arena_coalesce,
+    .counters = arena_counters,
+};
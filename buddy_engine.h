@@ -0,0 +1,197 @@
+#ifndef BUDDY_ENGINE_H
+#define BUDDY_ENGINE_H
+
+#include "buddy.h"
+
+#define PAGE_SIZE 4096
+
+#define NO_PAGE (-1)
+
+/*
+ * Allocator engines.  buddy.c implements the buddy.h interface once and
+ * dispatches every call through the pool's engine.  Each engine embeds
+ * struct buddy_pool as the first member of its own pool structure.
+ *
+ * buddy.c validates arguments before calling in: ranks are 1..MAX_RANK,
+ * counts are non-negative and npages is positive.  Pointers are passed
+ * through unchecked.  Optional operations may be NULL:
+ *   alloc / alloc_npages  at least one must be set; the other is emulated
+ *                         by rounding npages up to a rank, or by asking for
+ *                         exactly the pages of a rank
+ *   alloc_bulk            emulated by calling alloc repeatedly
+ *   largest_rank          found from query_counts
+ *   set_pcp / drain_pcp   the engine has no per-thread caches
+ *   set_chunks            the engine has no small chunks
+ *   set_lazy / coalesce   the engine always merges on free
+ *   counters              the pool counts everything itself; set by pools
+ *                         built on others to add the frees, splits and
+ *                         merges counted by those
+ *
+ * buddy.c counts allocations, -ENOSPC failures and -EINVAL rejections;
+ * engines count frees, splits, merges and merge depth with stat_add() and
+ * stat_depth(), which compile to nothing when BUDDY_STATS is 0.  The first
+ * BUDDY_STATS_SLOTS - 1 threads each own a slot and count into it with
+ * plain loads and stores; later threads, and every thread of a pool shared
+ * between processes, share slot 0 and count with atomic adds.
+ */
+#define BUDDY_STATS_SLOTS 16
+struct buddy_pool {
+    const struct buddy_engine *engine;
+#if BUDDY_STATS
+    int stats_shared;               /* Count everything into slot 0 */
+    struct buddy_stats_slot {
+        struct buddy_stats st;
+        char pad[64 - sizeof(struct buddy_stats) % 64];
+    } stats[BUDDY_STATS_SLOTS];
+#endif
+};
+
+struct buddy_engine {
+    const char *name;
+
+    /* Set up a pool over pgcount (>= 0) pages at p, ERR_PTR() on failure */
+    buddy_pool_t *(*create)(void *p, long pgcount, int flags);
+    /* Start over on new memory, reusing the metadata when it is big enough */
+    int (*reset)(buddy_pool_t *pool, void *p, long pgcount);
+    void (*destroy)(buddy_pool_t *pool);
+
+    void *(*alloc)(buddy_pool_t *pool, int rank);
+    void *(*alloc_npages)(buddy_pool_t *pool, long npages);
+    int (*alloc_bulk)(buddy_pool_t *pool, int rank, int n, void **out);
+    int (*free)(buddy_pool_t *pool, void *p);
+    int (*free_bulk)(buddy_pool_t *pool, void **ptrs, int n);
+
+    int (*query_ranks)(buddy_pool_t *pool, void *p);
+    /* Free block count per rank; out[0] is set to 0 */
+    void (*query_counts)(buddy_pool_t *pool, int out[MAX_RANK + 1]);
+    /* Highest rank with a free block counted by query_counts, or 0 */
+    int (*largest_rank)(buddy_pool_t *pool);
+    void (*stats)(buddy_pool_t *pool, struct buddy_pool_stats *st);
+
+    int (*set_pcp)(buddy_pool_t *pool, int high, int low);
+    void (*drain_pcp)(buddy_pool_t *pool);
+    int (*set_chunks)(buddy_pool_t *pool, int on);
+    int (*set_lazy)(buddy_pool_t *pool, int high);
+    void (*coalesce)(buddy_pool_t *pool);
+    void (*counters)(buddy_pool_t *pool, struct buddy_stats *st);
+};
+
+extern const struct buddy_engine buddy_list_engine;
+extern const struct buddy_engine buddy_nb_engine;
+extern const struct buddy_engine buddy_tree_engine;
+extern const struct buddy_engine buddy_tlsf_engine;
+extern const struct buddy_engine buddy_arena_engine;
+extern const struct buddy_engine buddy_shm_engine;
+
+/* Arena pool of at most narenas (1..BUDDY_MAX_ARENAS) list-engine arenas */
+buddy_pool_t *buddy_arena_create(void *p, long pgcount, int flags,
+                                 int narenas);
+
+/*
+ * Bulk free of a list-engine pool in two steps, so that a pool built on
+ * several can check all of them before freeing anything.  begin() checks
+ * ptrs exactly as free_bulk does and, when they are all good, returns OK
+ * with the pool locked; commit() then frees them and cancel() frees
+ * nothing, and both unlock.  Pools must be begun in address order.
+ */
+int buddy_list_free_bulk_begin(buddy_pool_t *pool, void **ptrs, int n);
+void buddy_list_free_bulk_commit(buddy_pool_t *pool, void **ptrs, int n);
+void buddy_list_free_bulk_cancel(buddy_pool_t *pool);
+
+/* Zero the counters of a pool that was just set up, shared between
+ * processes or not */
+void buddy_stats_init(buddy_pool_t *pool, int shared);
+/* Add the counters pool keeps itself to st */
+void buddy_stats_add(buddy_pool_t *pool, struct buddy_stats *st);
+/* Add only the frees, splits, merges and merge depth of from to st */
+void buddy_stats_add_engine(const struct buddy_stats *from,
+                            struct buddy_stats *st);
+
+#if BUDDY_STATS
+extern __thread unsigned int buddy_stats_slot;
+unsigned int buddy_stats_slot_assign(void);
+
+static inline struct buddy_stats *stat_slot(buddy_pool_t *pool) {
+    unsigned int slot = buddy_stats_slot;
+    if (slot == 0) {
+        slot = buddy_stats_slot_assign();
+    }
+    if (pool->stats_shared) {
+        slot = 0;
+    }
+    return &pool->stats[slot % BUDDY_STATS_SLOTS].st;
+}
+
+static inline void stat_count(buddy_pool_t *pool, unsigned long *counter,
+                              unsigned long n) {
+    if ((char*)counter < (char*)&pool->stats[1]) {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) +
+                         n, __ATOMIC_RELAXED);
+    }
+}
+
+#define stat_add(pool, field, n) \
+    stat_count((pool), &stat_slot(pool)->field, (n))
+
+static inline void stat_depth(buddy_pool_t *pool, int depth) {
+    int *max = &stat_slot(pool)->max_merge_depth;
+    int old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (depth > old &&
+           !__atomic_compare_exchange_n(max, &old, depth, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+#else
+#define stat_add(pool, field, n) ((void)(pool), (void)(n))
+#define stat_depth(pool, depth) ((void)(pool), (void)(depth))
+#endif
+
+static inline long pages_for_rank(int rank) {
+    return 1L << (rank - 1);
+}
+
+/* Index of the page p lies in, counted from base */
+static inline long page_index(const void *base, const void *p) {
+    return ((const char*)p - (const char*)base) / PAGE_SIZE;
+}
+
+static inline void *page_addr(void *base, long idx) {
+    return (char*)base + idx * PAGE_SIZE;
+}
+
+/* Index of the page p lies in if that is one of pages first..total_pages - 1
+ * at base, NO_PAGE otherwise */
+static inline long pool_page(void *base, long first, long total_pages,
+                             const void *p) {
+    if (p == NULL || (const char*)p < (char*)base ||
+        (const char*)p >= (char*)base + total_pages * PAGE_SIZE) {
+        return NO_PAGE;
+    }
+    
+    long idx = page_index(base, p);
+    return idx >= first ? idx : NO_PAGE;
+}
+
+/* qsort() order of pointers by address */
+static inline int ptr_cmp(const void *a, const void *b) {
+    const char *x = *(void* const*)a;
+    const char *y = *(void* const*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Fill in the free page figures of st for an engine of power-of-two blocks */
+static inline void stats_from_counts(const int counts[MAX_RANK + 1],
+                                     struct buddy_pool_stats *st) {
+    st->free_pages = 0;
+    st->largest_free_pages = 0;
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        st->free_pages += counts[rank] * pages_for_rank(rank);
+        if (counts[rank] > 0) {
+            st->largest_free_pages = pages_for_rank(rank);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,1385 @@
+#include "buddy_engine.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+// Free lists are doubly linked by page index.  By default the links are
+// stored inside the free pages themselves; building with BUDDY_OOB_FREELIST
+// keeps them in a side array instead, so free pages are never written to.
+typedef struct free_link {
+    long next;
+    long prev;
+} free_link_t;
+
+// Block metadata lives only at the head page of each block: the rank in the
+// low bits plus BLOCK_ALLOCATED.  Pages that are not a block head hold 0.
+#define BLOCK_RANK_MASK 0x1f
+#define BLOCK_CHUNK     0x20  // Allocated block carved from a small chunk
+#define BLOCK_CACHED    0x40  // Allocated block parked in a per-thread cache
+#define BLOCK_ALLOCATED 0x80
+
+#define CHUNK_PAGES 64            // pages_for_rank(BUDDY_CHUNK_RANK)
+#define CHUNK_SHIFT 6
+
+#define PCP_MAX_OWNERS 255        // Cache ids fit in a block_owner byte
+
+typedef struct list_pool list_pool_t;
+
+// Per-thread cache of free blocks of ranks 1..BUDDY_PCP_MAX_RANK.  Cached
+// blocks stay marked allocated in block_head, so the buddy lists never see
+// them, and are chained through their free_link_t next field.
+//
+// remote is a stack of blocks this cache handed out and other threads
+// freed, chained the same way.  Any thread pushes with a compare-and-swap
+// and whoever drains it swaps out the whole stack, so it needs no lock and
+// has no ABA problem.  A cache outlives its thread: it stays on pcp_all
+// and is handed to the next thread that needs one.
+struct pcp {
+    list_pool_t *pool;
+    struct pcp *next;               // On pool->pcp_all
+    int id;                         // Index in pool->pcp_by_id, 0 if none
+    int in_use;                     // Owned by a live thread
+    long remote;
+    long head[BUDDY_PCP_MAX_RANK + 1];
+    int count[BUDDY_PCP_MAX_RANK + 1];
+};
+
+// Per-page metadata is sized from the page count at init time.  It is
+// either one malloc()ed chunk or, with BUDDY_POOL_CARVE_METADATA, carved
+// together with the pool itself out of the first pages of the region.  The
+// pool refers to the pages and the metadata by byte offsets from itself,
+// never by pointers, so a carved pool works wherever the region is mapped.
+//
+// Locking: rank_lock[r] protects free_lists[r], free_count[r] and the list
+// links and block_head entries of every free block of rank r.  Locks are
+// always taken in ascending rank order, so an allocation holds the ranks it
+// splits through and a free holds the ranks it merges through, nothing else.
+// free_mask is shared by all ranks and updated atomically; free_count and
+// block_head are read without locks by the query functions.
+//
+// Small chunks are rank-BUDDY_CHUNK_RANK blocks taken off the buddy lists,
+// with one bit per page in chunk_map, set while the page is handed out.  A
+// chunk is indexed by its head page >> CHUNK_SHIFT and sits on
+// chunk_lists[r], r being the largest rank it still has an aligned free slot
+// for, or on no list when it is full.  chunk_lock protects all of it and is
+// taken before any rank lock.
+//
+// In lazy mode a free leaves the block unmerged while its rank has fewer
+// than lazy_high free blocks, so buddies may both sit on a free list.
+// lazy_dirty is set whenever that happens and cleared by coalesce_all(),
+// which an allocation that finds nothing large enough runs before failing.
+//
+// block_owner records, at the head page of each block handed out from a
+// per-thread cache, the id of that cache, and 0 for every other block.  A
+// free from another thread goes onto the owner's remote stack instead of
+// the freeing thread's cache, so blocks flow back to the thread that
+// allocates them without touching the buddy lists.
+struct list_pool {
+    struct buddy_pool common;
+    pthread_mutex_t rank_lock[MAX_RANK + 1];
+    long free_lists[MAX_RANK + 1];  // Head page index of each free list
+    int free_count[MAX_RANK + 1];   // Blocks on each free list
+    unsigned int free_mask;         // Bit r set iff free_lists[r] is non-empty
+    long base_off;                  // Page 0, in bytes from the pool
+    long total_pages;
+    long first_page;                // Pages below hold carved metadata
+    int flags;
+    void *meta;                     // malloc()ed metadata, NULL if carved
+    long block_head_off;            // total_pages entries
+    long block_owner_off;           // total_pages entries
+#ifdef BUDDY_OOB_FREELIST
+    long free_links_off;            // total_pages entries
+#endif
+    long chunk_map_off;             // One entry per CHUNK_PAGES pages
+    long chunk_next_off;
+    long chunk_prev_off;
+    long chunk_lists[BUDDY_CHUNK_MAX_RANK + 1];
+    unsigned int chunk_mask;        // Bit r set iff chunk_lists[r] is non-empty
+    int chunks_on;
+    pthread_mutex_t chunk_lock;
+    int lazy_high;                  // 0 when every free merges right away
+    int lazy_dirty;
+    int pcp_high;                   // 0 when per-thread caches are off
+    int pcp_low;
+    int pcp_key_valid;
+    pthread_key_t pcp_key;          // This thread's struct pcp
+    pthread_mutex_t pcp_lock;       // Protects pcp_all and key creation
+    struct pcp *pcp_all;
+    int pcp_ids;                    // Ids handed out so far
+    struct pcp *pcp_by_id[PCP_MAX_OWNERS + 1];
+};
+
+static inline list_pool_t *to_list(buddy_pool_t *pool) {
+    return (list_pool_t*)pool;
+}
+
+static inline void *pool_at(list_pool_t *pool, long off) {
+    return (char*)pool + off;
+}
+
+static inline long pool_off(list_pool_t *pool, void *p) {
+    return (char*)p - (char*)pool;
+}
+
+static inline char *base_addr(list_pool_t *pool) {
+    return pool_at(pool, pool->base_off);
+}
+
+static inline unsigned char *block_head(list_pool_t *pool) {
+    return pool_at(pool, pool->block_head_off);
+}
+
+static inline unsigned char *block_owner(list_pool_t *pool) {
+    return pool_at(pool, pool->block_owner_off);
+}
+
+#ifdef BUDDY_OOB_FREELIST
+static inline free_link_t *free_links(list_pool_t *pool) {
+    return pool_at(pool, pool->free_links_off);
+}
+#endif
+
+static inline unsigned long *chunk_map(list_pool_t *pool) {
+    return pool_at(pool, pool->chunk_map_off);
+}
+
+static inline long *chunk_next(list_pool_t *pool) {
+    return pool_at(pool, pool->chunk_next_off);
+}
+
+static inline long *chunk_prev(list_pool_t *pool) {
+    return pool_at(pool, pool->chunk_prev_off);
+}
+
+static inline long get_buddy_index(long idx, int rank) {
+    long pages = pages_for_rank(rank);
+    long block_num = idx / pages;
+    if (block_num % 2 == 0) {
+        return idx + pages;
+    } else {
+        return idx - pages;
+    }
+}
+
+static inline unsigned char head_get(list_pool_t *pool, long idx) {
+    return __atomic_load_n(&block_head(pool)[idx], __ATOMIC_RELAXED);
+}
+
+static inline void head_set(list_pool_t *pool, long idx, unsigned char v) {
+    __atomic_store_n(&block_head(pool)[idx], v, __ATOMIC_RELAXED);
+}
+
+// Locks of a BUDDY_POOL_SHARED pool work across processes and are robust:
+// one whose owner died is taken over as it is, so the other processes do
+// not block forever.  Nothing is repaired: a half-done list update by the
+// dead owner stays half done.
+static void mutex_init(pthread_mutex_t *m, int flags) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (flags & BUDDY_POOL_SHARED) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void mutex_lock(pthread_mutex_t *m) {
+    if (pthread_mutex_lock(m) == EOWNERDEAD) {
+        pthread_mutex_consistent(m);
+    }
+}
+
+static void lock_ranks(list_pool_t *pool, int lo, int hi) {
+    for (int r = lo; r <= hi; r++) {
+        mutex_lock(&pool->rank_lock[r]);
+    }
+}
+
+static void unlock_ranks(list_pool_t *pool, int lo, int hi) {
+    for (int r = hi; r >= lo; r--) {
+        pthread_mutex_unlock(&pool->rank_lock[r]);
+    }
+}
+
+static inline free_link_t *link_of(list_pool_t *pool, long idx) {
+#ifdef BUDDY_OOB_FREELIST
+    return &free_links(pool)[idx];
+#else
+    return (free_link_t*)page_addr(base_addr(pool), idx);
+#endif
+}
+
+// Find the block containing page idx: the only aligned candidate head whose
+// recorded rank matches the alignment it was found at.
+static long find_block_head(list_pool_t *pool, long idx) {
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        long head = idx & ~(pages_for_rank(rank) - 1);
+        if ((head_get(pool, head) & BLOCK_RANK_MASK) == rank) {
+            return head;
+        }
+    }
+    return -1;
+}
+
+static void list_add(list_pool_t *pool, int rank, long idx) {
+    free_link_t *node = link_of(pool, idx);
+    node->next = pool->free_lists[rank];
+    node->prev = NO_PAGE;
+    if (pool->free_lists[rank] != NO_PAGE) {
+        link_of(pool, pool->free_lists[rank])->prev = idx;
+    }
+    pool->free_lists[rank] = idx;
+    __atomic_store_n(&pool->free_count[rank], pool->free_count[rank] + 1,
+                     __ATOMIC_RELAXED);
+    if (node->next == NO_PAGE) {
+        __atomic_fetch_or(&pool->free_mask, 1u << rank, __ATOMIC_RELAXED);
+    }
+}
+
+static void list_remove(list_pool_t *pool, int rank, long idx) {
+    free_link_t *node = link_of(pool, idx);
+    if (node->prev != NO_PAGE) {
+        link_of(pool, node->prev)->next = node->next;
+    } else {
+        pool->free_lists[rank] = node->next;
+    }
+    if (node->next != NO_PAGE) {
+        link_of(pool, node->next)->prev = node->prev;
+    }
+    if (pool->free_lists[rank] == NO_PAGE) {
+        __atomic_fetch_and(&pool->free_mask, ~(1u << rank), __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&pool->free_count[rank], pool->free_count[rank] - 1,
+                     __ATOMIC_RELAXED);
+}
+
+static inline long nr_chunks(long pgcount) {
+    return (pgcount + CHUNK_PAGES - 1) >> CHUNK_SHIFT;
+}
+
+// Bytes of per-page metadata needed for pgcount pages
+static size_t meta_size(long pgcount) {
+    size_t size = 2 * ((pgcount + 7) & ~7L);  // block_head, block_owner
+#ifdef BUDDY_OOB_FREELIST
+    size += pgcount * sizeof(free_link_t);
+#endif
+    size += nr_chunks(pgcount) * (sizeof(unsigned long) + 2 * sizeof(long));
+    return size;
+}
+
+static void pool_set_meta(list_pool_t *pool, void *meta) {
+    char *next = (char*)meta + ((pool->total_pages + 7) & ~7L);
+    long chunks = nr_chunks(pool->total_pages);
+    pool->block_head_off = pool_off(pool, meta);
+    pool->block_owner_off = pool_off(pool, next);
+    next += (pool->total_pages + 7) & ~7L;
+#ifdef BUDDY_OOB_FREELIST
+    pool->free_links_off = pool_off(pool, next);
+    next += pool->total_pages * sizeof(free_link_t);
+#endif
+    pool->chunk_map_off = pool_off(pool, next);
+    next += chunks * sizeof(unsigned long);
+    pool->chunk_next_off = pool_off(pool, next);
+    next += chunks * sizeof(long);
+    pool->chunk_prev_off = pool_off(pool, next);
+}
+
+// Put pages [start, end) on the free lists as maximal aligned blocks
+static void add_free_range(list_pool_t *pool, long start, long end) {
+    long idx = start;
+    while (idx < end) {
+        // Find largest rank that fits and keeps idx aligned
+        int rank = MAX_RANK;
+        long pages = pages_for_rank(rank);
+        while (pages > end - idx || (idx & (pages - 1))) {
+            rank--;
+            pages = pages_for_rank(rank);
+        }
+        
+        // Add this block to free list
+        list_add(pool, rank, idx);
+        head_set(pool, idx, rank);
+        
+        idx += pages;
+    }
+}
+
+// Set up the free lists for pages [first, total_pages).  Pages below first
+// hold carved metadata and never belong to a block.
+static void pool_reset(list_pool_t *pool, long first) {
+    pool->first_page = first;
+    
+    // Initialize free lists
+    for (int i = 0; i <= MAX_RANK; i++) {
+        pool->free_lists[i] = NO_PAGE;
+        pool->free_count[i] = 0;
+    }
+    pool->free_mask = 0;
+    pool->lazy_dirty = 0;
+    
+    // No chunks are reserved
+    for (int i = 0; i <= BUDDY_CHUNK_MAX_RANK; i++) {
+        pool->chunk_lists[i] = NO_PAGE;
+    }
+    pool->chunk_mask = 0;
+    for (long i = 0; i < nr_chunks(pool->total_pages); i++) {
+        chunk_map(pool)[i] = 0;
+    }
+    
+    // Clear block heads
+    for (long i = 0; i < pool->total_pages; i++) {
+        block_head(pool)[i] = 0;
+    }
+    
+    // Build free blocks from largest to smallest
+    add_free_range(pool, first, pool->total_pages);
+}
+
+static buddy_pool_t *list_create(void *p, long pgcount, int flags) {
+    list_pool_t *pool;
+    long first = 0;
+    if (flags & BUDDY_POOL_CARVE_METADATA) {
+        // The pool and its metadata occupy the first pages of the region
+        size_t bytes = ((sizeof(*pool) + 7) & ~7L) + meta_size(pgcount);
+        first = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (first >= pgcount) {
+            return ERR_PTR(-EINVAL);
+        }
+        pool = p;
+        pool->meta = NULL;
+        pool->total_pages = pgcount;
+        pool_set_meta(pool, (char*)p + ((sizeof(*pool) + 7) & ~7L));
+    } else {
+        pool = malloc(sizeof(*pool));
+        if (pool == NULL) {
+            return ERR_PTR(-ENOMEM);
+        }
+        pool->meta = malloc(meta_size(pgcount));
+        if (pool->meta == NULL) {
+            free(pool);
+            return ERR_PTR(-ENOMEM);
+        }
+        pool->total_pages = pgcount;
+        pool_set_meta(pool, pool->meta);
+    }
+    pool->base_off = pool_off(pool, p);
+    pool->flags = flags;
+    for (int i = 0; i <= MAX_RANK; i++) {
+        mutex_init(&pool->rank_lock[i], flags);
+    }
+    pool->chunks_on = 0;
+    mutex_init(&pool->chunk_lock, flags);
+    pool->lazy_high = 0;
+    pool->pcp_high = 0;
+    pool->pcp_low = 0;
+    pool->pcp_key_valid = 0;
+    mutex_init(&pool->pcp_lock, flags);
+    pool->pcp_all = NULL;
+    pool->pcp_ids = 0;
+    
+    pool_reset(pool, first);
+    
+    return &pool->common;
+}
+
+// Forget every thread's cache without draining it; only for pool teardown
+// and re-initialization, when the blocks they hold are no longer valid.
+static void pcp_discard_all(list_pool_t *pool) {
+    mutex_lock(&pool->pcp_lock);
+    for (struct pcp *pcp = pool->pcp_all; pcp; pcp = pcp->next) {
+        for (int rank = 1; rank <= BUDDY_PCP_MAX_RANK; rank++) {
+            pcp->head[rank] = NO_PAGE;
+            pcp->count[rank] = 0;
+        }
+        __atomic_store_n(&pcp->remote, NO_PAGE, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pool->pcp_lock);
+}
+
+static int list_reset(buddy_pool_t *bp, void *p, long pgcount) {
+    list_pool_t *pool = to_list(bp);
+    if (pool->flags & BUDDY_POOL_CARVE_METADATA) {
+        return -EINVAL;
+    }
+    
+    if (meta_size(pgcount) > meta_size(pool->total_pages)) {
+        void *meta = malloc(meta_size(pgcount));
+        if (meta == NULL) {
+            return -ENOMEM;
+        }
+        free(pool->meta);
+        pool->meta = meta;
+    }
+    pcp_discard_all(pool);
+    pool->base_off = pool_off(pool, p);
+    pool->total_pages = pgcount;
+    pool_set_meta(pool, pool->meta);
+    
+    pool_reset(pool, 0);
+    
+    return OK;
+}
+
+static void list_destroy(buddy_pool_t *bp) {
+    list_pool_t *pool = to_list(bp);
+    if (pool->pcp_key_valid) {
+        pthread_key_delete(pool->pcp_key);
+    }
+    while (pool->pcp_all != NULL) {
+        struct pcp *pcp = pool->pcp_all;
+        pool->pcp_all = pcp->next;
+        free(pcp);
+    }
+    pthread_mutex_destroy(&pool->pcp_lock);
+    pthread_mutex_destroy(&pool->chunk_lock);
+    for (int i = 0; i <= MAX_RANK; i++) {
+        pthread_mutex_destroy(&pool->rank_lock[i]);
+    }
+    if (pool->flags & BUDDY_POOL_CARVE_METADATA) {
+        return;
+    }
+    free(pool->meta);
+    free(pool);
+}
+
+// Merge every pair of free buddies, bottom up, until none is left.  Blocks
+// merged into rank r + 1 are seen again when that list is walked.
+static void coalesce_all(list_pool_t *pool) {
+    lock_ranks(pool, 1, MAX_RANK);
+    __atomic_store_n(&pool->lazy_dirty, 0, __ATOMIC_RELAXED);
+    for (int rank = 1; rank < MAX_RANK; rank++) {
+        long pages = pages_for_rank(rank);
+        long idx = pool->free_lists[rank];
+        while (idx != NO_PAGE) {
+            long next = link_of(pool, idx)->next;
+            long buddy_idx = get_buddy_index(idx, rank);
+            if (buddy_idx < 0 || buddy_idx + pages > pool->total_pages ||
+                head_get(pool, buddy_idx) != rank) {
+                idx = next;
+                continue;
+            }
+            
+            if (buddy_idx == next) {
+                next = link_of(pool, next)->next;
+            }
+            list_remove(pool, rank, idx);
+            list_remove(pool, rank, buddy_idx);
+            head_set(pool, idx, 0);
+            head_set(pool, buddy_idx, 0);
+            long merged = idx < buddy_idx ? idx : buddy_idx;
+            list_add(pool, rank + 1, merged);
+            head_set(pool, merged, rank + 1);
+            stat_add(&pool->common, merges[rank + 1], 1);
+            idx = next;
+        }
+    }
+    unlock_ranks(pool, 1, MAX_RANK);
+}
+
+// Run coalesce_all() if lazy frees may have left free buddies unmerged.
+// Returns whether it did, in which case a failed allocation may succeed.
+static int coalesce_if_dirty(list_pool_t *pool) {
+    if (!__atomic_load_n(&pool->lazy_dirty, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    coalesce_all(pool);
+    return 1;
+}
+
+static long rank_alloc_once(list_pool_t *pool, int rank) {
+    // Find the smallest available block >= rank.  free_mask bits of ranks
+    // we hold are exact; bits above are only a hint until we lock them too.
+    int locked = rank;
+    lock_ranks(pool, rank, rank);
+    int current_rank;
+    for (;;) {
+        unsigned int mask = __atomic_load_n(&pool->free_mask, __ATOMIC_RELAXED);
+        unsigned int held = mask & ((2u << locked) - 1) & ~((1u << rank) - 1);
+        if (held) {
+            current_rank = __builtin_ctz(held);
+            break;
+        }
+        unsigned int above = mask & ~((2u << locked) - 1);
+        if (above == 0) {
+            unlock_ranks(pool, rank, locked);
+            return NO_PAGE;
+        }
+        int next = __builtin_ctz(above);
+        lock_ranks(pool, locked + 1, next);
+        locked = next;
+    }
+    
+    // Remove block from free list
+    long idx = pool->free_lists[current_rank];
+    list_remove(pool, current_rank, idx);
+    
+    // Split block if necessary
+    while (current_rank > rank) {
+        stat_add(&pool->common, splits[current_rank], 1);
+        current_rank--;
+        long buddy_idx = idx + pages_for_rank(current_rank);
+        list_add(pool, current_rank, buddy_idx);
+        head_set(pool, buddy_idx, current_rank);
+    }
+    
+    // Mark the head as allocated
+    head_set(pool, idx, rank | BLOCK_ALLOCATED);
+    
+    unlock_ranks(pool, rank, locked);
+    
+    return idx;
+}
+
+// Take a block of the given rank off the buddy lists, splitting as needed.
+// Returns its page index, or NO_PAGE if nothing large enough is free.
+static long rank_alloc(list_pool_t *pool, int rank) {
+    long idx = rank_alloc_once(pool, rank);
+    if (idx == NO_PAGE && coalesce_if_dirty(pool)) {
+        idx = rank_alloc_once(pool, rank);
+    }
+    return idx;
+}
+
+// Take up to n blocks of the given rank off the buddy lists in one pass.
+// Each source block is carved directly into rank-sized pieces instead of
+// being split one level at a time; whatever is left over goes back as
+// maximal aligned blocks.  The blocks are stored as addresses in out, or,
+// when pcp is given, pushed onto that cache.  Returns the number taken.
+static int rank_alloc_bulk(list_pool_t *pool, int rank, int n, void **out,
+                           struct pcp *pcp) {
+    int got = 0;
+    int locked = rank;
+    lock_ranks(pool, rank, rank);
+    while (got < n) {
+        unsigned int mask = __atomic_load_n(&pool->free_mask, __ATOMIC_RELAXED);
+        unsigned int held = mask & ((2u << locked) - 1) & ~((1u << rank) - 1);
+        if (held == 0) {
+            unsigned int above = mask & ~((2u << locked) - 1);
+            if (above == 0) {
+                break;
+            }
+            int next = __builtin_ctz(above);
+            lock_ranks(pool, locked + 1, next);
+            locked = next;
+            continue;
+        }
+        int current_rank = __builtin_ctz(held);
+        long start = pool->free_lists[current_rank];
+        list_remove(pool, current_rank, start);
+        
+        long pages = pages_for_rank(rank);
+        long pieces = 1L << (current_rank - rank);
+        if (pieces > n - got) {
+            pieces = n - got;
+            add_free_range(pool, start + pieces * pages,
+                           start + pages_for_rank(current_rank));
+        }
+        // Carving counts as the splits that would have freed the pieces
+        for (int k = rank + 1; k <= current_rank; k++) {
+            long split = (pieces + (1L << (k - rank)) - 1) >> (k - rank);
+            stat_add(&pool->common, splits[k], split);
+        }
+        for (long i = 0; i < pieces; i++) {
+            long idx = start + i * pages;
+            if (pcp != NULL) {
+                head_set(pool, idx, rank | BLOCK_ALLOCATED | BLOCK_CACHED);
+                link_of(pool, idx)->next = pcp->head[rank];
+                pcp->head[rank] = idx;
+                pcp->count[rank]++;
+            } else {
+                head_set(pool, idx, rank | BLOCK_ALLOCATED);
+                out[got + i] = page_addr(base_addr(pool), idx);
+            }
+        }
+        got += pieces;
+    }
+    unlock_ranks(pool, rank, locked);
+    
+    return got;
+}
+
+// Give the allocated block at idx, whose block_head byte was seen as head,
+// back to the buddy lists and merge it as far up as possible.
+static int rank_free(list_pool_t *pool, long idx, unsigned char head) {
+    int rank = head & BLOCK_RANK_MASK;
+    
+    // Recheck under the lock so that racing double frees fail cleanly
+    int first_rank = rank;
+    lock_ranks(pool, rank, rank);
+    if (head_get(pool, idx) != head) {
+        unlock_ranks(pool, rank, rank);
+        return -EINVAL;
+    }
+    head_set(pool, idx, 0);
+    
+    // Lazy mode: leave the block unmerged while its rank is short of blocks
+    int high = __atomic_load_n(&pool->lazy_high, __ATOMIC_RELAXED);
+    if (pool->free_count[rank] < high) {
+        list_add(pool, rank, idx);
+        head_set(pool, idx, rank);
+        __atomic_store_n(&pool->lazy_dirty, 1, __ATOMIC_RELAXED);
+        unlock_ranks(pool, rank, rank);
+        return OK;
+    }
+    
+    // Merge with buddy if possible
+    while (rank < MAX_RANK) {
+        long buddy_idx = get_buddy_index(idx, rank);
+        
+        // Check if buddy exists
+        if (buddy_idx < 0 || buddy_idx >= pool->total_pages) {
+            break;
+        }
+        
+        long pages = pages_for_rank(rank);
+        if (buddy_idx + pages > pool->total_pages) {
+            break;
+        }
+        
+        // Check if buddy is free and has same rank
+        if (head_get(pool, buddy_idx) != rank) {
+            break;
+        }
+        
+        // Remove buddy from free list
+        list_remove(pool, rank, buddy_idx);
+        head_set(pool, buddy_idx, 0);
+        
+        // Merge with buddy
+        if (buddy_idx < idx) {
+            idx = buddy_idx;
+        }
+        rank++;
+        lock_ranks(pool, rank, rank);
+        stat_add(&pool->common, merges[rank], 1);
+    }
+    stat_depth(&pool->common, rank - first_rank);
+    
+    // Add to free list
+    list_add(pool, rank, idx);
+    head_set(pool, idx, rank);
+    
+    unlock_ranks(pool, first_rank, rank);
+    
+    return OK;
+}
+
+#define SLOTS_2 0x5555555555555555UL
+#define SLOTS_3 0x1111111111111111UL
+#define SLOTS_4 0x0101010101010101UL
+
+// Start bits of the aligned runs of free pages in a chunk that can hold a
+// block of the given rank: AND each bit with the bits above it, doubling
+// the span every step, then keep the positions aligned to the block size.
+static inline unsigned long chunk_slots(unsigned long map, int rank) {
+    unsigned long free = ~map;
+    switch (rank) {
+    case 1:
+        return free;
+    case 2:
+        return free & (free >> 1) & SLOTS_2;
+    case 3:
+        free &= free >> 1;
+        return free & (free >> 2) & SLOTS_3;
+    default:
+        free &= free >> 1;
+        free &= free >> 2;
+        return free & (free >> 4) & SLOTS_4;
+    }
+}
+
+// Largest rank a chunk can still hand out, 0 when it has no room at all.
+// Written out for BUDDY_CHUNK_MAX_RANK == 4.
+static int chunk_level(unsigned long map) {
+    unsigned long f1 = ~map;
+    unsigned long f2 = f1 & (f1 >> 1);
+    unsigned long f4 = f2 & (f2 >> 2);
+    if (f4 & (f4 >> 4) & SLOTS_4) {
+        return 4;
+    }
+    if (f4 & SLOTS_3) {
+        return 3;
+    }
+    if (f2 & SLOTS_2) {
+        return 2;
+    }
+    return f1 != 0;
+}
+
+static void chunk_link(list_pool_t *pool, long c, int level) {
+    if (level == 0) {
+        return;
+    }
+    chunk_next(pool)[c] = pool->chunk_lists[level];
+    chunk_prev(pool)[c] = NO_PAGE;
+    if (pool->chunk_lists[level] != NO_PAGE) {
+        chunk_prev(pool)[pool->chunk_lists[level]] = c;
+    }
+    pool->chunk_lists[level] = c;
+    pool->chunk_mask |= 1u << level;
+}
+
+static void chunk_unlink(list_pool_t *pool, long c, int level) {
+    if (level == 0) {
+        return;
+    }
+    if (chunk_prev(pool)[c] != NO_PAGE) {
+        chunk_next(pool)[chunk_prev(pool)[c]] = chunk_next(pool)[c];
+    } else {
+        pool->chunk_lists[level] = chunk_next(pool)[c];
+    }
+    if (chunk_next(pool)[c] != NO_PAGE) {
+        chunk_prev(pool)[chunk_next(pool)[c]] = chunk_prev(pool)[c];
+    }
+    if (pool->chunk_lists[level] == NO_PAGE) {
+        pool->chunk_mask &= ~(1u << level);
+    }
+}
+
+// Change a chunk's page bits and move it to the list for its new level
+static void chunk_update(list_pool_t *pool, long c, unsigned long map) {
+    int old_level = chunk_level(chunk_map(pool)[c]);
+    int new_level = chunk_level(map);
+    __atomic_store_n(&chunk_map(pool)[c], map, __ATOMIC_RELAXED);
+    if (old_level != new_level) {
+        chunk_unlink(pool, c, old_level);
+        chunk_link(pool, c, new_level);
+    }
+}
+
+// Hand out a block of rank <= BUDDY_CHUNK_MAX_RANK from a chunk whose
+// largest free slot fits it most tightly, reserving a new chunk when none
+// has room.  Falls back to the buddy lists when no whole chunk is left.
+static long chunk_alloc(list_pool_t *pool, int rank) {
+    mutex_lock(&pool->chunk_lock);
+    unsigned int mask = pool->chunk_mask & ~((1u << rank) - 1);
+    long c;
+    if (mask) {
+        c = pool->chunk_lists[__builtin_ctz(mask)];
+    } else {
+        long head = rank_alloc(pool, BUDDY_CHUNK_RANK);
+        if (head == NO_PAGE) {
+            pthread_mutex_unlock(&pool->chunk_lock);
+            return rank_alloc(pool, rank);
+        }
+        c = head >> CHUNK_SHIFT;
+        head_set(pool, head, 0);
+        chunk_link(pool, c, chunk_level(0));
+    }
+    
+    // Lowest slot that fits, so that small blocks pack towards the front
+    unsigned long map = chunk_map(pool)[c];
+    int off = __builtin_ctzl(chunk_slots(map, rank));
+    chunk_update(pool, c, map | (((2UL << (pages_for_rank(rank) - 1)) - 1)
+                                 << off));
+    long idx = (c << CHUNK_SHIFT) + off;
+    head_set(pool, idx, rank | BLOCK_ALLOCATED | BLOCK_CHUNK);
+    
+    pthread_mutex_unlock(&pool->chunk_lock);
+    
+    return idx;
+}
+
+// Clear the pages of the chunk block at idx.  Returns 1 if that left the
+// chunk empty, in which case it is off every chunk list and its pages still
+// need to go back to the buddy lists as one rank-BUDDY_CHUNK_RANK block.
+// Caller holds chunk_lock.
+static int chunk_clear(list_pool_t *pool, long idx, int rank) {
+    long c = idx >> CHUNK_SHIFT;
+    unsigned long bits = ((2UL << (pages_for_rank(rank) - 1)) - 1)
+                         << (idx & (CHUNK_PAGES - 1));
+    unsigned long map = chunk_map(pool)[c] & ~bits;
+    if (map == 0) {
+        chunk_unlink(pool, c, chunk_level(chunk_map(pool)[c]));
+        __atomic_store_n(&chunk_map(pool)[c], 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    chunk_update(pool, c, map);
+    return 0;
+}
+
+static int chunk_free(list_pool_t *pool, long idx, unsigned char head) {
+    // Recheck under the lock so that racing double frees fail cleanly
+    mutex_lock(&pool->chunk_lock);
+    if (head_get(pool, idx) != head) {
+        pthread_mutex_unlock(&pool->chunk_lock);
+        return -EINVAL;
+    }
+    head_set(pool, idx, 0);
+    int empty = chunk_clear(pool, idx, head & BLOCK_RANK_MASK);
+    pthread_mutex_unlock(&pool->chunk_lock);
+    
+    // Nobody else can reach an empty chunk, so it is released unlocked
+    if (empty) {
+        long first = idx & ~(long)(CHUNK_PAGES - 1);
+        head_set(pool, first, BUDDY_CHUNK_RANK | BLOCK_ALLOCATED);
+        rank_free(pool, first, BUDDY_CHUNK_RANK | BLOCK_ALLOCATED);
+    }
+    return OK;
+}
+
+// Return up to n blocks from the front of a cache chain to the buddy lists
+static void pcp_drain(struct pcp *pcp, int rank, int n) {
+    list_pool_t *pool = pcp->pool;
+    while (n-- > 0 && pcp->count[rank] > 0) {
+        long idx = pcp->head[rank];
+        pcp->head[rank] = link_of(pool, idx)->next;
+        pcp->count[rank]--;
+        head_set(pool, idx, rank | BLOCK_ALLOCATED);
+        rank_free(pool, idx, rank | BLOCK_ALLOCATED);
+    }
+}
+
+static void pcp_drain_all(struct pcp *pcp) {
+    for (int rank = 1; rank <= BUDDY_PCP_MAX_RANK; rank++) {
+        pcp_drain(pcp, rank, pcp->count[rank]);
+    }
+}
+
+// Push a block freed by a thread other than its owner onto owner->remote
+static void remote_push(struct pcp *owner, long idx) {
+    list_pool_t *pool = owner->pool;
+    long head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    do {
+        link_of(pool, idx)->next = head;
+    } while (!__atomic_compare_exchange_n(&owner->remote, &head, idx, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Detach the whole remote stack of pcp; NO_PAGE if it is empty
+static long remote_take(struct pcp *pcp) {
+    if (__atomic_load_n(&pcp->remote, __ATOMIC_RELAXED) == NO_PAGE) {
+        return NO_PAGE;
+    }
+    return __atomic_exchange_n(&pcp->remote, NO_PAGE, __ATOMIC_ACQUIRE);
+}
+
+// Move the blocks other threads freed to this thread's cache onto its
+// stacks in one batch, then drain any rank that went past high.
+static void pcp_take_remote(struct pcp *pcp) {
+    list_pool_t *pool = pcp->pool;
+    long idx = remote_take(pcp);
+    if (idx == NO_PAGE) {
+        return;
+    }
+    
+    unsigned int grown = 0;
+    while (idx != NO_PAGE) {
+        long next = link_of(pool, idx)->next;
+        int rank = head_get(pool, idx) & BLOCK_RANK_MASK;
+        link_of(pool, idx)->next = pcp->head[rank];
+        pcp->head[rank] = idx;
+        pcp->count[rank]++;
+        grown |= 1u << rank;
+        idx = next;
+    }
+    
+    int high = __atomic_load_n(&pool->pcp_high, __ATOMIC_RELAXED);
+    int low = __atomic_load_n(&pool->pcp_low, __ATOMIC_RELAXED);
+    for (int rank = 1; rank <= BUDDY_PCP_MAX_RANK; rank++) {
+        if ((grown & (1u << rank)) && pcp->count[rank] > high) {
+            pcp_drain(pcp, rank, pcp->count[rank] - low);
+        }
+    }
+}
+
+// Give every block queued on any cache's remote stack back to the buddy
+// lists.  This covers caches whose thread has exited or stopped caching,
+// and is run before an allocation fails, on a drain and on a coalesce.
+// Returns whether it found any.
+static int remote_reclaim(list_pool_t *pool) {
+    int found = 0;
+    mutex_lock(&pool->pcp_lock);
+    for (struct pcp *pcp = pool->pcp_all; pcp; pcp = pcp->next) {
+        long idx = remote_take(pcp);
+        while (idx != NO_PAGE) {
+            long next = link_of(pool, idx)->next;
+            int rank = head_get(pool, idx) & BLOCK_RANK_MASK;
+            head_set(pool, idx, rank | BLOCK_ALLOCATED);
+            rank_free(pool, idx, rank | BLOCK_ALLOCATED);
+            found = 1;
+            idx = next;
+        }
+    }
+    pthread_mutex_unlock(&pool->pcp_lock);
+    
+    return found;
+}
+
+// pthread key destructor: a thread's cache is drained when it exits and
+// left for the next thread to take over
+static void pcp_thread_exit(void *arg) {
+    struct pcp *pcp = arg;
+    list_pool_t *pool = pcp->pool;
+    pcp_take_remote(pcp);
+    pcp_drain_all(pcp);
+    mutex_lock(&pool->pcp_lock);
+    pcp->in_use = 0;
+    pthread_mutex_unlock(&pool->pcp_lock);
+}
+
+// This thread's cache for pool, created on first use.  NULL if caching is
+// off or the cache cannot be allocated.
+static struct pcp *pcp_get(list_pool_t *pool) {
+    if (__atomic_load_n(&pool->pcp_high, __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+    
+    struct pcp *pcp = pthread_getspecific(pool->pcp_key);
+    if (pcp != NULL) {
+        return pcp;
+    }
+    
+    // Take over the cache of an exited thread, or make a new one
+    mutex_lock(&pool->pcp_lock);
+    for (pcp = pool->pcp_all; pcp; pcp = pcp->next) {
+        if (!pcp->in_use) {
+            break;
+        }
+    }
+    if (pcp == NULL) {
+        pcp = malloc(sizeof(*pcp));
+        if (pcp == NULL) {
+            pthread_mutex_unlock(&pool->pcp_lock);
+            return NULL;
+        }
+        pcp->pool = pool;
+        pcp->id = 0;
+        if (pool->pcp_ids < PCP_MAX_OWNERS) {
+            pcp->id = ++pool->pcp_ids;
+            pool->pcp_by_id[pcp->id] = pcp;
+        }
+        pcp->remote = NO_PAGE;
+        for (int rank = 0; rank <= BUDDY_PCP_MAX_RANK; rank++) {
+            pcp->head[rank] = NO_PAGE;
+            pcp->count[rank] = 0;
+        }
+        pcp->next = pool->pcp_all;
+        pool->pcp_all = pcp;
+    }
+    pcp->in_use = 1;
+    pthread_mutex_unlock(&pool->pcp_lock);
+    
+    if (pthread_setspecific(pool->pcp_key, pcp) != 0) {
+        mutex_lock(&pool->pcp_lock);
+        pcp->in_use = 0;
+        pthread_mutex_unlock(&pool->pcp_lock);
+        return NULL;
+    }
+    return pcp;
+}
+
+static void *list_alloc(buddy_pool_t *bp, int rank) {
+    list_pool_t *pool = to_list(bp);
+    struct pcp *pcp = rank <= BUDDY_PCP_MAX_RANK ? pcp_get(pool) : NULL;
+    if (pcp != NULL) {
+        pcp_take_remote(pcp);
+        
+        // Refill an empty cache with a batch of low blocks
+        if (pcp->count[rank] == 0) {
+            int batch = __atomic_load_n(&pool->pcp_low, __ATOMIC_RELAXED);
+            if (rank_alloc_bulk(pool, rank, batch, NULL, pcp) == 0 &&
+                (remote_reclaim(pool) | coalesce_if_dirty(pool))) {
+                rank_alloc_bulk(pool, rank, batch, NULL, pcp);
+            }
+        }
+        if (pcp->count[rank] > 0) {
+            long idx = pcp->head[rank];
+            pcp->head[rank] = link_of(pool, idx)->next;
+            pcp->count[rank]--;
+            __atomic_store_n(&block_owner(pool)[idx], pcp->id,
+                             __ATOMIC_RELAXED);
+            head_set(pool, idx, rank | BLOCK_ALLOCATED);
+            return page_addr(base_addr(pool), idx);
+        }
+        return ERR_PTR(-ENOSPC);
+    }
+    
+    int chunked = rank <= BUDDY_CHUNK_MAX_RANK &&
+                  __atomic_load_n(&pool->chunks_on, __ATOMIC_RELAXED);
+    long idx = chunked ? chunk_alloc(pool, rank) : rank_alloc(pool, rank);
+    if (idx == NO_PAGE && remote_reclaim(pool)) {
+        idx = chunked ? chunk_alloc(pool, rank) : rank_alloc(pool, rank);
+    }
+    if (idx == NO_PAGE) {
+        return ERR_PTR(-ENOSPC);
+    }
+    __atomic_store_n(&block_owner(pool)[idx], 0, __ATOMIC_RELAXED);
+    return page_addr(base_addr(pool), idx);
+}
+
+static int list_alloc_bulk(buddy_pool_t *bp, int rank, int n, void **out) {
+    list_pool_t *pool = to_list(bp);
+    int got = rank_alloc_bulk(pool, rank, n, out, NULL);
+    if (got < n && (remote_reclaim(pool) | coalesce_if_dirty(pool))) {
+        got += rank_alloc_bulk(pool, rank, n - got, out + got, NULL);
+    }
+    for (int i = 0; i < got; i++) {
+        long idx = page_index(base_addr(pool), out[i]);
+        __atomic_store_n(&block_owner(pool)[idx], 0, __ATOMIC_RELAXED);
+    }
+    return got;
+}
+
+// Put the allocated block at idx, whose block_head byte was seen as head,
+// on the cache of the calling thread
+static int pcp_free(struct pcp *pcp, long idx, unsigned char head) {
+    list_pool_t *pool = pcp->pool;
+    int rank = head & BLOCK_RANK_MASK;
+    
+    // Claim the block so that a racing double free fails cleanly
+    if (!__atomic_compare_exchange_n(&block_head(pool)[idx], &head,
+                                     head | BLOCK_CACHED, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return -EINVAL;
+    }
+    
+    // Blocks another thread's cache handed out go back to that thread
+    int owner = __atomic_load_n(&block_owner(pool)[idx], __ATOMIC_RELAXED);
+    if (owner != 0 && owner != pcp->id) {
+        remote_push(pool->pcp_by_id[owner], idx);
+        return OK;
+    }
+    
+    link_of(pool, idx)->next = pcp->head[rank];
+    pcp->head[rank] = idx;
+    pcp->count[rank]++;
+    
+    // Drain an overfull cache back down to low
+    int high = __atomic_load_n(&pool->pcp_high, __ATOMIC_RELAXED);
+    if (pcp->count[rank] > high) {
+        int low = __atomic_load_n(&pool->pcp_low, __ATOMIC_RELAXED);
+        pcp_drain(pcp, rank, pcp->count[rank] - low);
+    }
+    return OK;
+}
+
+static int list_free(buddy_pool_t *bp, void *p) {
+    list_pool_t *pool = to_list(bp);
+    long idx = pool_page(base_addr(pool), 0, pool->total_pages, p);
+    if (idx == NO_PAGE) {
+        return -EINVAL;
+    }
+    
+    // Check if page is aligned
+    if (((char*)p - base_addr(pool)) % PAGE_SIZE != 0) {
+        return -EINVAL;
+    }
+    
+    // Only the head of an allocated block may be returned
+    unsigned char head = head_get(pool, idx);
+    if ((head & (BLOCK_ALLOCATED | BLOCK_CACHED)) != BLOCK_ALLOCATED) {
+        return -EINVAL;
+    }
+    
+    int rank = head & BLOCK_RANK_MASK;
+    if (rank < 1 || rank > MAX_RANK) {
+        return -EINVAL;
+    }
+    
+    int ret;
+    if (head & BLOCK_CHUNK) {
+        ret = chunk_free(pool, idx, head);
+    } else {
+        struct pcp *pcp = rank <= BUDDY_PCP_MAX_RANK ? pcp_get(pool) : NULL;
+        ret = pcp != NULL ? pcp_free(pcp, idx, head)
+                          : rank_free(pool, idx, head);
+    }
+    if (ret == OK) {
+        stat_add(bp, frees[rank], 1);
+    }
+    return ret;
+}
+
+// Sort in-pool pointers by page index: an LSD radix sort, one pass per
+// byte of the largest index, falling back to qsort() for small batches or
+// when no scratch space is available.
+static void sort_by_page(list_pool_t *pool, void **ptrs, int n) {
+    void **tmp = n > 64 ? malloc(sizeof(void*) * n) : NULL;
+    if (tmp == NULL) {
+        qsort(ptrs, n, sizeof(void*), ptr_cmp);
+        return;
+    }
+    
+    char *base = base_addr(pool);
+    void **src = ptrs, **dst = tmp;
+    for (int shift = 0; (pool->total_pages - 1) >> shift; shift += 8) {
+        int count[257] = {0};
+        for (int i = 0; i < n; i++) {
+            count[((page_index(base, src[i]) >> shift) & 0xff) + 1]++;
+        }
+        for (int d = 0; d < 256; d++) {
+            count[d + 1] += count[d];
+        }
+        for (int i = 0; i < n; i++) {
+            dst[count[(page_index(base, src[i]) >> shift) & 0xff]++] = src[i];
+        }
+        void **t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != ptrs) {
+        for (int i = 0; i < n; i++) {
+            ptrs[i] = src[i];
+        }
+    }
+    free(tmp);
+}
+
+int buddy_list_free_bulk_begin(buddy_pool_t *bp, void **ptrs, int n) {
+    list_pool_t *pool = to_list(bp);
+    
+    // Range check first so that every pointer has a page index to sort by
+    for (int i = 0; i < n; i++) {
+        if (pool_page(base_addr(pool), 0, pool->total_pages,
+                      ptrs[i]) == NO_PAGE ||
+            ((char*)ptrs[i] - base_addr(pool)) % PAGE_SIZE != 0) {
+            return -EINVAL;
+        }
+    }
+    sort_by_page(pool, ptrs, n);
+    
+    mutex_lock(&pool->chunk_lock);
+    lock_ranks(pool, 1, MAX_RANK);
+    
+    // Validate everything before freeing anything
+    for (int i = 0; i < n; i++) {
+        long idx = page_index(base_addr(pool), ptrs[i]);
+        if ((head_get(pool, idx) & (BLOCK_ALLOCATED | BLOCK_CACHED)) !=
+                BLOCK_ALLOCATED ||
+            (i > 0 && ptrs[i] == ptrs[i - 1])) {
+            buddy_list_free_bulk_cancel(bp);
+            return -EINVAL;
+        }
+    }
+    return OK;
+}
+
+void buddy_list_free_bulk_cancel(buddy_pool_t *bp) {
+    list_pool_t *pool = to_list(bp);
+    unlock_ranks(pool, 1, MAX_RANK);
+    pthread_mutex_unlock(&pool->chunk_lock);
+}
+
+void buddy_list_free_bulk_commit(buddy_pool_t *bp, void **ptrs, int n) {
+    list_pool_t *pool = to_list(bp);
+    
+    // Coalesce bottom-up in address order.  A block whose right buddy may
+    // still be freed later in the batch waits on the pending stack; pending
+    // blocks nest, so each has a strictly smaller rank than the one below
+    // it and the stack never holds more than MAX_RANK entries.
+    long pending_idx[MAX_RANK];
+    int pending_rank[MAX_RANK];
+    int top = 0;
+    for (int i = 0; i < n; i++) {
+        long idx = page_index(base_addr(pool), ptrs[i]);
+        unsigned char head = head_get(pool, idx);
+        int rank = head & BLOCK_RANK_MASK;
+        head_set(pool, idx, 0);
+        stat_add(bp, frees[rank], 1);
+        
+        // A chunk block only reaches the buddy lists as part of its chunk,
+        // once the last block in it is freed.  No other entry can lie
+        // inside the chunk, so this keeps the batch in address order.
+        if (head & BLOCK_CHUNK) {
+            if (!chunk_clear(pool, idx, rank)) {
+                continue;
+            }
+            idx &= ~(long)(CHUNK_PAGES - 1);
+            rank = BUDDY_CHUNK_RANK;
+        }
+        
+        // Pending blocks whose right buddy lies wholly before idx are final
+        while (top > 0 && pending_idx[top - 1] +
+                          2 * pages_for_rank(pending_rank[top - 1]) <= idx) {
+            top--;
+            list_add(pool, pending_rank[top], pending_idx[top]);
+            head_set(pool, pending_idx[top], pending_rank[top]);
+        }
+        
+        int pending = 0;
+        int first_rank = rank;
+        while (rank < MAX_RANK) {
+            long pages = pages_for_rank(rank);
+            long buddy_idx = get_buddy_index(idx, rank);
+            if (buddy_idx < 0 || buddy_idx + pages > pool->total_pages) {
+                break;
+            }
+            
+            if (buddy_idx < idx && top > 0 &&
+                pending_idx[top - 1] == buddy_idx &&
+                pending_rank[top - 1] == rank) {
+                // Left buddy was freed earlier in this batch
+                top--;
+            } else if (head_get(pool, buddy_idx) == rank) {
+                // Buddy was already free
+                list_remove(pool, rank, buddy_idx);
+                head_set(pool, buddy_idx, 0);
+            } else {
+                // A right buddy may still be completed by later entries
+                pending = buddy_idx > idx;
+                break;
+            }
+            if (buddy_idx < idx) {
+                idx = buddy_idx;
+            }
+            rank++;
+            stat_add(bp, merges[rank], 1);
+        }
+        stat_depth(bp, rank - first_rank);
+        
+        if (pending) {
+            pending_idx[top] = idx;
+            pending_rank[top] = rank;
+            top++;
+            continue;
+        }
+        
+        // idx can no longer grow, so neither can anything waiting on it
+        while (top > 0) {
+            top--;
+            list_add(pool, pending_rank[top], pending_idx[top]);
+            head_set(pool, pending_idx[top], pending_rank[top]);
+        }
+        list_add(pool, rank, idx);
+        head_set(pool, idx, rank);
+    }
+    while (top > 0) {
+        top--;
+        list_add(pool, pending_rank[top], pending_idx[top]);
+        head_set(pool, pending_idx[top], pending_rank[top]);
+    }
+    
+    unlock_ranks(pool, 1, MAX_RANK);
+    pthread_mutex_unlock(&pool->chunk_lock);
+}
+
+static int list_free_bulk(buddy_pool_t *bp, void **ptrs, int n) {
+    int ret = buddy_list_free_bulk_begin(bp, ptrs, n);
+    if (ret == OK) {
+        buddy_list_free_bulk_commit(bp, ptrs, n);
+    }
+    return ret;
+}
+
+static int list_set_pcp(buddy_pool_t *bp, int high, int low) {
+    list_pool_t *pool = to_list(bp);
+    // Caches are private to a process, and so are the block owners
+    if (pool->flags & BUDDY_POOL_SHARED) {
+        return high == 0 ? OK : -EINVAL;
+    }
+    
+    mutex_lock(&pool->pcp_lock);
+    if (!pool->pcp_key_valid) {
+        if (pthread_key_create(&pool->pcp_key, pcp_thread_exit) != 0) {
+            pthread_mutex_unlock(&pool->pcp_lock);
+            return -ENOMEM;
+        }
+        pool->pcp_key_valid = 1;
+    }
+    __atomic_store_n(&pool->pcp_low, low, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->pcp_high, high, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->pcp_lock);
+    
+    return OK;
+}
+
+static void list_drain_pcp(buddy_pool_t *bp) {
+    list_pool_t *pool = to_list(bp);
+    if (!pool->pcp_key_valid) {
+        return;
+    }
+    
+    struct pcp *pcp = pthread_getspecific(pool->pcp_key);
+    if (pcp != NULL) {
+        pcp_take_remote(pcp);
+        pcp_drain_all(pcp);
+    }
+    remote_reclaim(pool);
+}
+
+static int list_set_chunks(buddy_pool_t *bp, int on) {
+    list_pool_t *pool = to_list(bp);
+    __atomic_store_n(&pool->chunks_on, on != 0, __ATOMIC_RELAXED);
+    
+    return OK;
+}
+
+static int list_set_lazy(buddy_pool_t *bp, int high) {
+    list_pool_t *pool = to_list(bp);
+    __atomic_store_n(&pool->lazy_high, high, __ATOMIC_RELAXED);
+    
+    return OK;
+}
+
+static void list_coalesce(buddy_pool_t *bp) {
+    list_pool_t *pool = to_list(bp);
+    if (pool->pcp_key_valid) {
+        remote_reclaim(pool);
+    }
+    coalesce_all(pool);
+}
+
+static int list_query_ranks(buddy_pool_t *bp, void *p) {
+    list_pool_t *pool = to_list(bp);
+    long idx = pool_page(base_addr(pool), 0, pool->total_pages, p);
+    if (idx == NO_PAGE) {
+        return -EINVAL;
+    }
+    
+    // A free page inside a reserved chunk belongs to no block of its own
+    long head = find_block_head(pool, idx);
+    if (head < 0) {
+        if (__atomic_load_n(&chunk_map(pool)[idx >> CHUNK_SHIFT],
+                            __ATOMIC_RELAXED) != 0) {
+            return BUDDY_CHUNK_RANK;
+        }
+        return -EINVAL;
+    }
+    
+    return head_get(pool, head) & BLOCK_RANK_MASK;
+}
+
+static void list_query_counts(buddy_pool_t *bp, int out[MAX_RANK + 1]) {
+    list_pool_t *pool = to_list(bp);
+    out[0] = 0;
+    for (int i = 1; i <= MAX_RANK; i++) {
+        out[i] = __atomic_load_n(&pool->free_count[i], __ATOMIC_RELAXED);
+    }
+}
+
+static int list_largest_rank(buddy_pool_t *bp) {
+    unsigned int mask = __atomic_load_n(&to_list(bp)->free_mask,
+                                        __ATOMIC_RELAXED);
+    return mask != 0 ? 31 - __builtin_clz(mask) : 0;
+}
+
+static void list_stats(buddy_pool_t *bp, struct buddy_pool_stats *st) {
+    list_pool_t *pool = to_list(bp);
+    int counts[MAX_RANK + 1];
+    list_query_counts(bp, counts);
+    stats_from_counts(counts, st);
+    st->total_pages = pool->total_pages - pool->first_page;
+}
+
+const struct buddy_engine buddy_list_engine = {
+    .name = "list",
+    .create = list_create,
+    .reset = list_reset,
+    .destroy = list_destroy,
+    .alloc = list_alloc,
+    .alloc_bulk = list_alloc_bulk,
+    .free = list_free,
+    .free_bulk = list_free_bulk,
+    .query_ranks = list_query_ranks,
+    .query_counts = list_query_counts,
+    .largest_rank = list_largest_rank,
+    .stats = list_stats,
+    .set_pcp = list_set_pcp,
+    .drain_pcp = list_drain_pcp,
+    .set_chunks = list_set_chunks,
+    .set_lazy = list_set_lazy,
+    .coalesce = list_coalesce,
+};
@@ -0,0 +1,548 @@
+#include "buddy_engine.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Lock-free engine in the style of the non-blocking buddy system (NBBS) of
+// Marotta et al.  The pool is a forest of complete binary trees, one per
+// MAX_RANK-sized stretch of pages, each stored heap-ordered with one status
+// byte per node: node 1 is the root, node n has children 2n and 2n + 1, and
+// the nodes at depth d are the blocks of rank MAX_RANK - d.  Statuses only
+// ever change by compare-and-swap or fetch-or, so no thread waits for
+// another; a thread preempted halfway through an operation leaves marks the
+// others work around instead of a lock they have to wait for.
+//
+// OCC marks a node allocated as a whole.  OCC_LEFT/OCC_RIGHT record that
+// something inside that child's subtree is allocated.  COAL_LEFT/COAL_RIGHT
+// are set while a free is clearing that child's side of the path, so that
+// an allocation which takes the side again in the meantime can cancel the
+// rest of the clearing.  RELEASING claims an OCC node for the thread freeing
+// it, which makes racing double frees fail cleanly.
+#define OCC_RIGHT  0x01
+#define OCC_LEFT   0x02
+#define COAL_RIGHT 0x04
+#define COAL_LEFT  0x08
+#define OCC        0x10
+#define RELEASING  0x20
+#define BUSY       (OCC | OCC_LEFT | OCC_RIGHT)
+
+#define TREE_PAGES (1L << (MAX_RANK - 1))
+#define TREE_NODES (2 * TREE_PAGES)  // Node 0 is unused
+
+// Called by an allocation just before it publishes a raised scan hint, so
+// that tests can run a free at exactly that point
+#ifndef NB_SCAN_HOOK
+#define NB_SCAN_HOOK(pool, rank)
+#endif
+
+// Pages past the end of the pool in the last tree, and carved metadata pages
+// at the front, are allocated once at init and never handed out.
+//
+// free_count[r] counts maximal free blocks of rank r, the same figure the
+// free-list engine reports.  A block is maximal exactly when its parent is
+// not OCC and has one of OCC_LEFT/OCC_RIGHT set, or when it is a free root,
+// so every successful status change adjusts the count for the node's
+// children on the spot.  scan_hint[r] is a page below which no rank-r block
+// was free when last looked at; allocations raise it and frees lower it.
+// The page is kept above a sequence number that every free covering rank r
+// bumps, so a scan publishes the page it reached only if no such free has
+// happened since it read the hint; otherwise a block freed behind the scan
+// would be hidden until the next free below it.
+typedef struct nb_pool {
+    struct buddy_pool common;
+    void *base_addr;
+    long total_pages;
+    long first_page;                // Pages below hold carved metadata
+    long ntrees;
+    int flags;
+    void *meta;                     // malloc()ed trees, NULL if carved
+    unsigned char *tree;            // ntrees * TREE_NODES status bytes
+    int free_count[MAX_RANK + 1];
+    unsigned long scan_hint[MAX_RANK + 1];
+} nb_pool_t;
+
+static inline nb_pool_t *to_nb(buddy_pool_t *pool) {
+    return (nb_pool_t*)pool;
+}
+
+static inline int node_rank(long n) {
+    return MAX_RANK - (63 - __builtin_clzl(n));
+}
+
+// First page of node n, relative to the start of its tree
+static inline long node_page(long n) {
+    int depth = 63 - __builtin_clzl(n);
+    return (n - (1L << depth)) << (MAX_RANK - 1 - depth);
+}
+
+// Node of the given rank covering page (relative to the start of its tree)
+static inline long page_node(long page, int rank) {
+    return (1L << (MAX_RANK - rank)) + (page >> (rank - 1));
+}
+
+static inline unsigned char *tree_of(nb_pool_t *pool, long page) {
+    return pool->tree + page / TREE_PAGES * TREE_NODES;
+}
+
+// The bits a parent keeps for its child n
+static inline unsigned char occ_bit(long n) {
+    return (n & 1) ? OCC_RIGHT : OCC_LEFT;
+}
+
+static inline unsigned char coal_bit(long n) {
+    return (n & 1) ? COAL_RIGHT : COAL_LEFT;
+}
+
+static inline unsigned char node_get(unsigned char *tree, long n) {
+    return __atomic_load_n(&tree[n], __ATOMIC_ACQUIRE);
+}
+
+// A node with this status has exactly one maximal free child
+static inline int has_free_child(unsigned char v) {
+    return !(v & OCC) && !(v & OCC_LEFT) != !(v & OCC_RIGHT);
+}
+
+static void account(nb_pool_t *pool, long n, unsigned char old,
+                    unsigned char new) {
+    int delta = has_free_child(new) - has_free_child(old);
+    if (delta != 0) {
+        __atomic_fetch_add(&pool->free_count[node_rank(n) - 1], delta,
+                           __ATOMIC_RELAXED);
+    }
+    if (n == 1) {
+        delta = !(new & BUSY) - !(old & BUSY);
+        if (delta != 0) {
+            __atomic_fetch_add(&pool->free_count[MAX_RANK], delta,
+                               __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Compare-and-swap a node status, keeping free_count in step
+static int node_cas(nb_pool_t *pool, unsigned char *tree, long n,
+                    unsigned char *expected, unsigned char desired) {
+    if (!__atomic_compare_exchange_n(&tree[n], expected, desired, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    account(pool, n, *expected, desired);
+    return 1;
+}
+
+// Clear the occupancy marks a free left on the ancestors of n, up to the
+// node of rank upper.  Stops early where an allocation has taken the side
+// again (its COAL bit is gone) or where the buddy side is still occupied.
+// Returns a mask of the ranks of the ancestors left wholly free, that is
+// of the blocks formed by merging.
+static unsigned int unmark(nb_pool_t *pool, unsigned char *tree, long n,
+                           int upper) {
+    unsigned int merged = 0;
+    for (long child = n, cur = n >> 1; ; child = cur, cur >>= 1) {
+        unsigned char val = node_get(tree, cur);
+        unsigned char new_val;
+        do {
+            if (!(val & coal_bit(child))) {
+                return merged;
+            }
+            new_val = val & ~(coal_bit(child) | occ_bit(child));
+        } while (!node_cas(pool, tree, cur, &val, new_val));
+        
+        if (node_rank(cur) >= upper || (new_val & occ_bit(child ^ 1))) {
+            return merged;
+        }
+        merged |= 1u << node_rank(cur);
+    }
+}
+
+// Free node n, which this thread owns, and clear its path up to the node of
+// rank upper.  The path is flagged as coalescing first, then n is released,
+// then the flags still standing are turned into cleared occupancy.  Returns
+// the ranks merged, as unmark() does.
+static unsigned int release(nb_pool_t *pool, unsigned char *tree, long n,
+                            int upper) {
+    for (long runner = n; node_rank(runner) < upper; runner >>= 1) {
+        unsigned char old = __atomic_fetch_or(&tree[runner >> 1],
+                                              coal_bit(runner),
+                                              __ATOMIC_ACQ_REL);
+        // The buddy keeps the parent occupied, so nothing above changes
+        if ((old & occ_bit(runner ^ 1)) && !(old & coal_bit(runner ^ 1))) {
+            break;
+        }
+    }
+    
+    unsigned char old = __atomic_exchange_n(&tree[n], 0, __ATOMIC_ACQ_REL);
+    account(pool, n, old, 0);
+    if (node_rank(n) < upper) {
+        return unmark(pool, tree, n, upper);
+    }
+    return 0;
+}
+
+// Claim free node n and mark its path up to the root.  Returns 0 on
+// success, with the ranks of the ancestors that were wholly free, and so
+// split, added to *split.  Otherwise returns the node that was found
+// allocated as a whole, either n itself or an ancestor, after undoing the
+// marks made on the way.
+static long try_alloc(nb_pool_t *pool, unsigned char *tree, long n,
+                      unsigned int *split) {
+    unsigned char expected = 0;
+    if (!node_cas(pool, tree, n, &expected, BUSY)) {
+        return n;
+    }
+    
+    for (long child = n, cur = n >> 1; cur >= 1; child = cur, cur >>= 1) {
+        unsigned char val = node_get(tree, cur);
+        unsigned char new_val;
+        do {
+            if (val & OCC) {
+                release(pool, tree, n, node_rank(child));
+                return cur;
+            }
+            new_val = (val & ~coal_bit(child)) | occ_bit(child);
+        } while (!node_cas(pool, tree, cur, &val, new_val));
+        
+        if (!(val & (OCC_LEFT | OCC_RIGHT))) {
+            *split |= 1u << node_rank(cur);
+        }
+    }
+    return 0;
+}
+
+// Count one split, or merge, of every rank in mask
+static void count_splits(nb_pool_t *pool, unsigned int mask) {
+    for (; mask != 0; mask &= mask - 1) {
+        stat_add(&pool->common, splits[__builtin_ctz(mask)], 1);
+    }
+}
+
+static void count_merges(nb_pool_t *pool, unsigned int mask) {
+    stat_depth(&pool->common, __builtin_popcount(mask));
+    for (; mask != 0; mask &= mask - 1) {
+        stat_add(&pool->common, merges[__builtin_ctz(mask)], 1);
+    }
+}
+
+#define HINT_SEQ_BITS 24
+#define HINT_SEQ_MASK ((1UL << HINT_SEQ_BITS) - 1)
+#define HINT_MAX_PAGES (1L << (63 - HINT_SEQ_BITS))
+
+static inline long hint_page(unsigned long hint) {
+    return hint >> HINT_SEQ_BITS;
+}
+
+// Lower the hints of ranks 1..upper to the blocks now free at page idx
+static void hint_lower(nb_pool_t *pool, long idx, int upper) {
+    for (int rank = 1; rank <= upper; rank++) {
+        long page = idx & ~(pages_for_rank(rank) - 1);
+        unsigned long hint = __atomic_load_n(&pool->scan_hint[rank],
+                                             __ATOMIC_ACQUIRE);
+        unsigned long new_hint;
+        do {
+            if (page > hint_page(hint)) {
+                page = hint_page(hint);
+            }
+            new_hint = (unsigned long)page << HINT_SEQ_BITS |
+                       ((hint + 1) & HINT_SEQ_MASK);
+        } while (!__atomic_compare_exchange_n(&pool->scan_hint[rank], &hint,
+                                              new_hint, 0, __ATOMIC_ACQ_REL,
+                                              __ATOMIC_ACQUIRE));
+    }
+}
+
+// Raise the hint of rank to page, unless it changed since it read hint
+static void hint_raise(nb_pool_t *pool, int rank, unsigned long hint,
+                       long page) {
+    NB_SCAN_HOOK(pool, rank);
+    unsigned long new_hint = (unsigned long)page << HINT_SEQ_BITS |
+                             (hint & HINT_SEQ_MASK);
+    __atomic_compare_exchange_n(&pool->scan_hint[rank], &hint, new_hint, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// Allocate the leftmost free block of the given rank.  Returns its page
+// index, or NO_PAGE if none is free.
+static long rank_alloc(nb_pool_t *pool, int rank) {
+    long pages = pages_for_rank(rank);
+    long end = pool->ntrees * TREE_PAGES;
+    unsigned long hint = __atomic_load_n(&pool->scan_hint[rank],
+                                         __ATOMIC_ACQUIRE);
+    long idx = hint_page(hint);
+    while (idx < end) {
+        unsigned char *tree = tree_of(pool, idx);
+        long base = idx & ~(TREE_PAGES - 1);
+        long n = page_node(idx - base, rank);
+        if (node_get(tree, n) & BUSY) {
+            idx += pages;
+            continue;
+        }
+        
+        unsigned int split = 0;
+        long failed = try_alloc(pool, tree, n, &split);
+        if (failed == 0) {
+            count_splits(pool, split);
+            // Nothing below idx was free when scanned
+            hint_raise(pool, rank, hint, idx + pages);
+            return idx;
+        }
+        
+        // Skip everything under the node that is allocated as a whole
+        idx = base + node_page(failed) + pages_for_rank(node_rank(failed));
+    }
+    hint_raise(pool, rank, hint, end);
+    return NO_PAGE;
+}
+
+// Allocate pages [start, end) as maximal aligned blocks that are never freed
+static void reserve_range(nb_pool_t *pool, long start, long end) {
+    long idx = start;
+    while (idx < end) {
+        int rank = MAX_RANK;
+        long pages = pages_for_rank(rank);
+        while (pages > end - idx || (idx & (pages - 1))) {
+            rank--;
+            pages = pages_for_rank(rank);
+        }
+        
+        unsigned int split = 0;
+        try_alloc(pool, tree_of(pool, idx),
+                  page_node(idx & (TREE_PAGES - 1), rank), &split);
+        
+        idx += pages;
+    }
+}
+
+static size_t meta_size(long pgcount) {
+    return (pgcount + TREE_PAGES - 1) / TREE_PAGES * TREE_NODES;
+}
+
+static void pool_reset(nb_pool_t *pool, long first) {
+    pool->first_page = first;
+    pool->ntrees = (pool->total_pages + TREE_PAGES - 1) / TREE_PAGES;
+    memset(pool->tree, 0, meta_size(pool->total_pages));
+    for (int i = 0; i <= MAX_RANK; i++) {
+        pool->free_count[i] = 0;
+        pool->scan_hint[i] = 0;
+    }
+    pool->free_count[MAX_RANK] = pool->ntrees;
+    
+    reserve_range(pool, 0, first);
+    reserve_range(pool, pool->total_pages, pool->ntrees * TREE_PAGES);
+}
+
+static buddy_pool_t *nb_create(void *p, long pgcount, int flags) {
+    nb_pool_t *pool;
+    long first = 0;
+    if (pgcount > HINT_MAX_PAGES) {
+        return ERR_PTR(-EINVAL);
+    }
+    if (flags & BUDDY_POOL_CARVE_METADATA) {
+        // The pool and its trees occupy the first pages of the region
+        size_t bytes = ((sizeof(*pool) + 7) & ~7L) + meta_size(pgcount);
+        first = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (first >= pgcount) {
+            return ERR_PTR(-EINVAL);
+        }
+        pool = p;
+        pool->meta = NULL;
+        pool->tree = (unsigned char*)p + ((sizeof(*pool) + 7) & ~7L);
+    } else {
+        pool = malloc(sizeof(*pool));
+        if (pool == NULL) {
+            return ERR_PTR(-ENOMEM);
+        }
+        pool->meta = malloc(meta_size(pgcount));
+        if (pool->meta == NULL && pgcount > 0) {
+            free(pool);
+            return ERR_PTR(-ENOMEM);
+        }
+        pool->tree = pool->meta;
+    }
+    pool->base_addr = p;
+    pool->total_pages = pgcount;
+    pool->flags = flags;
+    
+    pool_reset(pool, first);
+    
+    return &pool->common;
+}
+
+static int nb_reset(buddy_pool_t *bp, void *p, long pgcount) {
+    nb_pool_t *pool = to_nb(bp);
+    if ((pool->flags & BUDDY_POOL_CARVE_METADATA) ||
+        pgcount > HINT_MAX_PAGES) {
+        return -EINVAL;
+    }
+    
+    if (meta_size(pgcount) > meta_size(pool->total_pages)) {
+        void *meta = malloc(meta_size(pgcount));
+        if (meta == NULL) {
+            return -ENOMEM;
+        }
+        free(pool->meta);
+        pool->meta = meta;
+    }
+    pool->base_addr = p;
+    pool->total_pages = pgcount;
+    pool->tree = pool->meta;
+    
+    pool_reset(pool, 0);
+    
+    return OK;
+}
+
+static void nb_destroy(buddy_pool_t *bp) {
+    nb_pool_t *pool = to_nb(bp);
+    if (pool->flags & BUDDY_POOL_CARVE_METADATA) {
+        return;
+    }
+    free(pool->meta);
+    free(pool);
+}
+
+// Walk down from the root to the node that holds page idx as a whole: the
+// allocated block containing it, or the maximal free block if with_free.
+// Returns 0 when there is none.
+static long find_node(nb_pool_t *pool, long idx, int with_free) {
+    unsigned char *tree = tree_of(pool, idx);
+    long page = idx & (TREE_PAGES - 1);
+    long n = 1;
+    for (;;) {
+        unsigned char val = node_get(tree, n);
+        if (val & OCC) {
+            return n;
+        }
+        if (!(val & (OCC_LEFT | OCC_RIGHT))) {
+            return with_free ? n : 0;
+        }
+        int rank = node_rank(n);
+        n = page_node(page, rank - 1);
+    }
+}
+
+// Claim the allocated block headed by page idx for freeing
+static long claim(nb_pool_t *pool, long idx) {
+    long n = find_node(pool, idx, 0);
+    if (n == 0 || node_page(n) != (idx & (TREE_PAGES - 1))) {
+        return 0;
+    }
+    
+    unsigned char *tree = tree_of(pool, idx);
+    unsigned char expected = BUSY;
+    if (!node_cas(pool, tree, n, &expected, BUSY | RELEASING)) {
+        return 0;
+    }
+    return n;
+}
+
+static void unclaim(nb_pool_t *pool, long idx, long n) {
+    __atomic_store_n(&tree_of(pool, idx)[n], BUSY, __ATOMIC_RELEASE);
+}
+
+static void free_claimed(nb_pool_t *pool, long idx, long n) {
+    unsigned int merged = release(pool, tree_of(pool, idx), n, MAX_RANK);
+    count_merges(pool, merged);
+    stat_add(&pool->common, frees[node_rank(n)], 1);
+    hint_lower(pool, idx,
+               merged != 0 ? 31 - __builtin_clz(merged) : node_rank(n));
+}
+
+static void *nb_alloc(buddy_pool_t *bp, int rank) {
+    nb_pool_t *pool = to_nb(bp);
+    long idx = rank_alloc(pool, rank);
+    if (idx == NO_PAGE) {
+        return ERR_PTR(-ENOSPC);
+    }
+    return page_addr(pool->base_addr, idx);
+}
+
+static int nb_free(buddy_pool_t *bp, void *p) {
+    nb_pool_t *pool = to_nb(bp);
+    long idx = pool_page(pool->base_addr, pool->first_page,
+                         pool->total_pages, p);
+    if (idx == NO_PAGE) {
+        return -EINVAL;
+    }
+    
+    // Check if page is aligned
+    if (((char*)p - (char*)pool->base_addr) % PAGE_SIZE != 0) {
+        return -EINVAL;
+    }
+    
+    long n = claim(pool, idx);
+    if (n == 0) {
+        return -EINVAL;
+    }
+    free_claimed(pool, idx, n);
+    
+    return OK;
+}
+
+static int nb_free_bulk(buddy_pool_t *bp, void **ptrs, int n) {
+    nb_pool_t *pool = to_nb(bp);
+    for (int i = 0; i < n; i++) {
+        if (pool_page(pool->base_addr, pool->first_page, pool->total_pages,
+                      ptrs[i]) == NO_PAGE ||
+            ((char*)ptrs[i] - (char*)pool->base_addr) % PAGE_SIZE != 0) {
+            return -EINVAL;
+        }
+    }
+    qsort(ptrs, n, sizeof(void*), ptr_cmp);
+    
+    // Claim everything before freeing anything; a duplicate fails its claim.
+    // A claimed block stays OCC, so find_node() finds it again.
+    for (int i = 0; i < n; i++) {
+        if (claim(pool, page_index(pool->base_addr, ptrs[i])) == 0) {
+            while (i-- > 0) {
+                long idx = page_index(pool->base_addr, ptrs[i]);
+                unclaim(pool, idx, find_node(pool, idx, 0));
+            }
+            return -EINVAL;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        long idx = page_index(pool->base_addr, ptrs[i]);
+        free_claimed(pool, idx, find_node(pool, idx, 0));
+    }
+    
+    return OK;
+}
+
+static int nb_query_ranks(buddy_pool_t *bp, void *p) {
+    nb_pool_t *pool = to_nb(bp);
+    long idx = pool_page(pool->base_addr, pool->first_page,
+                         pool->total_pages, p);
+    if (idx == NO_PAGE) {
+        return -EINVAL;
+    }
+    
+    return node_rank(find_node(pool, idx, 1));
+}
+
+static void nb_query_counts(buddy_pool_t *bp, int out[MAX_RANK + 1]) {
+    nb_pool_t *pool = to_nb(bp);
+    out[0] = 0;
+    for (int i = 1; i <= MAX_RANK; i++) {
+        out[i] = __atomic_load_n(&pool->free_count[i], __ATOMIC_RELAXED);
+    }
+}
+
+static void nb_stats(buddy_pool_t *bp, struct buddy_pool_stats *st) {
+    nb_pool_t *pool = to_nb(bp);
+    int counts[MAX_RANK + 1];
+    nb_query_counts(bp, counts);
+    stats_from_counts(counts, st);
+    st->total_pages = pool->total_pages - pool->first_page;
+}
+
+const struct buddy_engine buddy_nb_engine = {
+    .name = "nb",
+    .create = nb_create,
+    .reset = nb_reset,
+    .destroy = nb_destroy,
+    .alloc = nb_alloc,
+    .free = nb_free,
+    .free_bulk = nb_free_bulk,
+    .query_ranks = nb_query_ranks,
+    .query_counts = nb_query_counts,
+    .stats = nb_stats,
+};
@@ -0,0 +1,238 @@
+#include "buddy_engine.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Shared-memory pools.  A POSIX shared memory segment holds one header page
+// followed by a list-engine pool created with BUDDY_POOL_CARVE_METADATA |
+// BUDDY_POOL_SHARED, so the pool, its metadata and its pages all live in
+// the segment and refer to each other by offsets.  Every process that maps
+// the segment, at whatever address, gets a handle of its own that runs the
+// list engine's operations on the pool directly; the pool's own engine
+// pointer would only be valid in one process and is left NULL.
+#define SHM_MAGIC 0x62756464u       // Set last, once the pool is ready
+
+struct shm_header {
+    unsigned int magic;
+    long pgcount;
+};
+
+typedef struct shm_pool {
+    struct buddy_pool common;
+    char *map;                      // Header page, then the pool
+    size_t size;
+    buddy_pool_t *shared;
+} shm_pool_t;
+
+static inline shm_pool_t *to_shm(buddy_pool_t *pool) {
+    return (shm_pool_t*)pool;
+}
+
+static buddy_pool_t *shm_handle(char *map, size_t size) {
+    shm_pool_t *pool = malloc(sizeof(*pool));
+    if (pool == NULL) {
+        munmap(map, size);
+        return ERR_PTR(-ENOMEM);
+    }
+    pool->common.engine = &buddy_shm_engine;
+    pool->map = map;
+    pool->size = size;
+    pool->shared = (buddy_pool_t*)(map + PAGE_SIZE);
+    buddy_stats_init(&pool->common, 0);
+    return &pool->common;
+}
+
+buddy_pool_t *buddy_pool_create_shared(const char *name, long pgcount) {
+    if (name == NULL || pgcount <= 0) {
+        return ERR_PTR(-EINVAL);
+    }
+    
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return ERR_PTR(-EINVAL);
+    }
+    size_t size = (size_t)(pgcount + 1) * PAGE_SIZE;
+    char *map = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(name);
+        return ERR_PTR(-ENOMEM);
+    }
+    
+    buddy_pool_t *shared = buddy_list_engine.create(
+        map + PAGE_SIZE, pgcount,
+        BUDDY_POOL_CARVE_METADATA | BUDDY_POOL_SHARED);
+    if (IS_ERR(shared)) {
+        munmap(map, size);
+        shm_unlink(name);
+        return shared;
+    }
+    buddy_stats_init(shared, 1);
+    struct shm_header *header = (struct shm_header*)map;
+    header->pgcount = pgcount;
+    __atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    
+    return shm_handle(map, size);
+}
+
+buddy_pool_t *buddy_pool_attach_shared(const char *name) {
+    if (name == NULL) {
+        return ERR_PTR(-EINVAL);
+    }
+    
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return ERR_PTR(-EINVAL);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 2 * PAGE_SIZE ||
+        st.st_size % PAGE_SIZE != 0) {
+        close(fd);
+        return ERR_PTR(-EINVAL);
+    }
+    size_t size = st.st_size;
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return ERR_PTR(-ENOMEM);
+    }
+    
+    // The creator may still be setting the pool up; give it a second
+    struct shm_header *header = (struct shm_header*)map;
+    struct timespec pause = {0, 1000000};
+    for (int i = 0; i < 1000; i++) {
+        if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC) {
+            break;
+        }
+        nanosleep(&pause, NULL);
+    }
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+        (size_t)(header->pgcount + 1) * PAGE_SIZE != size) {
+        munmap(map, size);
+        return ERR_PTR(-EINVAL);
+    }
+    
+    return shm_handle(map, size);
+}
+
+int buddy_pool_unlink_shared(const char *name) {
+    if (name == NULL || shm_unlink(name) != 0) {
+        return -EINVAL;
+    }
+    return OK;
+}
+
+long buddy_shared_offset(buddy_pool_t *pool, void *p) {
+    if (pool->engine != &buddy_shm_engine) {
+        return -EINVAL;
+    }
+    
+    shm_pool_t *shm = to_shm(pool);
+    if ((char*)p < shm->map + PAGE_SIZE || (char*)p >= shm->map + shm->size) {
+        return -EINVAL;
+    }
+    return (char*)p - shm->map;
+}
+
+void *buddy_shared_ptr(buddy_pool_t *pool, long offset) {
+    if (pool->engine != &buddy_shm_engine) {
+        return ERR_PTR(-EINVAL);
+    }
+    
+    shm_pool_t *shm = to_shm(pool);
+    if (offset < PAGE_SIZE || (size_t)offset >= shm->size) {
+        return ERR_PTR(-EINVAL);
+    }
+    return shm->map + offset;
+}
+
+static int shm_reset(buddy_pool_t *bp, void *p, long pgcount) {
+    (void)bp;
+    (void)p;
+    (void)pgcount;
+    return -EINVAL;
+}
+
+// Detach only; the segment lives on until it is unlinked and unmapped
+// everywhere
+static void shm_destroy(buddy_pool_t *bp) {
+    shm_pool_t *pool = to_shm(bp);
+    munmap(pool->map, pool->size);
+    free(pool);
+}
+
+static void *shm_alloc(buddy_pool_t *bp, int rank) {
+    return buddy_list_engine.alloc(to_shm(bp)->shared, rank);
+}
+
+static int shm_alloc_bulk(buddy_pool_t *bp, int rank, int n, void **out) {
+    return buddy_list_engine.alloc_bulk(to_shm(bp)->shared, rank, n, out);
+}
+
+static int shm_free(buddy_pool_t *bp, void *p) {
+    return buddy_list_engine.free(to_shm(bp)->shared, p);
+}
+
+static int shm_free_bulk(buddy_pool_t *bp, void **ptrs, int n) {
+    return buddy_list_engine.free_bulk(to_shm(bp)->shared, ptrs, n);
+}
+
+static int shm_query_ranks(buddy_pool_t *bp, void *p) {
+    return buddy_list_engine.query_ranks(to_shm(bp)->shared, p);
+}
+
+static void shm_query_counts(buddy_pool_t *bp, int out[MAX_RANK + 1]) {
+    buddy_list_engine.query_counts(to_shm(bp)->shared, out);
+}
+
+static int shm_largest_rank(buddy_pool_t *bp) {
+    return buddy_list_engine.largest_rank(to_shm(bp)->shared);
+}
+
+static void shm_stats(buddy_pool_t *bp, struct buddy_pool_stats *st) {
+    buddy_list_engine.stats(to_shm(bp)->shared, st);
+}
+
+static int shm_set_chunks(buddy_pool_t *bp, int on) {
+    return buddy_list_engine.set_chunks(to_shm(bp)->shared, on);
+}
+
+static int shm_set_lazy(buddy_pool_t *bp, int high) {
+    return buddy_list_engine.set_lazy(to_shm(bp)->shared, high);
+}
+
+static void shm_coalesce(buddy_pool_t *bp) {
+    buddy_list_engine.coalesce(to_shm(bp)->shared);
+}
+
+// The handle counts this process's allocations, the pool everything the
+// engine does for all of them
+static void shm_counters(buddy_pool_t *bp, struct buddy_stats *st) {
+    buddy_stats_add(to_shm(bp)->shared, st);
+}
+
+// Created only through buddy_pool_create_shared(), so there is no create
+const struct buddy_engine buddy_shm_engine = {
+    .name = "shm",
+    .reset = shm_reset,
+    .destroy = shm_destroy,
+    .alloc = shm_alloc,
+    .alloc_bulk = shm_alloc_bulk,
+    .free = shm_free,
+    .free_bulk = shm_free_bulk,
+    .query_ranks = shm_query_ranks,
+    .query_counts = shm_query_counts,
+    .largest_rank = shm_largest_rank,
+    .stats = shm_stats,
+    .set_chunks = shm_set_chunks,
+    .set_lazy = shm_set_lazy,
+    .coalesce = shm_coalesce,
+    .counters = shm_counters,
+};
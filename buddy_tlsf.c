@@ -0,0 +1,464 @@
+#include "buddy_engine.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// Two-level segregated fit (TLSF) engine over runs of whole pages.  Blocks
+// have any length and are kept as physically adjacent runs: allocation
+// splits the front off a free run, and a free merges with both neighbours
+// straight away, so no two free runs ever touch.
+//
+// Free runs are binned by length n: the first level is floor(log2(n)) and
+// the second splits each power-of-two range into SL_COUNT equal bins (bins
+// below SL_COUNT pages hold a single length each).  Two bitmaps record the
+// non-empty bins.  A request is rounded up to the next bin boundary, so that
+// any run in the first non-empty bin at or above it fits; finding that bin
+// is a couple of find-first-set operations, and a free is O(1) regardless of
+// pool size.  Only when no larger bin has a run is the request's own bin
+// walked, so that a fitting run there is never missed; an allocation is
+// therefore O(1) except in that case, whose worst case is a walk of every
+// free run in one bin.
+//
+// All metadata lives in side arrays indexed by page: the run length at the
+// first and the last page of every block, its state at the first page, and
+// the bin links at the first page of every free run.  One lock per pool.
+#define SL_SHIFT 4
+#define SL_COUNT (1 << SL_SHIFT)
+#define FL_COUNT 64
+
+#define RUN_FREE 1
+#define RUN_USED 2
+
+typedef struct tlsf_pool {
+    struct buddy_pool common;
+    pthread_mutex_t lock;
+    void *base_addr;
+    long total_pages;
+    long first_page;                // Pages below hold carved metadata
+    int flags;
+    void *meta;                     // malloc()ed metadata, NULL if carved
+    unsigned long fl_bitmap;        // Bit f set iff sl_bitmap[f] != 0
+    unsigned int sl_bitmap[FL_COUNT];
+    long bins[FL_COUNT][SL_COUNT];  // First page of each bin's first run
+    int free_count[MAX_RANK + 1];   // Free runs by the largest rank they fit
+    long free_pages;
+    long *length;                   // total_pages entries
+    long *next;                     // total_pages entries
+    long *prev;                     // total_pages entries
+    unsigned char *state;           // total_pages entries
+} tlsf_pool_t;
+
+static inline tlsf_pool_t *to_tlsf(buddy_pool_t *pool) {
+    return (tlsf_pool_t*)pool;
+}
+
+static inline int floor_log2(long n) {
+    return 63 - __builtin_clzl(n);
+}
+
+// Largest rank a run of n pages could hold, capped at MAX_RANK
+static inline int run_rank(long n) {
+    int rank = floor_log2(n) + 1;
+    return rank < MAX_RANK ? rank : MAX_RANK;
+}
+
+// Smallest rank that holds n pages
+static inline int block_rank(long n) {
+    return n == 1 ? 1 : floor_log2(n - 1) + 2;
+}
+
+static void bin_of(long n, int *fl, int *sl) {
+    int f = floor_log2(n);
+    *fl = f;
+    if (f < SL_SHIFT) {
+        *sl = (int)(n << (SL_SHIFT - f)) ^ SL_COUNT;
+    } else {
+        *sl = (int)(n >> (f - SL_SHIFT)) ^ SL_COUNT;
+    }
+}
+
+static void run_insert(tlsf_pool_t *pool, long idx, long n) {
+    int fl, sl;
+    bin_of(n, &fl, &sl);
+    pool->next[idx] = pool->bins[fl][sl];
+    pool->prev[idx] = NO_PAGE;
+    if (pool->bins[fl][sl] != NO_PAGE) {
+        pool->prev[pool->bins[fl][sl]] = idx;
+    }
+    pool->bins[fl][sl] = idx;
+    pool->sl_bitmap[fl] |= 1u << sl;
+    pool->fl_bitmap |= 1UL << fl;
+    
+    pool->state[idx] = RUN_FREE;
+    pool->length[idx] = n;
+    pool->length[idx + n - 1] = n;
+    pool->free_count[run_rank(n)]++;
+    pool->free_pages += n;
+}
+
+static void run_remove(tlsf_pool_t *pool, long idx) {
+    long n = pool->length[idx];
+    int fl, sl;
+    bin_of(n, &fl, &sl);
+    if (pool->prev[idx] != NO_PAGE) {
+        pool->next[pool->prev[idx]] = pool->next[idx];
+    } else {
+        pool->bins[fl][sl] = pool->next[idx];
+    }
+    if (pool->next[idx] != NO_PAGE) {
+        pool->prev[pool->next[idx]] = pool->prev[idx];
+    }
+    if (pool->bins[fl][sl] == NO_PAGE) {
+        pool->sl_bitmap[fl] &= ~(1u << sl);
+        if (pool->sl_bitmap[fl] == 0) {
+            pool->fl_bitmap &= ~(1UL << fl);
+        }
+    }
+    
+    pool->state[idx] = 0;
+    pool->free_count[run_rank(n)]--;
+    pool->free_pages -= n;
+}
+
+// A free run of at least n pages, or NO_PAGE
+static long run_find(tlsf_pool_t *pool, long n) {
+    // Nothing fits past the free pages, and rounding n up could overflow
+    if (n > pool->free_pages) {
+        return NO_PAGE;
+    }
+    
+    // Round up to the next bin boundary so that every run in the bin fits
+    long want = n;
+    if (floor_log2(n) >= SL_SHIFT) {
+        want += (1L << (floor_log2(n) - SL_SHIFT)) - 1;
+    }
+    int fl, sl;
+    bin_of(want, &fl, &sl);
+    
+    unsigned int sl_map = pool->sl_bitmap[fl] & (~0u << sl);
+    if (sl_map == 0) {
+        unsigned long fl_map = fl + 1 < FL_COUNT ?
+                               pool->fl_bitmap & (~0UL << (fl + 1)) : 0;
+        if (fl_map != 0) {
+            fl = __builtin_ctzl(fl_map);
+            sl_map = pool->sl_bitmap[fl];
+        }
+    }
+    if (sl_map != 0) {
+        return pool->bins[fl][__builtin_ctz(sl_map)];
+    }
+    
+    // Nothing larger is free, but a run in n's own bin may still fit
+    bin_of(n, &fl, &sl);
+    for (long idx = pool->bins[fl][sl]; idx != NO_PAGE;
+         idx = pool->next[idx]) {
+        if (pool->length[idx] >= n) {
+            return idx;
+        }
+    }
+    return NO_PAGE;
+}
+
+static long run_alloc(tlsf_pool_t *pool, long n) {
+    long idx = run_find(pool, n);
+    if (idx == NO_PAGE) {
+        return NO_PAGE;
+    }
+    
+    long have = pool->length[idx];
+    run_remove(pool, idx);
+    if (have > n) {
+        run_insert(pool, idx + n, have - n);
+        stat_add(&pool->common, splits[run_rank(have)], 1);
+    }
+    pool->state[idx] = RUN_USED;
+    pool->length[idx] = n;
+    pool->length[idx + n - 1] = n;
+    
+    return idx;
+}
+
+static void run_free(tlsf_pool_t *pool, long idx) {
+    long n = pool->length[idx];
+    pool->state[idx] = 0;
+    stat_add(&pool->common,
+             frees[n > pages_for_rank(MAX_RANK) ? MAX_RANK : block_rank(n)], 1);
+    
+    // Merge with the run in front, found through its last page
+    int depth = 0;
+    if (idx > pool->first_page) {
+        long prev = idx - pool->length[idx - 1];
+        if (pool->state[prev] == RUN_FREE) {
+            n += pool->length[prev];
+            run_remove(pool, prev);
+            idx = prev;
+            stat_add(&pool->common, merges[run_rank(n)], 1);
+            depth++;
+        }
+    }
+    
+    // Merge with the run behind
+    long next = idx + n;
+    if (next < pool->total_pages && pool->state[next] == RUN_FREE) {
+        n += pool->length[next];
+        run_remove(pool, next);
+        stat_add(&pool->common, merges[run_rank(n)], 1);
+        depth++;
+    }
+    stat_depth(&pool->common, depth);
+    
+    run_insert(pool, idx, n);
+}
+
+static size_t meta_size(long pgcount) {
+    return pgcount * (3 * sizeof(long)) + ((pgcount + 7) & ~7L);
+}
+
+static void pool_set_meta(tlsf_pool_t *pool, void *meta) {
+    pool->length = meta;
+    pool->next = pool->length + pool->total_pages;
+    pool->prev = pool->next + pool->total_pages;
+    pool->state = (unsigned char*)(pool->prev + pool->total_pages);
+}
+
+static void pool_reset(tlsf_pool_t *pool, long first) {
+    pool->first_page = first;
+    pool->fl_bitmap = 0;
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        pool->sl_bitmap[fl] = 0;
+        for (int sl = 0; sl < SL_COUNT; sl++) {
+            pool->bins[fl][sl] = NO_PAGE;
+        }
+    }
+    for (int i = 0; i <= MAX_RANK; i++) {
+        pool->free_count[i] = 0;
+    }
+    pool->free_pages = 0;
+    
+    for (long i = 0; i < pool->total_pages; i++) {
+        pool->state[i] = 0;
+    }
+    if (first < pool->total_pages) {
+        run_insert(pool, first, pool->total_pages - first);
+    }
+}
+
+static buddy_pool_t *tlsf_create(void *p, long pgcount, int flags) {
+    tlsf_pool_t *pool;
+    long first = 0;
+    if (flags & BUDDY_POOL_CARVE_METADATA) {
+        // The pool and its metadata occupy the first pages of the region
+        size_t bytes = ((sizeof(*pool) + 7) & ~7L) + meta_size(pgcount);
+        first = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (first >= pgcount) {
+            return ERR_PTR(-EINVAL);
+        }
+        pool = p;
+        pool->meta = NULL;
+        pool->total_pages = pgcount;
+        pool_set_meta(pool, (char*)p + ((sizeof(*pool) + 7) & ~7L));
+    } else {
+        pool = malloc(sizeof(*pool));
+        if (pool == NULL) {
+            return ERR_PTR(-ENOMEM);
+        }
+        pool->meta = malloc(meta_size(pgcount));
+        if (pool->meta == NULL && pgcount > 0) {
+            free(pool);
+            return ERR_PTR(-ENOMEM);
+        }
+        pool->total_pages = pgcount;
+        pool_set_meta(pool, pool->meta);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->base_addr = p;
+    pool->flags = flags;
+    
+    pool_reset(pool, first);
+    
+    return &pool->common;
+}
+
+static int tlsf_reset(buddy_pool_t *bp, void *p, long pgcount) {
+    tlsf_pool_t *pool = to_tlsf(bp);
+    if (pool->flags & BUDDY_POOL_CARVE_METADATA) {
+        return -EINVAL;
+    }
+    
+    if (meta_size(pgcount) > meta_size(pool->total_pages)) {
+        void *meta = malloc(meta_size(pgcount));
+        if (meta == NULL) {
+            return -ENOMEM;
+        }
+        free(pool->meta);
+        pool->meta = meta;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->base_addr = p;
+    pool->total_pages = pgcount;
+    pool_set_meta(pool, pool->meta);
+    
+    pool_reset(pool, 0);
+    pthread_mutex_unlock(&pool->lock);
+    
+    return OK;
+}
+
+static void tlsf_destroy(buddy_pool_t *bp) {
+    tlsf_pool_t *pool = to_tlsf(bp);
+    pthread_mutex_destroy(&pool->lock);
+    if (pool->flags & BUDDY_POOL_CARVE_METADATA) {
+        return;
+    }
+    free(pool->meta);
+    free(pool);
+}
+
+// Page index of p if it is the start of a page of the pool, NO_PAGE
+// otherwise
+static long run_page(tlsf_pool_t *pool, void *p) {
+    long idx = pool_page(pool->base_addr, pool->first_page,
+                         pool->total_pages, p);
+    if (idx == NO_PAGE ||
+        ((char*)p - (char*)pool->base_addr) % PAGE_SIZE != 0) {
+        return NO_PAGE;
+    }
+    return idx;
+}
+
+static void *tlsf_alloc_npages(buddy_pool_t *bp, long npages) {
+    tlsf_pool_t *pool = to_tlsf(bp);
+    pthread_mutex_lock(&pool->lock);
+    long idx = run_alloc(pool, npages);
+    pthread_mutex_unlock(&pool->lock);
+    if (idx == NO_PAGE) {
+        return ERR_PTR(-ENOSPC);
+    }
+    return page_addr(pool->base_addr, idx);
+}
+
+static int tlsf_alloc_bulk(buddy_pool_t *bp, int rank, int n, void **out) {
+    tlsf_pool_t *pool = to_tlsf(bp);
+    int got = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (got < n) {
+        long idx = run_alloc(pool, pages_for_rank(rank));
+        if (idx == NO_PAGE) {
+            break;
+        }
+        out[got++] = page_addr(pool->base_addr, idx);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    return got;
+}
+
+static int tlsf_free(buddy_pool_t *bp, void *p) {
+    tlsf_pool_t *pool = to_tlsf(bp);
+    long idx = run_page(pool, p);
+    if (idx == NO_PAGE) {
+        return -EINVAL;
+    }
+    
+    int ret = -EINVAL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->state[idx] == RUN_USED) {
+        run_free(pool, idx);
+        ret = OK;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    return ret;
+}
+
+static int tlsf_free_bulk(buddy_pool_t *bp, void **ptrs, int n) {
+    tlsf_pool_t *pool = to_tlsf(bp);
+    for (int i = 0; i < n; i++) {
+        if (run_page(pool, ptrs[i]) == NO_PAGE) {
+            return -EINVAL;
+        }
+    }
+    qsort(ptrs, n, sizeof(void*), ptr_cmp);
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    // Validate everything before freeing anything
+    for (int i = 0; i < n; i++) {
+        if (pool->state[page_index(pool->base_addr, ptrs[i])] != RUN_USED ||
+            (i > 0 && ptrs[i] == ptrs[i - 1])) {
+            pthread_mutex_unlock(&pool->lock);
+            return -EINVAL;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        run_free(pool, page_index(pool->base_addr, ptrs[i]));
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+    
+    return OK;
+}
+
+static int tlsf_query_ranks(buddy_pool_t *bp, void *p) {
+    tlsf_pool_t *pool = to_tlsf(bp);
+    long idx = run_page(pool, p);
+    if (idx == NO_PAGE) {
+        return -EINVAL;
+    }
+    
+    int rank = -EINVAL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->state[idx] == RUN_USED) {
+        rank = block_rank(pool->length[idx]);
+    } else if (pool->state[idx] == RUN_FREE) {
+        rank = run_rank(pool->length[idx]);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    return rank;
+}
+
+static void tlsf_query_counts(buddy_pool_t *bp, int out[MAX_RANK + 1]) {
+    tlsf_pool_t *pool = to_tlsf(bp);
+    out[0] = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 1; i <= MAX_RANK; i++) {
+        out[i] = pool->free_count[i];
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void tlsf_stats(buddy_pool_t *bp, struct buddy_pool_stats *st) {
+    tlsf_pool_t *pool = to_tlsf(bp);
+    pthread_mutex_lock(&pool->lock);
+    st->total_pages = pool->total_pages - pool->first_page;
+    st->free_pages = pool->free_pages;
+    
+    // The longest run is somewhere in the highest non-empty bin
+    st->largest_free_pages = 0;
+    if (pool->fl_bitmap != 0) {
+        int fl = 63 - __builtin_clzl(pool->fl_bitmap);
+        int sl = 31 - __builtin_clz(pool->sl_bitmap[fl]);
+        for (long idx = pool->bins[fl][sl]; idx != NO_PAGE;
+             idx = pool->next[idx]) {
+            if (pool->length[idx] > st->largest_free_pages) {
+                st->largest_free_pages = pool->length[idx];
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+const struct buddy_engine buddy_tlsf_engine = {
+    .name = "tlsf",
+    .create = tlsf_create,
+    .reset = tlsf_reset,
+    .destroy = tlsf_destroy,
+    .alloc_npages = tlsf_alloc_npages,
+    .alloc_bulk = tlsf_alloc_bulk,
+    .free = tlsf_free,
+    .free_bulk = tlsf_free_bulk,
+    .query_ranks = tlsf_query_ranks,
+    .query_counts = tlsf_query_counts,
+    .stats = tlsf_stats,
+};
@@ -0,0 +1,113 @@
+#include "buddy_engine.h"
+#include "buddy_trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Trace writer behind -DBUDDY_TRACE.  The file is opened by the first
+// record and flushed at exit; stdio's own lock keeps records from several
+// threads whole, and a call with items holds it across the group.  If the
+// file cannot be opened nothing is recorded.
+#define TRACE_BUFFER (1 << 20)
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static FILE *trace_file;
+static unsigned long long trace_start;
+
+// Timestamp of the group being written, under the file lock
+static uint64_t group_ns;
+
+// Pool of the last init_page(), for turning addresses into page indices
+static char *trace_base;
+static long trace_pages;
+
+static unsigned long long trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int32_t clamp32(long v) {
+    return v > INT32_MAX ? INT32_MAX : v < INT32_MIN ? INT32_MIN : v;
+}
+
+static void trace_close(void) {
+    fclose(trace_file);
+}
+
+static void trace_open(void) {
+    const char *name = getenv("BUDDY_TRACE_FILE");
+    FILE *f = fopen(name != NULL ? name : "buddy.trace", "wb");
+    if (f == NULL) {
+        return;
+    }
+    setvbuf(f, NULL, _IOFBF, TRACE_BUFFER);
+    
+    struct buddy_trace_header header;
+    memcpy(header.magic, BUDDY_TRACE_MAGIC, sizeof(header.magic));
+    header.page_size = PAGE_SIZE;
+    header.rec_size = sizeof(struct buddy_trace_rec);
+    fwrite(&header, sizeof(header), 1, f);
+    
+    trace_start = trace_clock();
+    trace_file = f;
+    atexit(trace_close);
+}
+
+void buddy_trace_record_at(int op, long arg, long ret, uint64_t ns) {
+    pthread_once(&trace_once, trace_open);
+    if (trace_file == NULL) {
+        return;
+    }
+    
+    struct buddy_trace_rec rec;
+    rec.stamp = ns << 8 | op;
+    rec.arg = clamp32(arg);
+    rec.ret = clamp32(ret);
+    fwrite(&rec, sizeof(rec), 1, trace_file);
+}
+
+void buddy_trace_record(int op, long arg, long ret) {
+    pthread_once(&trace_once, trace_open);
+    buddy_trace_record_at(op, arg, ret, trace_clock() - trace_start);
+}
+
+void buddy_trace_begin(int op, long arg, long ret) {
+    pthread_once(&trace_once, trace_open);
+    if (trace_file == NULL) {
+        return;
+    }
+    
+    flockfile(trace_file);
+    group_ns = trace_clock() - trace_start;
+    buddy_trace_record_at(op, arg, ret, group_ns);
+}
+
+void buddy_trace_item(long arg, long ret) {
+    if (trace_file != NULL) {
+        buddy_trace_record_at(BUDDY_TRACE_ITEM, arg, ret, group_ns);
+    }
+}
+
+void buddy_trace_end(void) {
+    if (trace_file != NULL) {
+        funlockfile(trace_file);
+    }
+}
+
+void buddy_trace_pool(void *p, long pgcount) {
+    trace_base = p;
+    trace_pages = pgcount;
+}
+
+long buddy_trace_page(void *p) {
+    if (trace_base == NULL || (char*)p < trace_base ||
+        (char*)p >= trace_base + trace_pages * PAGE_SIZE ||
+        ((char*)p - trace_base) % PAGE_SIZE != 0) {
+        return -1;
+    }
+    return ((char*)p - trace_base) / PAGE_SIZE;
+}
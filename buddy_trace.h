@@ -0,0 +1,105 @@
+#ifndef BUDDY_TRACE_H
+#define BUDDY_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Binary traces of the default-pool interface of buddy.h.  Built with
+ * -DBUDDY_TRACE (`make TRACE=1`), buddy.c appends one record per call to
+ * the file named by $BUDDY_TRACE_FILE, or buddy.trace in the working
+ * directory, and replay.c replays such a file against any engine.  Only
+ * init_page_shared() is not recorded, as its pool lives outside the
+ * process; slab.h's default-pool calls are recorded as the calls they
+ * make here.
+ *
+ * A trace is a struct buddy_trace_header followed by fixed-size records in
+ * host byte order.  Addresses are stored as page indices into the pool of
+ * the last init_page() call, so a trace does not depend on where the pool
+ * was mapped; an address that is not the start of a page in that pool is
+ * stored as -1, and replayed as NULL.  Values outside 32 bits are clamped.
+ * Calls from several threads are recorded in the order they complete.
+ *
+ *   op                        arg           ret
+ *   BUDDY_TRACE_INIT          pgcount       result
+ *   BUDDY_TRACE_ALLOC         rank          page index or -errno
+ *   BUDDY_TRACE_FREE          page index    result
+ *   BUDDY_TRACE_QRANK         page index    result
+ *   BUDDY_TRACE_QCOUNT        rank          result
+ *   BUDDY_TRACE_ALLOC_NPAGES  npages        page index or -errno
+ *   BUDDY_TRACE_ALLOC_BULK    rank          result
+ *   BUDDY_TRACE_FREE_BULK     n             result
+ *   BUDDY_TRACE_QALL          0             result
+ *   BUDDY_TRACE_QLARGEST      0             result
+ *   BUDDY_TRACE_QFREE         0             result
+ *   BUDDY_TRACE_SET_PCP       high          result
+ *   BUDDY_TRACE_DRAIN_PCP     0             0
+ *   BUDDY_TRACE_SET_CHUNKS    on            result
+ *   BUDDY_TRACE_SET_LAZY      high          result
+ *   BUDDY_TRACE_COALESCE      0             result
+ *   BUDDY_TRACE_STATS         0             result
+ *   BUDDY_TRACE_FRAG          0             result
+ *   BUDDY_TRACE_BUDDYINFO     size          result
+ *
+ * Calls with more arguments or results than fit in one record are followed
+ * by BUDDY_TRACE_ITEM records, written together with it:
+ *
+ *   after                     arg           ret
+ *   BUDDY_TRACE_ALLOC_BULK    n             0, then for each block
+ *                             its position  page index
+ *   BUDDY_TRACE_FREE_BULK     page index    0, for each pointer
+ *   BUDDY_TRACE_QALL          rank          count, for ranks 1..MAX_RANK
+ *   BUDDY_TRACE_SET_PCP       low           0
+ */
+#define BUDDY_TRACE_MAGIC "BUDDYTR1"
+
+enum {
+    BUDDY_TRACE_INIT = 1,
+    BUDDY_TRACE_ALLOC,
+    BUDDY_TRACE_FREE,
+    BUDDY_TRACE_QRANK,
+    BUDDY_TRACE_QCOUNT,
+    BUDDY_TRACE_ALLOC_NPAGES,
+    BUDDY_TRACE_ALLOC_BULK,
+    BUDDY_TRACE_FREE_BULK,
+    BUDDY_TRACE_QALL,
+    BUDDY_TRACE_QLARGEST,
+    BUDDY_TRACE_QFREE,
+    BUDDY_TRACE_SET_PCP,
+    BUDDY_TRACE_DRAIN_PCP,
+    BUDDY_TRACE_SET_CHUNKS,
+    BUDDY_TRACE_SET_LAZY,
+    BUDDY_TRACE_COALESCE,
+    BUDDY_TRACE_STATS,
+    BUDDY_TRACE_FRAG,
+    BUDDY_TRACE_BUDDYINFO,
+    BUDDY_TRACE_ITEM,
+};
+
+struct buddy_trace_header {
+    char magic[8];
+    uint32_t page_size;
+    uint32_t rec_size;              /* sizeof(struct buddy_trace_rec) */
+};
+
+struct buddy_trace_rec {
+    uint64_t stamp;                 /* ns since the trace began << 8 | op */
+    int32_t arg;
+    int32_t ret;
+};
+
+#define BUDDY_TRACE_OP(rec)    ((int)((rec)->stamp & 0xff))
+#define BUDDY_TRACE_NS(rec)    ((rec)->stamp >> 8)
+
+/* Pool that later addresses are turned into page indices of */
+void buddy_trace_pool(void *p, long pgcount);
+void buddy_trace_record(int op, long arg, long ret);
+/* Same with a given timestamp instead of the clock */
+void buddy_trace_record_at(int op, long arg, long ret, uint64_t ns);
+/* A record followed by items; no other thread's record comes in between */
+void buddy_trace_begin(int op, long arg, long ret);
+void buddy_trace_item(long arg, long ret);
+void buddy_trace_end(void);
+/* Page index of p in the traced pool, or -1 */
+long buddy_trace_page(void *p);
+
+#endif
@@ -0,0 +1,406 @@
+#include "buddy_engine.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// Tree engine.  One implicit binary tree spans the pool, rounded up to a
+// power of two pages: node 1 is the root, node n has children 2n and 2n + 1,
+// and the leaves 2^height .. 2^(height+1) - 1 are the pages.  A node of rank
+// r (leaves are rank 1) stores the largest rank free anywhere in its
+// subtree, so r itself when the whole node is one free block and 0 when
+// nothing under it is free.  Nodes above MAX_RANK are never blocks and only
+// carry the maximum of their children.
+//
+// Allocation follows one root-to-leaf path, at each step taking the child
+// whose largest free rank is the smallest that still fits (the left one on a
+// tie), which makes it best fit.  Freeing walks up from the page to the
+// lowest node holding 0, which is the block, marks it free again and
+// recomputes its ancestors.  Nodes below an allocated block keep the values
+// they had when it was taken; they are all full and never consulted.
+//
+// Pages past pgcount and carved metadata pages start out as allocated
+// leaves and are never handed out.
+//
+// free_count[r] counts maximal free blocks of rank r: full nodes whose
+// parent is not full.  It is updated on the same walk that recomputes the
+// ancestors.  The whole tree is protected by one lock, as every operation
+// touches the root.
+typedef struct tree_pool {
+    struct buddy_pool common;
+    pthread_mutex_t lock;
+    void *base_addr;
+    long total_pages;
+    long first_page;                // Pages below hold carved metadata
+    long leaves;                    // Pages covered by the tree, a power of 2
+    int height;                     // log2(leaves)
+    int flags;
+    void *meta;                     // malloc()ed tree, NULL if carved
+    unsigned char *tree;            // 2 * leaves entries
+    int free_count[MAX_RANK + 1];
+} tree_pool_t;
+
+static inline tree_pool_t *to_tree(buddy_pool_t *pool) {
+    return (tree_pool_t*)pool;
+}
+
+static inline int node_rank(tree_pool_t *pool, long n) {
+    return pool->height - (63 - __builtin_clzl(n)) + 1;
+}
+
+static inline long node_page(tree_pool_t *pool, long n) {
+    int rank = node_rank(pool, n);
+    return (n << (rank - 1)) - pool->leaves;
+}
+
+// Node n is one whole free block
+static inline int is_full(tree_pool_t *pool, long n) {
+    int rank = node_rank(pool, n);
+    return rank <= MAX_RANK && pool->tree[n] == rank;
+}
+
+static unsigned char node_value(tree_pool_t *pool, long n) {
+    int rank = node_rank(pool, n);
+    unsigned char left = pool->tree[2 * n];
+    unsigned char right = pool->tree[2 * n + 1];
+    if (rank <= MAX_RANK && left == rank - 1 && right == rank - 1) {
+        return rank;
+    }
+    return left > right ? left : right;
+}
+
+// Node n has just changed from old to its current value: recompute its
+// ancestors and keep free_count in step.  The children of n itself only
+// matter when n is an inner node of the walk, not the block that changed.
+// An ancestor that stops being one free block has been split, and one that
+// becomes one has been formed by a merge; returns the number of merges.
+static int propagate(tree_pool_t *pool, long n, unsigned char old) {
+    int block = 1;
+    int depth = 0;
+    for (;;) {
+        int rank = node_rank(pool, n);
+        int was_full = rank <= MAX_RANK && old == rank;
+        int now_full = is_full(pool, n);
+        if (was_full != now_full) {
+            // Counted while its parent is not full; the parent still has
+            // its old value at this point
+            int delta = now_full - was_full;
+            if (n == 1 || !is_full(pool, n >> 1)) {
+                pool->free_count[rank] += delta;
+            }
+            if (!block && rank > 1) {
+                pool->free_count[rank - 1] -= delta *
+                    (is_full(pool, 2 * n) + is_full(pool, 2 * n + 1));
+            }
+            if (!block && now_full) {
+                stat_add(&pool->common, merges[rank], 1);
+                depth++;
+            } else if (!block) {
+                stat_add(&pool->common, splits[rank], 1);
+            }
+        }
+        block = 0;
+        
+        if (n == 1) {
+            break;
+        }
+        n >>= 1;
+        old = pool->tree[n];
+        unsigned char val = node_value(pool, n);
+        if (val == old) {
+            break;
+        }
+        pool->tree[n] = val;
+    }
+    return depth;
+}
+
+// Take a block of the given rank.  Returns its page index, or NO_PAGE if
+// nothing large enough is free.
+static long rank_alloc(tree_pool_t *pool, int rank) {
+    if (pool->tree[1] < rank) {
+        return NO_PAGE;
+    }
+    
+    long n = 1;
+    for (int r = pool->height + 1; r > rank; r--) {
+        unsigned char left = pool->tree[2 * n];
+        unsigned char right = pool->tree[2 * n + 1];
+        if (left >= rank && (right < rank || left <= right)) {
+            n = 2 * n;
+        } else {
+            n = 2 * n + 1;
+        }
+    }
+    
+    pool->tree[n] = 0;
+    propagate(pool, n, rank);
+    
+    return node_page(pool, n);
+}
+
+// The allocated block headed by page idx, or 0 if there is none
+static long find_block(tree_pool_t *pool, long idx) {
+    for (long n = pool->leaves + idx; n >= 1; n >>= 1) {
+        if (pool->tree[n] == 0) {
+            return node_page(pool, n) == idx ? n : 0;
+        }
+    }
+    return 0;
+}
+
+static void block_free(tree_pool_t *pool, long n) {
+    int rank = node_rank(pool, n);
+    pool->tree[n] = rank;
+    stat_add(&pool->common, frees[rank], 1);
+    stat_depth(&pool->common, propagate(pool, n, 0));
+}
+
+static size_t meta_size(long pgcount) {
+    long leaves = 1;
+    while (leaves < pgcount) {
+        leaves *= 2;
+    }
+    return 2 * leaves;
+}
+
+// Build the tree bottom-up with pages [first, total_pages) free
+static void pool_reset(tree_pool_t *pool, long first) {
+    pool->first_page = first;
+    pool->leaves = meta_size(pool->total_pages) / 2;
+    pool->height = 63 - __builtin_clzl(pool->leaves);
+    
+    for (long i = 0; i < pool->leaves; i++) {
+        pool->tree[pool->leaves + i] = i >= first && i < pool->total_pages;
+    }
+    for (long n = pool->leaves - 1; n >= 1; n--) {
+        pool->tree[n] = node_value(pool, n);
+    }
+    
+    for (int i = 0; i <= MAX_RANK; i++) {
+        pool->free_count[i] = 0;
+    }
+    for (long n = 1; n < 2 * pool->leaves; n++) {
+        if (is_full(pool, n) && (n == 1 || !is_full(pool, n >> 1))) {
+            pool->free_count[node_rank(pool, n)]++;
+        }
+    }
+}
+
+static buddy_pool_t *tree_create(void *p, long pgcount, int flags) {
+    tree_pool_t *pool;
+    long first = 0;
+    if (flags & BUDDY_POOL_CARVE_METADATA) {
+        // The pool and its tree occupy the first pages of the region
+        size_t bytes = ((sizeof(*pool) + 7) & ~7L) + meta_size(pgcount);
+        first = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (first >= pgcount) {
+            return ERR_PTR(-EINVAL);
+        }
+        pool = p;
+        pool->meta = NULL;
+        pool->tree = (unsigned char*)p + ((sizeof(*pool) + 7) & ~7L);
+    } else {
+        pool = malloc(sizeof(*pool));
+        if (pool == NULL) {
+            return ERR_PTR(-ENOMEM);
+        }
+        pool->meta = malloc(meta_size(pgcount));
+        if (pool->meta == NULL) {
+            free(pool);
+            return ERR_PTR(-ENOMEM);
+        }
+        pool->tree = pool->meta;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->base_addr = p;
+    pool->total_pages = pgcount;
+    pool->flags = flags;
+    
+    pool_reset(pool, first);
+    
+    return &pool->common;
+}
+
+static int tree_reset(buddy_pool_t *bp, void *p, long pgcount) {
+    tree_pool_t *pool = to_tree(bp);
+    if (pool->flags & BUDDY_POOL_CARVE_METADATA) {
+        return -EINVAL;
+    }
+    
+    if (meta_size(pgcount) > meta_size(pool->total_pages)) {
+        void *meta = malloc(meta_size(pgcount));
+        if (meta == NULL) {
+            return -ENOMEM;
+        }
+        free(pool->meta);
+        pool->meta = meta;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->base_addr = p;
+    pool->total_pages = pgcount;
+    pool->tree = pool->meta;
+    
+    pool_reset(pool, 0);
+    pthread_mutex_unlock(&pool->lock);
+    
+    return OK;
+}
+
+static void tree_destroy(buddy_pool_t *bp) {
+    tree_pool_t *pool = to_tree(bp);
+    pthread_mutex_destroy(&pool->lock);
+    if (pool->flags & BUDDY_POOL_CARVE_METADATA) {
+        return;
+    }
+    free(pool->meta);
+    free(pool);
+}
+
+static void *tree_alloc(buddy_pool_t *bp, int rank) {
+    tree_pool_t *pool = to_tree(bp);
+    pthread_mutex_lock(&pool->lock);
+    long idx = rank_alloc(pool, rank);
+    pthread_mutex_unlock(&pool->lock);
+    if (idx == NO_PAGE) {
+        return ERR_PTR(-ENOSPC);
+    }
+    return page_addr(pool->base_addr, idx);
+}
+
+static int tree_alloc_bulk(buddy_pool_t *bp, int rank, int n, void **out) {
+    tree_pool_t *pool = to_tree(bp);
+    int got = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (got < n) {
+        long idx = rank_alloc(pool, rank);
+        if (idx == NO_PAGE) {
+            break;
+        }
+        out[got++] = page_addr(pool->base_addr, idx);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    return got;
+}
+
+static int tree_free(buddy_pool_t *bp, void *p) {
+    tree_pool_t *pool = to_tree(bp);
+    long idx = pool_page(pool->base_addr, pool->first_page,
+                         pool->total_pages, p);
+    if (idx == NO_PAGE) {
+        return -EINVAL;
+    }
+    
+    // Check if page is aligned
+    if (((char*)p - (char*)pool->base_addr) % PAGE_SIZE != 0) {
+        return -EINVAL;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    long n = find_block(pool, idx);
+    if (n != 0) {
+        block_free(pool, n);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    return n != 0 ? OK : -EINVAL;
+}
+
+static int tree_free_bulk(buddy_pool_t *bp, void **ptrs, int n) {
+    tree_pool_t *pool = to_tree(bp);
+    for (int i = 0; i < n; i++) {
+        if (pool_page(pool->base_addr, pool->first_page, pool->total_pages,
+                      ptrs[i]) == NO_PAGE ||
+            ((char*)ptrs[i] - (char*)pool->base_addr) % PAGE_SIZE != 0) {
+            return -EINVAL;
+        }
+    }
+    qsort(ptrs, n, sizeof(void*), ptr_cmp);
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    // Validate everything before freeing anything
+    for (int i = 0; i < n; i++) {
+        if (find_block(pool, page_index(pool->base_addr, ptrs[i])) == 0 ||
+            (i > 0 && ptrs[i] == ptrs[i - 1])) {
+            pthread_mutex_unlock(&pool->lock);
+            return -EINVAL;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        long idx = page_index(pool->base_addr, ptrs[i]);
+        block_free(pool, find_block(pool, idx));
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+    
+    return OK;
+}
+
+static int tree_query_ranks(buddy_pool_t *bp, void *p) {
+    tree_pool_t *pool = to_tree(bp);
+    long idx = pool_page(pool->base_addr, pool->first_page,
+                         pool->total_pages, p);
+    if (idx == NO_PAGE) {
+        return -EINVAL;
+    }
+    
+    // The lowest 0 node is the allocated block; otherwise the highest full
+    // node is the free block containing the page
+    int rank = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (long n = pool->leaves + idx; n >= 1; n >>= 1) {
+        if (pool->tree[n] == 0) {
+            rank = node_rank(pool, n);
+            break;
+        }
+        if (is_full(pool, n)) {
+            rank = node_rank(pool, n);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    return rank;
+}
+
+static void tree_query_counts(buddy_pool_t *bp, int out[MAX_RANK + 1]) {
+    tree_pool_t *pool = to_tree(bp);
+    out[0] = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 1; i <= MAX_RANK; i++) {
+        out[i] = pool->free_count[i];
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// The root holds the largest rank free anywhere
+static int tree_largest_rank(buddy_pool_t *bp) {
+    tree_pool_t *pool = to_tree(bp);
+    pthread_mutex_lock(&pool->lock);
+    int rank = pool->tree[1];
+    pthread_mutex_unlock(&pool->lock);
+    return rank;
+}
+
+static void tree_stats(buddy_pool_t *bp, struct buddy_pool_stats *st) {
+    tree_pool_t *pool = to_tree(bp);
+    int counts[MAX_RANK + 1];
+    tree_query_counts(bp, counts);
+    stats_from_counts(counts, st);
+    st->total_pages = pool->total_pages - pool->first_page;
+}
+
+const struct buddy_engine buddy_tree_engine = {
+    .name = "tree",
+    .create = tree_create,
+    .reset = tree_reset,
+    .destroy = tree_destroy,
+    .alloc = tree_alloc,
+    .alloc_bulk = tree_alloc_bulk,
+    .free = tree_free,
+    .free_bulk = tree_free_bulk,
+    .query_ranks = tree_query_ranks,
+    .query_counts = tree_query_counts,
+    .largest_rank = tree_largest_rank,
+    .stats = tree_stats,
+};
@@ -0,0 +1,319 @@
+/*
+ * Synthetic workload generator.
+ *
+ * `make gen` builds this tool.  It simulates a program that allocates
+ * blocks with ranks drawn from one distribution and frees each one after a
+ * lifetime drawn from another, never holding more than a target number of
+ * pages, and writes the resulting stream of calls as a trace in the format
+ * of buddy_trace.h.  The calls are run against a free-list pool as they are
+ * generated, so the trace records the results the reference engine gives
+ * and `replay` can check any engine against them.  The same options and
+ * seed always give the same stream.
+ *
+ * Usage: gen [options]
+ *   -n records     stop after this many calls (default 1000000)
+ *   -p pages       pool size in pages (default 32768)
+ *   -t pages       live-set target: allocate only while fewer pages than
+ *                  this are held (default half the pool)
+ *   -r ranks       rank distribution (default zipf:1.5:10)
+ *                    uniform:lo:hi     every rank from lo to hi alike
+ *                    zipf:s:max        rank k with weight 1 / k^s, up to max
+ *                    bimodal:a:b:p     rank a with probability p, else b
+ *   -l lifetime    lifetime distribution, counted in allocations
+ *                  (default exp:2000)
+ *                    fixed:n           always n
+ *                    uniform:lo:hi     anything from lo to hi alike
+ *                    exp:mean          exponential with that mean
+ *                    pareto:min:alpha  heavy tailed: mostly short lives,
+ *                                      a few that outlast everything
+ *   -q every       call query_page_counts() for every rank after each
+ *                  this many allocations, 0 for never (default 0)
+ *   -s seed        random seed (default 1)
+ *   -o file        output trace (default gen.trace)
+ *
+ * Time advances by one tick per allocation.  Blocks whose lifetime is up
+ * are freed before the next allocation, and while the live-set target is
+ * met time skips ahead to the next death.  An allocation that fails is
+ * recorded with its error and allocates nothing.  Records are stamped with
+ * the tick instead of the clock, so the output is the same byte for byte.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "buddy_trace.h"
+
+#define PAGE_SIZE 4096
+
+enum { LIFE_FIXED, LIFE_UNIFORM, LIFE_EXP, LIFE_PARETO };
+
+struct lifetime {
+    int kind;
+    double a, b;
+};
+
+// A live block and the tick it is freed at, kept in a min-heap on death
+struct block {
+    long death;
+    void *p;
+    int rank;
+};
+
+static struct block *heap;
+static long heap_len;
+
+static void heap_push(struct block b) {
+    long i = heap_len++;
+    while (i > 0 && heap[(i - 1) / 2].death > b.death) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = b;
+}
+
+static struct block heap_pop(void) {
+    struct block top = heap[0];
+    struct block last = heap[--heap_len];
+    long i = 0;
+    for (;;) {
+        long c = 2 * i + 1;
+        if (c >= heap_len) {
+            break;
+        }
+        if (c + 1 < heap_len && heap[c + 1].death < heap[c].death) {
+            c++;
+        }
+        if (last.death <= heap[c].death) {
+            break;
+        }
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static unsigned int seed = 1;
+
+// Uniform in [0, 1)
+static double uniform(void) {
+    return rand_r(&seed) / ((double)RAND_MAX + 1);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: gen [-n records] [-p pages] [-t pages] "
+            "[-r ranks] [-l lifetime] [-q every] [-s seed] [-o file]\n");
+    exit(2);
+}
+
+// Fill cdf[1..MAX_RANK] with the cumulative rank distribution given by spec
+static void parse_ranks(const char *spec, double cdf[MAX_RANK + 1]) {
+    double weight[MAX_RANK + 1] = {0};
+    double s, p;
+    int lo, hi;
+    if (sscanf(spec, "uniform:%d:%d", &lo, &hi) == 2 && lo >= 1 &&
+        lo <= hi && hi <= MAX_RANK) {
+        for (int k = lo; k <= hi; k++) {
+            weight[k] = 1;
+        }
+    } else if (sscanf(spec, "zipf:%lf:%d", &s, &hi) == 2 && s >= 0 &&
+               hi >= 1 && hi <= MAX_RANK) {
+        for (int k = 1; k <= hi; k++) {
+            weight[k] = pow(k, -s);
+        }
+    } else if (sscanf(spec, "bimodal:%d:%d:%lf", &lo, &hi, &p) == 3 &&
+               lo >= 1 && lo <= MAX_RANK && hi >= 1 && hi <= MAX_RANK &&
+               p >= 0 && p <= 1) {
+        weight[lo] += p;
+        weight[hi] += 1 - p;
+    } else {
+        fprintf(stderr, "gen: bad rank distribution '%s'\n", spec);
+        usage();
+    }
+    
+    double total = 0;
+    for (int k = 1; k <= MAX_RANK; k++) {
+        total += weight[k];
+    }
+    double sum = 0;
+    cdf[0] = 0;
+    for (int k = 1; k <= MAX_RANK; k++) {
+        sum += weight[k];
+        cdf[k] = sum / total;
+    }
+    cdf[MAX_RANK] = 1;
+}
+
+static int draw_rank(const double cdf[MAX_RANK + 1]) {
+    double u = uniform();
+    int k = 1;
+    while (k < MAX_RANK && u >= cdf[k]) {
+        k++;
+    }
+    return k;
+}
+
+static void parse_lifetime(const char *spec, struct lifetime *life) {
+    if (sscanf(spec, "fixed:%lf", &life->a) == 1 && life->a >= 1) {
+        life->kind = LIFE_FIXED;
+    } else if (sscanf(spec, "uniform:%lf:%lf", &life->a, &life->b) == 2 &&
+               life->a >= 1 && life->a <= life->b) {
+        life->kind = LIFE_UNIFORM;
+    } else if (sscanf(spec, "exp:%lf", &life->a) == 1 && life->a > 0) {
+        life->kind = LIFE_EXP;
+    } else if (sscanf(spec, "pareto:%lf:%lf", &life->a, &life->b) == 2 &&
+               life->a >= 1 && life->b > 0) {
+        life->kind = LIFE_PARETO;
+    } else {
+        fprintf(stderr, "gen: bad lifetime distribution '%s'\n", spec);
+        usage();
+    }
+}
+
+// Lifetime in ticks, at least 1
+static long draw_lifetime(const struct lifetime *life) {
+    double t;
+    switch (life->kind) {
+    case LIFE_FIXED:
+        t = life->a;
+        break;
+    case LIFE_UNIFORM:
+        t = floor(life->a + uniform() * (life->b - life->a + 1));
+        break;
+    case LIFE_EXP:
+        t = -life->a * log(1 - uniform());
+        break;
+    default:
+        t = life->a / pow(1 - uniform(), 1 / life->b);
+        break;
+    }
+    return t < 1 ? 1 : t > 1e15 ? (long)1e15 : (long)t;
+}
+
+int main(int argc, char **argv) {
+    long records = 1000000, pages = 32768, target = -1, every = 0;
+    const char *rank_spec = "zipf:1.5:10";
+    const char *life_spec = "exp:2000";
+    const char *out = "gen.trace";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:t:r:l:q:s:o:")) != -1) {
+        switch (opt) {
+        case 'n':
+            records = atol(optarg);
+            break;
+        case 'p':
+            pages = atol(optarg);
+            break;
+        case 't':
+            target = atol(optarg);
+            break;
+        case 'r':
+            rank_spec = optarg;
+            break;
+        case 'l':
+            life_spec = optarg;
+            break;
+        case 'q':
+            every = atol(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (target < 0) {
+        target = pages / 2;
+    }
+    if (optind != argc || records < 1 || pages < 1 || pages > 0x7fffffff ||
+        target < 1 || every < 0) {
+        usage();
+    }
+    double cdf[MAX_RANK + 1];
+    struct lifetime life;
+    parse_ranks(rank_spec, cdf);
+    parse_lifetime(life_spec, &life);
+    
+    // The trace writer is the one behind -DBUDDY_TRACE, pointed at out
+    FILE *f = fopen(out, "wb");
+    if (f == NULL) {
+        perror(out);
+        return 1;
+    }
+    fclose(f);
+    setenv("BUDDY_TRACE_FILE", out, 1);
+    char *mem = malloc(pages * PAGE_SIZE);
+    heap = malloc(sizeof(struct block) * pages);
+    if (mem == NULL || heap == NULL) {
+        fprintf(stderr, "gen: out of memory\n");
+        return 1;
+    }
+    buddy_pool_t *pool = buddy_pool_create_engine(mem, pages, 0,
+                                                  BUDDY_ENGINE_LIST);
+    if (IS_ERR(pool)) {
+        fprintf(stderr, "gen: cannot create a pool of %ld pages\n", pages);
+        return 1;
+    }
+    buddy_trace_pool(mem, pages);
+    buddy_trace_record_at(BUDDY_TRACE_INIT, pages, OK, 0);
+    
+    long n = 1, now = 0, live = 0, peak = 0;
+    long allocs = 0, frees = 0, failed = 0;
+    while (n < records) {
+        // Free what is due, or skip ahead to it while the target is met
+        if (heap_len > 0 && (heap[0].death <= now || live >= target)) {
+            struct block b = heap_pop();
+            if (b.death > now) {
+                now = b.death;
+            }
+            buddy_trace_record_at(BUDDY_TRACE_FREE, buddy_trace_page(b.p),
+                                  buddy_pool_free(pool, b.p), now);
+            live -= 1L << (b.rank - 1);
+            frees++;
+            n++;
+            continue;
+        }
+        
+        int rank = draw_rank(cdf);
+        long death = now + draw_lifetime(&life);
+        void *p = buddy_pool_alloc(pool, rank);
+        now++;
+        allocs++;
+        n++;
+        if (IS_ERR(p)) {
+            buddy_trace_record_at(BUDDY_TRACE_ALLOC, rank, PTR_ERR(p), now);
+            failed++;
+        } else {
+            buddy_trace_record_at(BUDDY_TRACE_ALLOC, rank,
+                                  buddy_trace_page(p), now);
+            heap_push((struct block){death, p, rank});
+            live += 1L << (rank - 1);
+            if (live > peak) {
+                peak = live;
+            }
+        }
+        
+        if (every > 0 && allocs % every == 0) {
+            for (int k = 1; k <= MAX_RANK && n < records; k++, n++) {
+                buddy_trace_record_at(BUDDY_TRACE_QCOUNT, k,
+                                      buddy_pool_query_page_counts(pool, k),
+                                      now);
+            }
+        }
+    }
+    
+    printf("%s: %ld records, %ld allocations (%ld failed), %ld frees, "
+           "%ld pages live at most, %ld at the end\n", out, n, allocs,
+           failed, frees, peak, live);
+    buddy_pool_destroy(pool);
+    free(heap);
+    free(mem);
+    return 0;
+}
@@ -0,0 +1,475 @@
+/*
+ * Trace replay.
+ *
+ * `make replay` builds this tool.  It maps a trace written by a build with
+ * -DBUDDY_TRACE (see buddy_trace.h), replays the records in place, one
+ * after another on a single thread, against a pool of the chosen engine,
+ * and compares every result with the recorded one.
+ *
+ * Usage: replay [-e list|nb|tree|tlsf|arena] trace
+ *
+ * Engines place blocks differently, so an allocation that succeeds on
+ * another page than recorded is counted as moved rather than divergent,
+ * and later frees and queries of that block are sent to where it landed.
+ * Any other difference, such as a call that succeeded and now fails, a
+ * different error or a different query result, is a divergence; the first
+ * one is printed and the exit status is 1 if there was any.  The values a
+ * call records in item records, such as the pages of a bulk allocation or
+ * the counts of query_all_page_counts(), are compared the same way.
+ * Throughput covers every call except init_page(), whose pool is set up
+ * untimed.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "buddy_trace.h"
+
+#define PAGE_SIZE 4096
+
+static const struct {
+    const char *name;
+    int engine;
+} engines[] = {
+    {"list", BUDDY_ENGINE_LIST},
+    {"nb", BUDDY_ENGINE_NB},
+    {"tree", BUDDY_ENGINE_TREE},
+    {"tlsf", BUDDY_ENGINE_TLSF},
+    {"arena", BUDDY_ENGINE_ARENA},
+};
+
+static const char *const op_names[] = {
+    [BUDDY_TRACE_INIT] = "init_page",
+    [BUDDY_TRACE_ALLOC] = "alloc_pages",
+    [BUDDY_TRACE_FREE] = "return_pages",
+    [BUDDY_TRACE_QRANK] = "query_ranks",
+    [BUDDY_TRACE_QCOUNT] = "query_page_counts",
+    [BUDDY_TRACE_ALLOC_NPAGES] = "alloc_npages",
+    [BUDDY_TRACE_ALLOC_BULK] = "alloc_pages_bulk",
+    [BUDDY_TRACE_FREE_BULK] = "return_pages_bulk",
+    [BUDDY_TRACE_QALL] = "query_all_page_counts",
+    [BUDDY_TRACE_QLARGEST] = "query_largest_free_rank",
+    [BUDDY_TRACE_QFREE] = "query_free_pages",
+    [BUDDY_TRACE_SET_PCP] = "buddy_set_pcp",
+    [BUDDY_TRACE_DRAIN_PCP] = "buddy_drain_pcp",
+    [BUDDY_TRACE_SET_CHUNKS] = "buddy_set_chunks",
+    [BUDDY_TRACE_SET_LAZY] = "buddy_set_lazy",
+    [BUDDY_TRACE_COALESCE] = "buddy_coalesce_all",
+    [BUDDY_TRACE_STATS] = "buddy_get_stats",
+    [BUDDY_TRACE_FRAG] = "buddy_get_frag_info",
+    [BUDDY_TRACE_BUDDYINFO] = "buddy_format_buddyinfo",
+    [BUDDY_TRACE_ITEM] = "item",
+};
+
+// Replay-side state of the traced pool.  Until the first init_page() there
+// is no pool and calls fail the way they do on an empty default pool.
+struct replay {
+    int engine;
+    buddy_pool_t *pool;
+    char *mem;
+    long pgcount;
+    void **live;                    // Replayed block of each recorded page
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void replay_clear(struct replay *r) {
+    if (r->pool != NULL) {
+        buddy_pool_destroy(r->pool);
+    }
+    free(r->mem);
+    free(r->live);
+    r->pool = NULL;
+    r->mem = NULL;
+    r->live = NULL;
+    r->pgcount = 0;
+}
+
+static int replay_init(struct replay *r, long pgcount) {
+    if (pgcount < 0) {
+        return -EINVAL;
+    }
+    
+    replay_clear(r);
+    r->mem = malloc(pgcount * PAGE_SIZE);
+    r->live = calloc(pgcount, sizeof(void*));
+    if (pgcount > 0 && (r->mem == NULL || r->live == NULL)) {
+        replay_clear(r);
+        return -ENOMEM;
+    }
+    buddy_pool_t *pool = buddy_pool_create_engine(r->mem, pgcount, 0,
+                                                  r->engine);
+    if (IS_ERR(pool)) {
+        replay_clear(r);
+        return PTR_ERR(pool);
+    }
+    r->pool = pool;
+    r->pgcount = pgcount;
+    return OK;
+}
+
+// Address to replay a recorded page index as: the block allocated in its
+// place, if any, or else the page at the same index
+static void *replay_addr(struct replay *r, long page) {
+    if (page < 0 || page >= r->pgcount) {
+        return NULL;
+    }
+    return r->live[page] != NULL ? r->live[page] : r->mem + page * PAGE_SIZE;
+}
+
+// Record p, allocated where page recorded was, and return the result to
+// compare with it.  A recorded failure, or a page outside the pool, which
+// only a corrupt trace has, differs from any page of the pool.
+static long replay_placed(struct replay *r, void *p, long recorded,
+                          long *moved) {
+    long page = ((char*)p - r->mem) / PAGE_SIZE;
+    if (recorded < 0 || recorded >= r->pgcount) {
+        return page;
+    }
+    if (page != recorded) {
+        (*moved)++;
+    }
+    r->live[recorded] = p;
+    return recorded;
+}
+
+static long replay_alloc(struct replay *r, void *p, long recorded,
+                         long *moved) {
+    if (IS_ERR(p)) {
+        return PTR_ERR(p);
+    }
+    return replay_placed(r, p, recorded, moved);
+}
+
+static long replay_alloc_bulk(struct replay *r,
+                              const struct buddy_trace_rec *rec,
+                              long nitems, long *items, long *moved) {
+    int rank = rec->arg;
+    int n = nitems > 0 ? rec[1].arg : 0;
+    void **out = malloc(sizeof(void*) * (n > 0 ? n : 1));
+    if (out == NULL) {
+        fprintf(stderr, "replay: out of memory\n");
+        exit(2);
+    }
+    int got;
+    if (r->pool == NULL) {
+        got = rank < 1 || rank > MAX_RANK || n < 0 ? -EINVAL : 0;
+    } else {
+        got = buddy_pool_alloc_bulk(r->pool, rank, n, out);
+    }
+    for (long j = 0; j < nitems; j++) {
+        if (j == 0) {
+            items[j] = 0;
+        } else if (j - 1 < got) {
+            items[j] = replay_placed(r, out[j - 1], rec[1 + j].ret, moved);
+        } else {
+            items[j] = -ENOSPC;
+        }
+    }
+    free(out);
+    return got;
+}
+
+static long replay_free_bulk(struct replay *r,
+                             const struct buddy_trace_rec *rec,
+                             long nitems, long *items) {
+    int n = rec->arg < 0 ? rec->arg : nitems;
+    void **ptrs = malloc(sizeof(void*) * (nitems > 0 ? nitems : 1));
+    if (ptrs == NULL) {
+        fprintf(stderr, "replay: out of memory\n");
+        exit(2);
+    }
+    for (long j = 0; j < nitems; j++) {
+        ptrs[j] = replay_addr(r, rec[1 + j].arg);
+        items[j] = 0;
+    }
+    int ret;
+    if (r->pool == NULL) {
+        ret = n == 0 ? OK : -EINVAL;
+    } else {
+        ret = buddy_pool_free_bulk(r->pool, ptrs, n);
+    }
+    for (long j = 0; ret == OK && j < nitems; j++) {
+        long page = rec[1 + j].arg;
+        if (page >= 0 && page < r->pgcount) {
+            r->live[page] = NULL;
+        }
+    }
+    free(ptrs);
+    return ret;
+}
+
+// Replay one call and return the result to compare with rec->ret.  The
+// nitems item records after it are compared with items[].
+static long replay_one(struct replay *r, const struct buddy_trace_rec *rec,
+                       long nitems, long *items, long *moved) {
+    long arg = rec->arg;
+    for (long j = 0; j < nitems; j++) {
+        items[j] = 0;
+    }
+    switch (BUDDY_TRACE_OP(rec)) {
+    case BUDDY_TRACE_INIT:
+        return replay_init(r, arg);
+    case BUDDY_TRACE_ALLOC: {
+        void *p;
+        if (r->pool == NULL) {
+            p = ERR_PTR(arg < 1 || arg > MAX_RANK ? -EINVAL : -ENOSPC);
+        } else {
+            p = buddy_pool_alloc(r->pool, arg);
+        }
+        return replay_alloc(r, p, rec->ret, moved);
+    }
+    case BUDDY_TRACE_ALLOC_NPAGES: {
+        void *p;
+        if (r->pool == NULL) {
+            p = ERR_PTR(arg < 1 ? -EINVAL : -ENOSPC);
+        } else {
+            p = buddy_pool_alloc_npages(r->pool, arg);
+        }
+        return replay_alloc(r, p, rec->ret, moved);
+    }
+    case BUDDY_TRACE_ALLOC_BULK:
+        return replay_alloc_bulk(r, rec, nitems, items, moved);
+    case BUDDY_TRACE_FREE: {
+        if (r->pool == NULL) {
+            return -EINVAL;
+        }
+        int ret = buddy_pool_free(r->pool, replay_addr(r, arg));
+        if (ret == OK && arg >= 0 && arg < r->pgcount) {
+            r->live[arg] = NULL;
+        }
+        return ret;
+    }
+    case BUDDY_TRACE_FREE_BULK:
+        return replay_free_bulk(r, rec, nitems, items);
+    case BUDDY_TRACE_QRANK:
+        if (r->pool == NULL) {
+            return -EINVAL;
+        }
+        return buddy_pool_query_ranks(r->pool, replay_addr(r, arg));
+    case BUDDY_TRACE_QCOUNT:
+        if (r->pool == NULL) {
+            return arg < 1 || arg > MAX_RANK ? -EINVAL : 0;
+        }
+        return buddy_pool_query_page_counts(r->pool, arg);
+    case BUDDY_TRACE_QALL: {
+        int counts[MAX_RANK + 1] = {0};
+        if (r->pool != NULL) {
+            buddy_pool_query_all_page_counts(r->pool, counts);
+        }
+        for (long j = 0; j < nitems; j++) {
+            int rank = rec[1 + j].arg;
+            items[j] = rank >= 1 && rank <= MAX_RANK ? counts[rank] : 0;
+        }
+        return OK;
+    }
+    case BUDDY_TRACE_QLARGEST:
+        if (r->pool == NULL) {
+            return 0;
+        }
+        return buddy_pool_query_largest_free_rank(r->pool);
+    case BUDDY_TRACE_QFREE: {
+        if (r->pool == NULL) {
+            return 0;
+        }
+        struct buddy_pool_stats st;
+        buddy_pool_get_stats(r->pool, &st);
+        return st.free_pages;
+    }
+    case BUDDY_TRACE_SET_PCP: {
+        if (r->pool == NULL) {
+            return -EINVAL;
+        }
+        int low = nitems > 0 ? rec[1].arg : 0;
+        return buddy_pool_set_pcp(r->pool, arg, low);
+    }
+    case BUDDY_TRACE_DRAIN_PCP:
+        if (r->pool != NULL) {
+            buddy_pool_drain_pcp(r->pool);
+        }
+        return 0;
+    case BUDDY_TRACE_SET_CHUNKS:
+        if (r->pool == NULL) {
+            return -EINVAL;
+        }
+        return buddy_pool_set_chunks(r->pool, arg);
+    case BUDDY_TRACE_SET_LAZY:
+        if (r->pool == NULL) {
+            return -EINVAL;
+        }
+        return buddy_pool_set_lazy(r->pool, arg);
+    case BUDDY_TRACE_COALESCE:
+        if (r->pool == NULL) {
+            return OK;
+        }
+        return buddy_pool_coalesce_all(r->pool);
+    // The reports are compared by their result only.  Without a pool they
+    // are the ones of this process's own, never set up, default pool.
+    case BUDDY_TRACE_STATS: {
+        struct buddy_stats st;
+        if (r->pool == NULL) {
+            return buddy_get_stats(&st);
+        }
+        return buddy_pool_get_counters(r->pool, &st);
+    }
+    case BUDDY_TRACE_FRAG: {
+        struct buddy_frag_info fi;
+        if (r->pool == NULL) {
+            return buddy_get_frag_info(&fi);
+        }
+        return buddy_pool_get_frag_info(r->pool, &fi);
+    }
+    case BUDDY_TRACE_BUDDYINFO: {
+        char buf[256];
+        if (r->pool == NULL) {
+            return buddy_format_buddyinfo(buf, sizeof(buf));
+        }
+        return buddy_pool_format_buddyinfo(r->pool, buf, sizeof(buf));
+    }
+    default:
+        fprintf(stderr, "replay: unknown op %d\n", BUDDY_TRACE_OP(rec));
+        exit(2);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: replay [-e list|nb|tree|tlsf|arena] trace\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    struct replay r = {BUDDY_ENGINE_LIST, NULL, NULL, 0, NULL};
+    const char *engine_name = "list";
+    int opt;
+    while ((opt = getopt(argc, argv, "e:")) != -1) {
+        if (opt != 'e') {
+            usage();
+        }
+        size_t i;
+        for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+            if (strcmp(optarg, engines[i].name) == 0) {
+                break;
+            }
+        }
+        if (i == sizeof(engines) / sizeof(engines[0])) {
+            usage();
+        }
+        r.engine = engines[i].engine;
+        engine_name = engines[i].name;
+    }
+    if (optind != argc - 1) {
+        usage();
+    }
+    const char *path = argv[optind];
+    
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        return 2;
+    }
+    if ((size_t)st.st_size < sizeof(struct buddy_trace_header)) {
+        fprintf(stderr, "replay: %s: not a trace\n", path);
+        return 2;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 2;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    
+    const struct buddy_trace_header *header = (const void*)map;
+    if (memcmp(header->magic, BUDDY_TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->page_size != PAGE_SIZE ||
+        header->rec_size != sizeof(struct buddy_trace_rec)) {
+        fprintf(stderr, "replay: %s: not a trace of this format\n", path);
+        return 2;
+    }
+    // A writer killed mid-record leaves a partial one at the end
+    const struct buddy_trace_rec *recs = (const void*)(header + 1);
+    long n = (st.st_size - sizeof(*header)) / sizeof(*recs);
+    
+    long inits = 0, calls = 0, moved = 0, diverged = 0, first = -1;
+    long first_call = -1, first_got = 0;
+    long *items = NULL;
+    long items_size = 0;
+    double init_seconds = 0;
+    double start = now_sec();
+    for (long i = 0; i < n; ) {
+        const struct buddy_trace_rec *rec = &recs[i];
+        long nitems = 0;
+        while (i + 1 + nitems < n &&
+               BUDDY_TRACE_OP(&rec[1 + nitems]) == BUDDY_TRACE_ITEM) {
+            nitems++;
+        }
+        if (nitems > items_size) {
+            items_size = nitems * 2;
+            items = realloc(items, sizeof(long) * items_size);
+            if (items == NULL) {
+                fprintf(stderr, "replay: out of memory\n");
+                return 2;
+            }
+        }
+        
+        double init_start = 0;
+        if (BUDDY_TRACE_OP(rec) == BUDDY_TRACE_INIT) {
+            init_start = now_sec();
+        }
+        long got = replay_one(&r, rec, nitems, items, &moved);
+        if (BUDDY_TRACE_OP(rec) == BUDDY_TRACE_INIT) {
+            init_seconds += now_sec() - init_start;
+            inits++;
+        }
+        calls++;
+        for (long j = -1; j < nitems; j++) {
+            long want = rec[1 + j].ret;
+            long have = j < 0 ? got : items[j];
+            if (have != want && diverged++ == 0) {
+                first = i + 1 + j;
+                first_call = i;
+                first_got = have;
+            }
+        }
+        i += 1 + nitems;
+    }
+    double seconds = now_sec() - start - init_seconds;
+    free(items);
+    
+    long ops = calls - inits;
+    double span = n > 0 ? BUDDY_TRACE_NS(&recs[n - 1]) * 1e-9 : 0;
+    printf("%s: %ld records, %ld calls, %ld init_page calls, engine %s\n",
+           path, n, calls, inits, engine_name);
+    printf("recorded %10.3f ms\n", span * 1e3);
+    printf("replayed %10.3f ms  %.2f Mops/s\n", seconds * 1e3,
+           seconds > 0 ? ops / seconds / 1e6 : 0);
+    printf("moved    %10ld allocations landed on another page\n", moved);
+    printf("diverged %10ld results differ\n", diverged);
+    if (diverged) {
+        const struct buddy_trace_rec *rec = &recs[first];
+        const char *call = op_names[BUDDY_TRACE_OP(&recs[first_call])];
+        if (first != first_call) {
+            printf("first at record %ld: item %ld of %s(%d), %d, was %d, "
+                   "replayed %ld\n", first, first - first_call - 1, call,
+                   recs[first_call].arg, rec->arg, rec->ret, first_got);
+        } else {
+            printf("first at record %ld: %s(%d) was %d, replayed %ld\n",
+                   first, call, rec->arg, rec->ret, first_got);
+        }
+    }
+    
+    replay_clear(&r);
+    munmap(map, st.st_size);
+    return diverged ? 1 : 0;
+}
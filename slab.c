@@ -0,0 +1,476 @@
+#include "slab.h"
+#include "buddy_engine.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A slab starts with its header and in-use bitmap, followed by the objects
+// at obj_offset.  Objects past fresh have never been handed out; returned
+// objects are chained through their first word, so a new slab is only
+// touched as far as it is used.
+struct slab {
+    struct slab *next;              // Must match struct slab_list
+    struct slab *prev;
+    slab_cache_t *cache;
+    void *free;                     // Last returned object, NULL if none
+    int fresh;                      // Objects below have been handed out
+    int inuse;
+    unsigned long used[];           // Bit per object, set while handed out
+};
+
+// Slab lists are circular, with the list head standing in as a sentinel
+// struct slab of which only next and prev are used
+struct slab_list {
+    struct slab *next;
+    struct slab *prev;
+};
+
+// Lock protects everything below it
+struct slab_cache {
+    char name[SLAB_NAME_LEN];
+    buddy_pool_t *pool;             // NULL for the default pool
+    size_t size;
+    int rank;
+    int objs;                       // Objects per slab
+    size_t obj_offset;
+    pthread_mutex_t lock;
+    struct slab_list full;
+    struct slab_list partial;
+    struct slab_list empty;
+    long nr_full;
+    long nr_partial;
+    long nr_empty;
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long slabs_created;
+    unsigned long slabs_released;
+};
+
+// Page map from page address to slab, a three-level radix tree over the
+// 36-bit page numbers of a 48-bit address space.  Lookups are lock-free;
+// owner_lock only serializes adding nodes, which are never freed.
+#define OWNER_BITS   12
+#define OWNER_FANOUT (1 << OWNER_BITS)
+
+typedef struct owner_node {
+    void *slot[OWNER_FANOUT];
+} owner_node_t;
+
+static owner_node_t owner_root;
+static pthread_mutex_t owner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline unsigned long page_number(const void *p) {
+    return (unsigned long)p / PAGE_SIZE;
+}
+
+static struct slab *owner_get(const void *p) {
+    unsigned long pfn = page_number(p);
+    if (pfn >> (3 * OWNER_BITS)) {
+        return NULL;
+    }
+    
+    unsigned long i = pfn >> (2 * OWNER_BITS);
+    owner_node_t *mid = __atomic_load_n(&owner_root.slot[i], __ATOMIC_ACQUIRE);
+    if (mid == NULL) {
+        return NULL;
+    }
+    i = (pfn >> OWNER_BITS) & (OWNER_FANOUT - 1);
+    owner_node_t *leaf = __atomic_load_n(&mid->slot[i], __ATOMIC_ACQUIRE);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&leaf->slot[pfn & (OWNER_FANOUT - 1)],
+                           __ATOMIC_ACQUIRE);
+}
+
+// Child of node at i, created if missing.  Caller holds owner_lock.
+static owner_node_t *owner_child(owner_node_t *node, unsigned long i) {
+    owner_node_t *child = node->slot[i];
+    if (child == NULL) {
+        child = calloc(1, sizeof(*child));
+        if (child == NULL) {
+            return NULL;
+        }
+        __atomic_store_n(&node->slot[i], child, __ATOMIC_RELEASE);
+    }
+    return child;
+}
+
+// Point npages pages from p at slab, which may be NULL to clear them
+static int owner_set(void *p, long npages, struct slab *slab) {
+    pthread_mutex_lock(&owner_lock);
+    for (long i = 0; i < npages; i++) {
+        unsigned long pfn = page_number(p) + i;
+        if (pfn >> (3 * OWNER_BITS)) {
+            pthread_mutex_unlock(&owner_lock);
+            return -EINVAL;
+        }
+        
+        owner_node_t *mid = owner_child(&owner_root, pfn >> (2 * OWNER_BITS));
+        owner_node_t *leaf = mid == NULL ? NULL :
+            owner_child(mid, (pfn >> OWNER_BITS) & (OWNER_FANOUT - 1));
+        if (leaf == NULL) {
+            pthread_mutex_unlock(&owner_lock);
+            return -ENOMEM;
+        }
+        __atomic_store_n(&leaf->slot[pfn & (OWNER_FANOUT - 1)], slab,
+                         __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&owner_lock);
+    
+    return OK;
+}
+
+static inline size_t round_up(size_t n, size_t align) {
+    return (n + align - 1) & ~(align - 1);
+}
+
+static inline size_t header_size(int objs) {
+    return sizeof(struct slab) + (objs + 63) / 64 * sizeof(unsigned long);
+}
+
+static void slab_list_init(struct slab_list *list) {
+    list->next = (struct slab*)list;
+    list->prev = (struct slab*)list;
+}
+
+static inline int slab_list_empty(struct slab_list *list) {
+    return list->next == (struct slab*)list;
+}
+
+static void slab_list_add(struct slab_list *list, struct slab *slab) {
+    slab->next = list->next;
+    slab->prev = (struct slab*)list;
+    list->next->prev = slab;
+    list->next = slab;
+}
+
+static void slab_list_del(struct slab *slab) {
+    slab->prev->next = slab->next;
+    slab->next->prev = slab->prev;
+}
+
+static void *slab_pages_alloc(slab_cache_t *cache) {
+    if (cache->pool != NULL) {
+        return buddy_pool_alloc(cache->pool, cache->rank);
+    }
+    return alloc_pages(cache->rank);
+}
+
+static void slab_pages_free(slab_cache_t *cache, void *p) {
+    if (cache->pool != NULL) {
+        buddy_pool_free(cache->pool, p);
+    } else {
+        return_pages(p);
+    }
+}
+
+// Pick the smallest slab rank that wastes at most an eighth of the slab on
+// header and tail, or else the smallest that holds an object at all.
+// Returns 0 if even a MAX_RANK block is too small.
+static int slab_layout(slab_cache_t *cache, size_t align) {
+    cache->rank = 0;
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        size_t bytes = pages_for_rank(rank) * PAGE_SIZE;
+        long objs = bytes / cache->size;
+        while (objs > 0 && round_up(header_size(objs), align) +
+                           objs * cache->size > bytes) {
+            objs--;
+        }
+        if (objs == 0) {
+            continue;
+        }
+        
+        int tight = (bytes - objs * cache->size) * 8 <= bytes;
+        if (cache->rank == 0 || tight) {
+            cache->rank = rank;
+            cache->objs = objs;
+            cache->obj_offset = round_up(header_size(objs), align);
+        }
+        if (tight) {
+            break;
+        }
+    }
+    return cache->rank;
+}
+
+slab_cache_t *slab_cache_create_pool(buddy_pool_t *pool, const char *name,
+                                     size_t size, size_t align) {
+    if (align == 0) {
+        align = sizeof(void*);
+    }
+    if (size == 0 || (align & (align - 1)) || align > PAGE_SIZE) {
+        return ERR_PTR(-EINVAL);
+    }
+    
+    slab_cache_t *cache = malloc(sizeof(*cache));
+    if (cache == NULL) {
+        return ERR_PTR(-ENOMEM);
+    }
+    memset(cache, 0, sizeof(*cache));
+    if (name != NULL) {
+        strncpy(cache->name, name, SLAB_NAME_LEN - 1);
+    }
+    cache->pool = pool;
+    
+    // Free objects hold the free-list link
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+    cache->size = round_up(size, align);
+    if (cache->size < size || slab_layout(cache, align) == 0) {
+        free(cache);
+        return ERR_PTR(-EINVAL);
+    }
+    
+    pthread_mutex_init(&cache->lock, NULL);
+    slab_list_init(&cache->full);
+    slab_list_init(&cache->partial);
+    slab_list_init(&cache->empty);
+    
+    return cache;
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align) {
+    return slab_cache_create_pool(NULL, name, size, align);
+}
+
+static void slab_release(slab_cache_t *cache, struct slab *slab) {
+    owner_set(slab, pages_for_rank(cache->rank), NULL);
+    slab_pages_free(cache, slab);
+    cache->slabs_released++;
+}
+
+static void slab_list_release(slab_cache_t *cache, struct slab_list *list) {
+    while (!slab_list_empty(list)) {
+        struct slab *slab = list->next;
+        slab_list_del(slab);
+        slab_release(cache, slab);
+    }
+}
+
+void slab_cache_destroy(slab_cache_t *cache) {
+    slab_list_release(cache, &cache->full);
+    slab_list_release(cache, &cache->partial);
+    slab_list_release(cache, &cache->empty);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+// Take a new slab from the buddy allocator.  Caller holds the cache lock.
+static struct slab *slab_grow(slab_cache_t *cache, long *err) {
+    struct slab *slab = slab_pages_alloc(cache);
+    if (IS_ERR(slab)) {
+        *err = PTR_ERR(slab);
+        return NULL;
+    }
+    
+    int ret = owner_set(slab, pages_for_rank(cache->rank), slab);
+    if (ret != OK) {
+        owner_set(slab, pages_for_rank(cache->rank), NULL);
+        slab_pages_free(cache, slab);
+        *err = ret;
+        return NULL;
+    }
+    slab->cache = cache;
+    slab->free = NULL;
+    slab->fresh = 0;
+    slab->inuse = 0;
+    memset(slab->used, 0, (cache->objs + 63) / 64 * sizeof(unsigned long));
+    cache->slabs_created++;
+    
+    return slab;
+}
+
+void *slab_alloc(slab_cache_t *cache) {
+    pthread_mutex_lock(&cache->lock);
+    
+    // Fill partial slabs first, then reuse an empty one
+    struct slab *slab;
+    if (!slab_list_empty(&cache->partial)) {
+        slab = cache->partial.next;
+    } else if (!slab_list_empty(&cache->empty)) {
+        slab = cache->empty.next;
+        slab_list_del(slab);
+        cache->nr_empty--;
+        slab_list_add(&cache->partial, slab);
+        cache->nr_partial++;
+    } else {
+        long err;
+        slab = slab_grow(cache, &err);
+        if (slab == NULL) {
+            pthread_mutex_unlock(&cache->lock);
+            return ERR_PTR(err);
+        }
+        slab_list_add(&cache->partial, slab);
+        cache->nr_partial++;
+    }
+    
+    char *obj;
+    if (slab->free != NULL) {
+        obj = slab->free;
+        slab->free = *(void**)obj;
+    } else {
+        obj = (char*)slab + cache->obj_offset + slab->fresh * cache->size;
+        slab->fresh++;
+    }
+    long i = (obj - ((char*)slab + cache->obj_offset)) / cache->size;
+    slab->used[i / 64] |= 1UL << (i % 64);
+    
+    if (++slab->inuse == cache->objs) {
+        slab_list_del(slab);
+        cache->nr_partial--;
+        slab_list_add(&cache->full, slab);
+        cache->nr_full++;
+    }
+    cache->allocs++;
+    
+    pthread_mutex_unlock(&cache->lock);
+    
+    return obj;
+}
+
+int slab_free(slab_cache_t *cache, void *obj) {
+    struct slab *slab = owner_get(obj);
+    if (slab == NULL || slab->cache != cache) {
+        return -EINVAL;
+    }
+    
+    // Must be the start of an object slot
+    char *objs = (char*)slab + cache->obj_offset;
+    if ((char*)obj < objs || ((char*)obj - objs) % cache->size != 0) {
+        return -EINVAL;
+    }
+    long i = ((char*)obj - objs) / cache->size;
+    if (i >= cache->objs) {
+        return -EINVAL;
+    }
+    
+    pthread_mutex_lock(&cache->lock);
+    if (!(slab->used[i / 64] & (1UL << (i % 64)))) {
+        pthread_mutex_unlock(&cache->lock);
+        return -EINVAL;
+    }
+    slab->used[i / 64] &= ~(1UL << (i % 64));
+    *(void**)obj = slab->free;
+    slab->free = obj;
+    cache->frees++;
+    
+    if (slab->inuse-- == cache->objs) {
+        slab_list_del(slab);
+        cache->nr_full--;
+        slab_list_add(&cache->partial, slab);
+        cache->nr_partial++;
+    }
+    if (slab->inuse == 0) {
+        slab_list_del(slab);
+        cache->nr_partial--;
+        if (cache->nr_empty < SLAB_EMPTY_KEEP) {
+            slab_list_add(&cache->empty, slab);
+            cache->nr_empty++;
+        } else {
+            slab_release(cache, slab);
+        }
+    }
+    
+    pthread_mutex_unlock(&cache->lock);
+    
+    return OK;
+}
+
+int slab_cache_shrink(slab_cache_t *cache) {
+    pthread_mutex_lock(&cache->lock);
+    int released = cache->nr_empty;
+    slab_list_release(cache, &cache->empty);
+    cache->nr_empty = 0;
+    pthread_mutex_unlock(&cache->lock);
+    
+    return released;
+}
+
+int slab_cache_get_stats(slab_cache_t *cache, struct slab_cache_stats *st) {
+    pthread_mutex_lock(&cache->lock);
+    memcpy(st->name, cache->name, SLAB_NAME_LEN);
+    st->object_size = cache->size;
+    st->objects_per_slab = cache->objs;
+    st->slab_rank = cache->rank;
+    st->full_slabs = cache->nr_full;
+    st->partial_slabs = cache->nr_partial;
+    st->empty_slabs = cache->nr_empty;
+    st->total_objects = (cache->nr_full + cache->nr_partial + cache->nr_empty) *
+                        cache->objs;
+    st->active_objects = (long)(cache->allocs - cache->frees);
+    st->allocs = cache->allocs;
+    st->frees = cache->frees;
+    st->slabs_created = cache->slabs_created;
+    st->slabs_released = cache->slabs_released;
+    pthread_mutex_unlock(&cache->lock);
+    
+    return OK;
+}
+
+slab_cache_t *slab_cache_of(const void *obj) {
+    struct slab *slab = owner_get(obj);
+    return slab == NULL ? NULL : slab->cache;
+}
+
+// Size classes 2^MALLOC_MIN_SHIFT..BUDDY_MALLOC_MAX_SMALL bytes, indexed by
+// shift and created together on first use
+#define MALLOC_MIN_SHIFT 3
+#define MALLOC_MAX_SHIFT 11
+
+static slab_cache_t *malloc_caches[MALLOC_MAX_SHIFT + 1];
+static pthread_once_t malloc_once = PTHREAD_ONCE_INIT;
+
+static void malloc_init(void) {
+    for (int shift = MALLOC_MIN_SHIFT; shift <= MALLOC_MAX_SHIFT; shift++) {
+        char name[SLAB_NAME_LEN];
+        snprintf(name, sizeof(name), "malloc-%d", 1 << shift);
+        malloc_caches[shift] = slab_cache_create(name, 1 << shift,
+                                                 shift > 3 ? 16 : 8);
+    }
+}
+
+void *buddy_malloc(size_t size) {
+    if (size == 0) {
+        return ERR_PTR(-EINVAL);
+    }
+    
+    if (size > BUDDY_MALLOC_MAX_SMALL) {
+        return alloc_npages(size / PAGE_SIZE + (size % PAGE_SIZE != 0));
+    }
+    
+    int shift = size <= 1 << MALLOC_MIN_SHIFT ? MALLOC_MIN_SHIFT :
+                64 - __builtin_clzl(size - 1);
+    pthread_once(&malloc_once, malloc_init);
+    if (IS_ERR(malloc_caches[shift])) {
+        return malloc_caches[shift];
+    }
+    return slab_alloc(malloc_caches[shift]);
+}
+
+int buddy_free(void *p) {
+    // A slab of some other cache is no buddy_malloc() object either
+    slab_cache_t *cache = slab_cache_of(p);
+    if (cache != NULL) {
+        int shift = __builtin_ctzl(cache->size);
+        if (shift > MALLOC_MAX_SHIFT || malloc_caches[shift] != cache) {
+            return -EINVAL;
+        }
+        return slab_free(cache, p);
+    }
+    return return_pages(p);
+}
+
+int buddy_malloc_trim(void) {
+    int released = 0;
+    pthread_once(&malloc_once, malloc_init);
+    for (int shift = MALLOC_MIN_SHIFT; shift <= MALLOC_MAX_SHIFT; shift++) {
+        if (!IS_ERR(malloc_caches[shift])) {
+            released += slab_cache_shrink(malloc_caches[shift]);
+        }
+    }
+    return released;
+}
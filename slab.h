@@ -0,0 +1,86 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#include "buddy.h"
+
+/*
+ * Object caches on top of the buddy allocator.  A cache hands out objects
+ * of one size and alignment, carved from slabs of 2^(rank-1) pages that it
+ * takes from alloc_pages(), or from a pool when created with
+ * slab_cache_create_pool().  Each slab is on one of three lists: full,
+ * partial or empty.  Allocation prefers partial slabs, then an empty one,
+ * and only then takes a new slab; a slab that empties is kept for reuse
+ * while fewer than SLAB_EMPTY_KEEP others are, and otherwise goes straight
+ * back through return_pages().
+ *
+ * Objects carry no header.  slab_free() finds an object's slab through a
+ * page map shared by all caches, so it takes constant time, and rejects
+ * pointers that are not a live object of the cache with -EINVAL.
+ *
+ * slab_cache_create() returns ERR_PTR(-EINVAL) for a zero size, an
+ * alignment that is not a power of two up to PAGE_SIZE, or an object that
+ * does not fit in a MAX_RANK block, and ERR_PTR(-ENOMEM) if its own memory
+ * cannot be allocated.  slab_alloc() passes on the buddy allocator's error
+ * when a new slab is needed and none can be had.  Caches are thread-safe.
+ */
+typedef struct slab_cache slab_cache_t;
+
+#define SLAB_NAME_LEN   32
+#define SLAB_EMPTY_KEEP 1
+
+struct slab_cache_stats {
+    char name[SLAB_NAME_LEN];
+    size_t object_size;         /* Size after rounding up to the alignment */
+    int objects_per_slab;
+    int slab_rank;
+    long active_objects;
+    long total_objects;         /* Object slots in all slabs held */
+    long full_slabs;
+    long partial_slabs;
+    long empty_slabs;
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long slabs_created;
+    unsigned long slabs_released;
+};
+
+/* align == 0 means the natural alignment of a pointer */
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align);
+slab_cache_t *slab_cache_create_pool(buddy_pool_t *pool, const char *name,
+                                     size_t size, size_t align);
+/* Releases every slab, including those with objects still allocated */
+void slab_cache_destroy(slab_cache_t *cache);
+void *slab_alloc(slab_cache_t *cache);
+int slab_free(slab_cache_t *cache, void *obj);
+/* Release every empty slab; returns how many were released */
+int slab_cache_shrink(slab_cache_t *cache);
+int slab_cache_get_stats(slab_cache_t *cache, struct slab_cache_stats *st);
+/* Cache whose slab holds the page of obj, or NULL */
+slab_cache_t *slab_cache_of(const void *obj);
+
+/*
+ * Byte-sized allocations from the default pool.  Sizes up to
+ * BUDDY_MALLOC_MAX_SMALL are rounded up to a power of two of at least 8
+ * bytes and served from one slab cache per size class, so objects of a class
+ * share pages and carry no header.  Larger sizes get whole pages straight
+ * from alloc_npages().  buddy_free() tells the two apart through the slab
+ * page map in constant time.  Objects of 16 bytes and more are 16-byte
+ * aligned, large ones page aligned.
+ *
+ * buddy_malloc() returns ERR_PTR(-EINVAL) for a size of 0 and otherwise the
+ * allocator's error.  buddy_free() returns -EINVAL for a pointer that is
+ * neither a live object nor an allocated block of the default pool.  The
+ * size-class caches keep an empty slab each, so before the default pool is
+ * re-initialized with init_page() every object must be freed and
+ * buddy_malloc_trim() called.
+ */
+#define BUDDY_MALLOC_MAX_SMALL 2048
+
+void *buddy_malloc(size_t size);
+int buddy_free(void *p);
+/* Release the empty slabs of every size class; returns how many */
+int buddy_malloc_trim(void);
+
+#endif
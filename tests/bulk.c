@@ -0,0 +1,154 @@
+/*
+ * Bulk allocation and free on every engine: blocks are distinct and
+ * aligned, what is left of a carved block stays merged, a short count
+ * means the pool ran out, and a bulk free with a duplicate, interior,
+ * foreign or already free pointer frees nothing.
+ */
+#include "test.h"
+
+#define PAGES 1024
+#define N 48
+
+static struct model model;
+
+static buddy_pool_t *create(char *mem, int engine) {
+    model_init(&model, mem, PAGES);
+    if (engine == BUDDY_ENGINE_ARENA) {
+        model.top = 9;              // PAGES / 4 pages per arena
+        return buddy_pool_create_arenas(mem, PAGES, 0, 4);
+    }
+    return buddy_pool_create_engine(mem, PAGES, 0, engine);
+}
+
+// A bulk free of blocks[0..n) plus bad is rejected and changes nothing
+static int rejected(buddy_pool_t *pool, void **blocks, int n, void *bad) {
+    void *ptrs[PAGES / 8 + 1];
+    memcpy(ptrs, blocks, sizeof(void*) * n);
+    ptrs[n] = bad;
+    return buddy_pool_free_bulk(pool, ptrs, n + 1) == -EINVAL &&
+           model_matches(&model, pool);
+}
+
+// Any count of any rank, carved from an empty pool or a partly used one,
+// leaves the rest of the pool merged as far as it goes
+static int carves(buddy_pool_t *pool) {
+    void *held[PAGES / 64], *blocks[N];
+    int ok = 1;
+    for (int used = 0; used < 2; used++) {
+        int h = 0;
+        if (used) {
+            // Every other rank-7 block, so no free block is above rank 7
+            for (long idx = 0; idx + 64 <= PAGES; idx += 128) {
+                held[h] = buddy_pool_alloc(pool, 7);
+                ok &= !IS_ERR(held[h]) && model_take(&model, held[h], 7);
+                h++;
+            }
+        }
+        for (int rank = 1; rank <= 6; rank++) {
+            for (int n = 1; n <= N && n << (rank - 1) <= PAGES / 4;
+                 n += 1 + n / 4) {
+                ok &= buddy_pool_alloc_bulk(pool, rank, n, blocks) == n;
+                for (int i = 0; i < n; i++) {
+                    ok &= model_take(&model, blocks[i], rank);
+                }
+                ok &= model_matches(&model, pool);
+                ok &= buddy_pool_free_bulk(pool, blocks, n) == OK;
+                for (int i = 0; i < n; i++) {
+                    model_release(&model, blocks[i], rank);
+                }
+            }
+        }
+        while (h > 0) {
+            h--;
+            ok &= buddy_pool_free(pool, held[h]) == OK;
+            model_release(&model, held[h], 7);
+        }
+        ok &= model_matches(&model, pool);
+    }
+    return ok;
+}
+
+static void test_engine(char *mem, int engine) {
+    buddy_pool_t *pool = create(mem, engine);
+    void *blocks[N];
+    
+    CHECK(buddy_pool_alloc_bulk(pool, 0, 1, blocks) == -EINVAL);
+    CHECK(buddy_pool_alloc_bulk(pool, MAX_RANK + 1, 1, blocks) == -EINVAL);
+    CHECK(buddy_pool_alloc_bulk(pool, 1, -1, blocks) == -EINVAL);
+    CHECK(buddy_pool_alloc_bulk(pool, 1, 0, blocks) == 0);
+    CHECK(buddy_pool_free_bulk(pool, blocks, -1) == -EINVAL);
+    CHECK(buddy_pool_free_bulk(pool, blocks, 0) == OK);
+    CHECK(carves(pool));
+    
+    // Mixed ranks, every block distinct and aligned
+    int ranks[N];
+    int n = 0, ok = 1;
+    for (int rank = 1; rank <= 4; rank++) {
+        int got = buddy_pool_alloc_bulk(pool, rank, N / 4, blocks + n);
+        ok &= got == N / 4;
+        for (int i = n; i < n + got; i++) {
+            ranks[i] = rank;
+            ok &= model_take(&model, blocks[i], rank) &&
+                  model_page(&model, blocks[i]) % (1L << (rank - 1)) == 0;
+        }
+        n += got;
+    }
+    CHECK(ok);
+    CHECK(n == N);
+    CHECK(model_matches(&model, pool));
+    
+    // Duplicate and interior pointers; blocks[N / 4] is of rank 2
+    CHECK(rejected(pool, blocks, n, blocks[0]));
+    CHECK(rejected(pool, blocks, n, (char*)blocks[N / 4] + TEST_PAGE_SIZE));
+    CHECK(rejected(pool, blocks, n, NULL));
+    CHECK(rejected(pool, blocks, n, mem + (long)PAGES * TEST_PAGE_SIZE));
+    CHECK(rejected(pool, blocks, n, mem - TEST_PAGE_SIZE));
+    void *spare = buddy_pool_alloc(pool, 1);
+    CHECK(!IS_ERR(spare));
+    CHECK(buddy_pool_free(pool, spare) == OK);
+    CHECK(rejected(pool, blocks, n, spare));
+    for (int i = 0; i < n; i++) {
+        ok &= buddy_pool_query_ranks(pool, blocks[i]) == ranks[i];
+    }
+    CHECK(ok);
+    
+    // Freeing them all at once leaves the counts of one-by-one frees
+    CHECK(buddy_pool_free_bulk(pool, blocks, n) == OK);
+    for (int i = 0; i < n; i++) {
+        model_release(&model, blocks[i], ranks[i]);
+    }
+    CHECK(model_matches(&model, pool));
+    CHECK(buddy_pool_free_bulk(pool, blocks, 1) == -EINVAL);
+    
+    // A short count means no block of that rank is left
+    void *all[PAGES / 8 + 1];
+    n = buddy_pool_alloc_bulk(pool, 4, PAGES / 8 + 1, all);
+    CHECK(n == PAGES / 8);
+    CHECK(buddy_pool_query_largest_free_rank(pool) == 0);
+    CHECK(buddy_pool_alloc_bulk(pool, 1, 1, all + n) == 0);
+    for (int i = 0; i < n; i++) {
+        ok &= model_take(&model, all[i], 4);
+    }
+    CHECK(ok);
+    
+    // These span the whole pool, so with arenas a bad pointer at the top
+    // is checked only after every other arena's blocks
+    CHECK(rejected(pool, all, n, mem + (long)(PAGES - 8) * TEST_PAGE_SIZE));
+    CHECK(buddy_pool_free_bulk(pool, all, n) == OK);
+    for (int i = 0; i < n; i++) {
+        model_release(&model, all[i], 4);
+    }
+    
+    check_reusable(&model, pool);
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+}
+
+int main(void) {
+    char *mem = aligned_alloc(TEST_PAGE_SIZE, (size_t)PAGES * TEST_PAGE_SIZE);
+    for (int e = 0; e < TEST_ENGINES; e++) {
+        test_engine(mem, test_engines[e].engine);
+    }
+    free(mem);
+    return test_done("bulk");
+}
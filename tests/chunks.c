@@ -0,0 +1,125 @@
+/*
+ * Small chunks: a reserved chunk counts as one allocated block, small
+ * blocks fill it from the lowest slot, bad frees are rejected, and the
+ * chunk goes back to the buddy lists with its last block.
+ */
+#include "test.h"
+
+#define PAGES 1024
+#define CHUNK_PAGES (1L << (BUDDY_CHUNK_RANK - 1))
+
+static struct model model;
+
+static buddy_pool_t *create(char *mem, int engine) {
+    model_init(&model, mem, PAGES);
+    if (engine == BUDDY_ENGINE_ARENA) {
+        model.top = 9;              // PAGES / 4 pages per arena
+        return buddy_pool_create_arenas(mem, PAGES, 0, 4);
+    }
+    return buddy_pool_create_engine(mem, PAGES, 0, engine);
+}
+
+static char *chunk_of(char *mem, void *p) {
+    long page = ((char*)p - mem) / TEST_PAGE_SIZE;
+    return mem + (page & ~(CHUNK_PAGES - 1)) * TEST_PAGE_SIZE;
+}
+
+static void test_engine(char *mem, int engine) {
+    buddy_pool_t *pool = create(mem, engine);
+    CHECK(buddy_pool_set_chunks(pool, 1) == OK);
+    
+    // The first small block reserves a chunk, counted as one whole block
+    void *first = buddy_pool_alloc(pool, 1);
+    CHECK(!IS_ERR(first));
+    char *chunk = chunk_of(mem, first);
+    CHECK(first == chunk);
+    CHECK(model_take(&model, chunk, BUDDY_CHUNK_RANK));
+    CHECK(model_matches(&model, pool));
+    CHECK(buddy_pool_query_ranks(pool, first) == 1);
+    CHECK(buddy_pool_query_ranks(pool, chunk + TEST_PAGE_SIZE) ==
+          BUDDY_CHUNK_RANK);
+    
+    // Later ones fill the same chunk at the lowest slot that fits them
+    static const long want[] = {8, 4, 2, 1};
+    void *blocks[BUDDY_CHUNK_MAX_RANK];
+    int n = 0, ok = 1;
+    for (int rank = BUDDY_CHUNK_MAX_RANK; rank >= 1; rank--) {
+        void *p = buddy_pool_alloc(pool, rank);
+        ok &= p == chunk + want[n] * TEST_PAGE_SIZE &&
+              buddy_pool_query_ranks(pool, p) == rank;
+        blocks[n++] = p;
+    }
+    CHECK(ok);
+    CHECK(model_matches(&model, pool));
+    
+    // Double, interior and free-slot frees fail and change nothing
+    void *big = blocks[0];
+    CHECK(buddy_pool_free(pool, (char*)big + TEST_PAGE_SIZE) == -EINVAL);
+    CHECK(buddy_pool_free(pool, chunk + (CHUNK_PAGES - 1) * TEST_PAGE_SIZE) ==
+          -EINVAL);
+    CHECK(buddy_pool_free(pool, blocks[n - 1]) == OK);
+    CHECK(buddy_pool_free(pool, blocks[n - 1]) == -EINVAL);
+    n--;
+    CHECK(model_matches(&model, pool));
+    void *ptrs[2] = {big, (char*)big + TEST_PAGE_SIZE};
+    CHECK(buddy_pool_free_bulk(pool, ptrs, 2) == -EINVAL);
+    CHECK(buddy_pool_query_ranks(pool, big) == BUDDY_CHUNK_MAX_RANK);
+    
+    // Bulk allocations come from the buddy lists
+    void *bulk[4];
+    CHECK(buddy_pool_alloc_bulk(pool, 1, 4, bulk) == 4);
+    for (int i = 0; i < 4; i++) {
+        ok &= chunk_of(mem, bulk[i]) != chunk &&
+              model_take(&model, bulk[i], 1);
+    }
+    CHECK(ok);
+    CHECK(model_matches(&model, pool));
+    CHECK(buddy_pool_free_bulk(pool, bulk, 4) == OK);
+    for (int i = 0; i < 4; i++) {
+        model_release(&model, bulk[i], 1);
+    }
+    
+    // Turning chunks off stops new carving; the chunk drains as it empties
+    CHECK(buddy_pool_set_chunks(pool, 0) == OK);
+    void *plain = buddy_pool_alloc(pool, 1);
+    CHECK(chunk_of(mem, plain) != chunk);
+    CHECK(model_take(&model, plain, 1));
+    CHECK(model_matches(&model, pool));
+    CHECK(buddy_pool_free(pool, plain) == OK);
+    model_release(&model, plain, 1);
+    CHECK(buddy_pool_free(pool, first) == OK);
+    while (n > 0) {
+        n--;
+        ok &= buddy_pool_free(pool, blocks[n]) == OK;
+    }
+    CHECK(ok);
+    model_release(&model, chunk, BUDDY_CHUNK_RANK);
+    CHECK(model_matches(&model, pool));
+    
+    // Every page can still be handed out with chunks on, and comes back
+    CHECK(buddy_pool_set_chunks(pool, 1) == OK);
+    check_reusable(&model, pool);
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+}
+
+int main(void) {
+    char *mem = aligned_alloc(TEST_PAGE_SIZE, (size_t)PAGES * TEST_PAGE_SIZE);
+    
+    // Engines without chunks refuse them
+    for (int e = 0; e < TEST_ENGINES; e++) {
+        int engine = test_engines[e].engine;
+        buddy_pool_t *p = buddy_pool_create_engine(mem, PAGES, 0, engine);
+        int has_chunks = engine == BUDDY_ENGINE_LIST ||
+                         engine == BUDDY_ENGINE_ARENA;
+        CHECK(buddy_pool_set_chunks(p, 1) == (has_chunks ? OK : -EINVAL));
+        CHECK(buddy_pool_set_chunks(p, 0) == OK);
+        buddy_pool_destroy(p);
+    }
+    
+    test_engine(mem, BUDDY_ENGINE_LIST);
+    test_engine(mem, BUDDY_ENGINE_ARENA);
+    
+    free(mem);
+    return test_done("chunks");
+}
@@ -0,0 +1,156 @@
+/*
+ * Operation counters: a known sequence of calls gives known allocation,
+ * free, split, merge and failure counts on every engine, counts from
+ * several threads add up, and init_page() starts the default pool's
+ * counters over.
+ */
+#include <pthread.h>
+
+#include "test.h"
+
+#define PAGES 16                    // One rank-5 block
+#define THREADS 4
+#define PER_THREAD 1000
+
+static struct model model;
+
+static int zero_from(const unsigned long *counts, int rank) {
+    for (; rank <= MAX_RANK; rank++) {
+        if (counts[rank] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static buddy_pool_t *create(char *mem, int engine) {
+    model_init(&model, mem, PAGES);
+    if (engine == BUDDY_ENGINE_ARENA) {
+        return buddy_pool_create_arenas(mem, PAGES, 0, 1);
+    }
+    return buddy_pool_create_engine(mem, PAGES, 0, engine);
+}
+
+static void test_engine(char *mem, int engine) {
+    buddy_pool_t *pool = create(mem, engine);
+    struct buddy_stats st;
+    CHECK(buddy_pool_get_counters(pool, &st) == OK);
+    CHECK(zero_from(st.allocs, 0) && zero_from(st.frees, 0) &&
+          zero_from(st.splits, 0) && zero_from(st.merges, 0) &&
+          zero_from(st.enospc, 0));
+    CHECK(st.einval == 0 && st.max_merge_depth == 0);
+    
+    // A page out of the whole pool splits every rank above it, and its
+    // free merges them all back
+    void *p = buddy_pool_alloc(pool, 1);
+    CHECK(!IS_ERR(p));
+    CHECK(buddy_pool_get_counters(pool, &st) == OK);
+    CHECK(st.allocs[1] == 1 && zero_from(st.allocs, 2));
+    CHECK(st.splits[1] == 0 && st.splits[2] == 1 && st.splits[3] == 1 &&
+          st.splits[4] == 1 && st.splits[5] == 1 && zero_from(st.splits, 6));
+    CHECK(zero_from(st.merges, 0) && zero_from(st.frees, 0));
+    CHECK(buddy_pool_free(pool, p) == OK);
+    CHECK(buddy_pool_get_counters(pool, &st) == OK);
+    CHECK(st.frees[1] == 1 && zero_from(st.frees, 2));
+    CHECK(st.merges[1] == 0 && st.merges[2] == 1 && st.merges[3] == 1 &&
+          st.merges[4] == 1 && st.merges[5] == 1 && zero_from(st.merges, 6));
+    CHECK(st.max_merge_depth == 4);
+    
+    // The whole pool takes no split and frees with no merge
+    p = buddy_pool_alloc(pool, 5);
+    CHECK(!IS_ERR(p));
+    CHECK(PTR_ERR(buddy_pool_alloc(pool, 1)) == -ENOSPC);
+    CHECK(PTR_ERR(buddy_pool_alloc(pool, 5)) == -ENOSPC);
+    CHECK(buddy_pool_free(pool, p) == OK);
+    CHECK(buddy_pool_get_counters(pool, &st) == OK);
+    CHECK(st.allocs[5] == 1 && st.frees[5] == 1);
+    CHECK(st.splits[5] == 1 && st.merges[5] == 1);
+    CHECK(st.enospc[1] == 1 && st.enospc[5] == 1);
+    CHECK(st.max_merge_depth == 4);
+    
+    // Rejected calls count once each, and nothing else
+    CHECK(PTR_ERR(buddy_pool_alloc(pool, 0)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_alloc(pool, MAX_RANK + 1)) == -EINVAL);
+    CHECK(buddy_pool_free(pool, NULL) == -EINVAL);
+    CHECK(buddy_pool_free(pool, mem + TEST_PAGE_SIZE) == -EINVAL);
+    CHECK(buddy_pool_query_page_counts(pool, 0) == -EINVAL);
+    CHECK(buddy_pool_get_counters(pool, &st) == OK);
+    CHECK(st.einval == 5);
+    CHECK(st.allocs[1] == 1 && st.frees[1] == 1 && st.enospc[1] == 1);
+    
+    // Bulk calls count every block
+    void *ptrs[4];
+    CHECK(buddy_pool_alloc_bulk(pool, 2, 4, ptrs) == 4);
+    CHECK(buddy_pool_free_bulk(pool, ptrs, 4) == OK);
+    CHECK(buddy_pool_get_counters(pool, &st) == OK);
+    CHECK(st.allocs[2] == 4 && st.frees[2] == 4);
+    
+    check_reusable(&model, pool);
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+}
+
+struct worker {
+    buddy_pool_t *pool;
+    int ok;
+};
+
+static void *worker(void *arg) {
+    struct worker *w = arg;
+    for (int i = 0; i < PER_THREAD; i++) {
+        void *p = buddy_pool_alloc(w->pool, 1);
+        w->ok &= !IS_ERR(p) && buddy_pool_free(w->pool, p) == OK;
+    }
+    return NULL;
+}
+
+// Counts from every thread's slot are summed
+static void test_threads(char *mem, int engine) {
+    buddy_pool_t *pool = create(mem, engine);
+    pthread_t tids[THREADS];
+    struct worker w[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        w[i].pool = pool;
+        w[i].ok = 1;
+        pthread_create(&tids[i], NULL, worker, &w[i]);
+    }
+    int ok = 1;
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(tids[i], NULL);
+        ok &= w[i].ok;
+    }
+    CHECK(ok);
+    struct buddy_stats st;
+    CHECK(buddy_pool_get_counters(pool, &st) == OK);
+    CHECK(st.allocs[1] == THREADS * PER_THREAD);
+    CHECK(st.frees[1] == THREADS * PER_THREAD);
+    CHECK(zero_from(st.enospc, 0) && st.einval == 0);
+    check_reusable(&model, pool);
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+}
+
+// The default pool's counters start over with every init_page()
+static void test_default(char *mem) {
+    struct buddy_stats st;
+    CHECK(init_page(mem, PAGES) == OK);
+    return_pages(alloc_pages(1));
+    CHECK(return_pages(NULL) == -EINVAL);
+    CHECK(buddy_get_stats(&st) == OK);
+    CHECK(st.allocs[1] == 1 && st.frees[1] == 1 && st.einval == 1);
+    CHECK(init_page(mem, PAGES) == OK);
+    CHECK(buddy_get_stats(&st) == OK);
+    CHECK(zero_from(st.allocs, 0) && zero_from(st.frees, 0));
+    CHECK(st.einval == 0);
+}
+
+int main(void) {
+    char *mem = aligned_alloc(TEST_PAGE_SIZE, PAGES * TEST_PAGE_SIZE);
+    for (int e = 0; e < TEST_ENGINES; e++) {
+        test_engine(mem, test_engines[e].engine);
+        test_threads(mem, test_engines[e].engine);
+    }
+    test_default(mem);
+    free(mem);
+    return test_done("counters");
+}
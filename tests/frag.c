@@ -0,0 +1,205 @@
+/*
+ * Fragmentation reports: through a random workload on every engine, the
+ * frag info and buddyinfo line agree with figures worked out from the
+ * model's block counts, a hand-worked case gives its known figures, and
+ * the buddyinfo functions size and truncate their output as snprintf()
+ * does.
+ */
+#include "test.h"
+
+#define PAGES 256
+#define STEPS 2000
+#define LIVE 64
+
+static struct model model;
+
+// What the reports must say for the model's counts, worked out directly
+static void expected(struct model *m, struct buddy_frag_info *fi) {
+    int counts[MAX_RANK + 1];
+    model_counts(m, counts);
+    long free_pages = 0, free_blocks = 0;
+    fi->largest_free_pages = 0;
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        long pages = 1L << (rank - 1);
+        free_pages += counts[rank] * pages;
+        free_blocks += counts[rank];
+        if (counts[rank] > 0) {
+            fi->largest_free_pages = pages;
+        }
+    }
+    fi->free_pages = free_pages;
+    fi->unusable[0] = fi->frag_index[0] = 0;
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        long small = 0;
+        int fits = 0;
+        for (int r = 1; r <= MAX_RANK; r++) {
+            if (r < rank) {
+                small += counts[r] * (1L << (r - 1));
+            } else {
+                fits |= counts[r] > 0;
+            }
+        }
+        if (free_pages == 0) {
+            fi->unusable[rank] = fi->frag_index[rank] = 0;
+            continue;
+        }
+        fi->unusable[rank] = small * 1000 / free_pages;
+        fi->frag_index[rank] = fits ? -1000 :
+            1000 - (1000 + free_pages * 1000 / (1L << (rank - 1))) /
+            free_blocks;
+    }
+}
+
+// The buddyinfo line for the given counts, returning its length
+static int buddyinfo_line(char *line, const char *name,
+                          const int counts[MAX_RANK + 1]) {
+    int len = sprintf(line, "%-5s", name);
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        len += sprintf(line + len, " %6d", counts[rank]);
+    }
+    return len + sprintf(line + len, "\n");
+}
+
+static int frag_matches(buddy_pool_t *pool, const char *name) {
+    struct buddy_frag_info want, got;
+    expected(&model, &want);
+    if (buddy_pool_get_frag_info(pool, &got) != OK ||
+        memcmp(&want, &got, sizeof(want)) != 0) {
+        return 0;
+    }
+    
+    int counts[MAX_RANK + 1];
+    char line[512], buf[512];
+    model_counts(&model, counts);
+    int len = buddyinfo_line(line, name, counts);
+    return buddy_pool_format_buddyinfo(pool, buf, sizeof(buf)) == len &&
+           strcmp(buf, line) == 0;
+}
+
+static void test_random(char *mem, int e) {
+    int engine = test_engines[e].engine;
+    buddy_pool_t *pool;
+    model_init(&model, mem, PAGES);
+    if (engine == BUDDY_ENGINE_ARENA) {
+        pool = buddy_pool_create_arenas(mem, PAGES, 0, 4);
+        model.top = 7;              // PAGES / 4 pages per arena
+    } else {
+        pool = buddy_pool_create_engine(mem, PAGES, 0, engine);
+    }
+    CHECK(frag_matches(pool, test_engines[e].name));
+    
+    void *live[LIVE];
+    int ranks[LIVE], n = 0, ok = 1, matched = 1;
+    srand(25);
+    for (int step = 0; step < STEPS; step++) {
+        if (n < LIVE && (n == 0 || rand() % 3 != 0)) {
+            int rank = 1 + rand() % 4;
+            void *p = buddy_pool_alloc(pool, rank);
+            if (IS_ERR(p)) {
+                ok &= PTR_ERR(p) == -ENOSPC;
+                continue;
+            }
+            ok &= model_take(&model, p, rank);
+            live[n] = p;
+            ranks[n++] = rank;
+        } else {
+            int i = rand() % n;
+            ok &= buddy_pool_free(pool, live[i]) == OK;
+            model_release(&model, live[i], ranks[i]);
+            live[i] = live[--n];
+            ranks[i] = ranks[n];
+        }
+        if (step % 50 == 0) {
+            matched &= frag_matches(pool, test_engines[e].name);
+        }
+    }
+    CHECK(ok);
+    CHECK(matched);
+    while (n > 0) {
+        n--;
+        ok &= buddy_pool_free(pool, live[n]) == OK;
+        model_release(&model, live[n], ranks[n]);
+    }
+    CHECK(ok);
+    CHECK(frag_matches(pool, test_engines[e].name));
+    check_reusable(&model, pool);
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+}
+
+// Four single free pages out of 16: nothing above rank 1 fits
+static void test_known(char *mem) {
+    buddy_pool_t *pool = buddy_pool_create(mem, 16, 0);
+    void *pages[16];
+    for (int i = 0; i < 16; i++) {
+        pages[i] = buddy_pool_alloc(pool, 1);
+    }
+    struct buddy_frag_info fi;
+    CHECK(buddy_pool_get_frag_info(pool, &fi) == OK);
+    CHECK(fi.free_pages == 0 && fi.largest_free_pages == 0);
+    CHECK(fi.unusable[1] == 0 && fi.frag_index[1] == 0);
+    for (int i = 0; i < 8; i += 2) {
+        CHECK(buddy_pool_free(pool, pages[i]) == OK);
+    }
+    CHECK(buddy_pool_get_frag_info(pool, &fi) == OK);
+    CHECK(fi.free_pages == 4 && fi.largest_free_pages == 1);
+    CHECK(fi.unusable[1] == 0 && fi.unusable[2] == 1000);
+    CHECK(fi.frag_index[1] == -1000);
+    CHECK(fi.frag_index[2] == 250);     // 1000 - (1000 + 4000 / 2) / 4
+    CHECK(fi.frag_index[3] == 500);
+    CHECK(fi.frag_index[5] == 688);     // 1000 - (1000 + 4000 / 16) / 4
+    buddy_pool_destroy(pool);
+}
+
+// Output is sized and cut short as snprintf() does it
+static void test_format(char *mem) {
+    buddy_pool_t *pool = buddy_pool_create(mem, 16, 0);
+    char full[512], buf[512];
+    int len = buddy_pool_format_buddyinfo(pool, full, sizeof(full));
+    CHECK(len > 0 && (size_t)len == strlen(full) && full[len - 1] == '\n');
+    CHECK(buddy_pool_format_buddyinfo(pool, NULL, 0) == len);
+    memset(buf, 'x', sizeof(buf));
+    CHECK(buddy_pool_format_buddyinfo(pool, buf, 10) == len);
+    CHECK(strlen(buf) == 9 && strncmp(buf, full, 9) == 0 && buf[10] == 'x');
+    CHECK(buddy_pool_format_buddyinfo(pool, buf, len) == len);
+    CHECK(strlen(buf) == (size_t)len - 1);
+    CHECK(buddy_pool_format_buddyinfo(pool, buf, len + 1) == len);
+    CHECK(strcmp(buf, full) == 0);
+    buddy_pool_destroy(pool);
+}
+
+// Before the first init_page() the default pool reports nothing free
+static void test_default(char *mem) {
+    struct buddy_frag_info fi, zero;
+    memset(&zero, 0, sizeof(zero));
+    CHECK(buddy_get_frag_info(&fi) == OK);
+    CHECK(memcmp(&fi, &zero, sizeof(fi)) == 0);
+    char before[512], after[512], line[512], name[16];
+    int len = buddy_format_buddyinfo(before, sizeof(before));
+    CHECK(sscanf(before, "%15s", name) == 1);
+    int counts[MAX_RANK + 1] = {0};
+    CHECK(buddyinfo_line(line, name, counts) == len);
+    CHECK(strcmp(before, line) == 0);
+    
+    // One whole free block once it is set up
+    CHECK(init_page(mem, 16) == OK);
+    CHECK(buddy_get_frag_info(&fi) == OK);
+    CHECK(fi.free_pages == 16 && fi.largest_free_pages == 16);
+    CHECK(fi.unusable[5] == 0 && fi.frag_index[5] == -1000);
+    counts[5] = 1;
+    buddyinfo_line(line, name, counts);
+    CHECK(buddy_format_buddyinfo(after, sizeof(after)) == len);
+    CHECK(strcmp(after, line) == 0);
+}
+
+int main(void) {
+    char *mem = aligned_alloc(TEST_PAGE_SIZE, PAGES * TEST_PAGE_SIZE);
+    test_default(mem);
+    for (int e = 0; e < TEST_ENGINES; e++) {
+        test_random(mem, e);
+    }
+    test_known(mem);
+    test_format(mem);
+    free(mem);
+    return test_done("frag");
+}
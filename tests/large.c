@@ -0,0 +1,86 @@
+/*
+ * Pools far past the old 32768-page limit, with their metadata carved from
+ * the first pages: the pool spans more than 8 GiB, so page offsets overflow
+ * 32 bits, and on every engine that carves the counts match the model as
+ * the pool is filled to the last page and emptied again.  The region is
+ * reserved without backing; only the pages the engines write are touched.
+ */
+#include <sys/mman.h>
+
+#include "test.h"
+
+#define PAGES ((1L << 21) + 3)
+
+static struct model model;
+
+static void test_engine(char *mem, int engine) {
+    buddy_pool_t *pool = buddy_pool_create_engine(mem, PAGES,
+                                                  BUDDY_POOL_CARVE_METADATA,
+                                                  engine);
+    if (engine == BUDDY_ENGINE_ARENA) {
+        CHECK(PTR_ERR(pool) == -EINVAL);
+        return;
+    }
+    CHECK(!IS_ERR(pool));
+    
+    // The carved pages are in use from the start, and only those
+    struct buddy_pool_stats st;
+    CHECK(buddy_pool_get_stats(pool, &st) == OK);
+    long carved = PAGES - st.free_pages;
+    CHECK(carved > 0 && carved < 1L << (MAX_RANK - 1));
+    model_init(&model, mem, PAGES);
+    memset(model.used, 1, carved);
+    CHECK(model_matches(&model, pool));
+    CHECK(buddy_pool_free(pool, mem) == -EINVAL);
+    
+    // Largest blocks first, so the whole pool goes in a few hundred blocks
+    static void *blocks[1024];
+    static int ranks[1024];
+    int n = 0, ok = 1;
+    for (int rank = MAX_RANK; rank >= 1; rank--) {
+        void *p;
+        while (n < 1024 && !IS_ERR(p = buddy_pool_alloc(pool, rank))) {
+            ok &= model_take(&model, p, rank);
+            blocks[n] = p;
+            ranks[n++] = rank;
+        }
+    }
+    CHECK(ok);
+    CHECK(n < 1024);
+    CHECK(model_matches(&model, pool));
+    CHECK(buddy_pool_get_stats(pool, &st) == OK);
+    CHECK(st.free_pages == 0);
+    
+    // The last three pages lie past 8 GiB, in blocks of rank 2 and 1
+    char *tail = mem + (PAGES - 3) * TEST_PAGE_SIZE;
+    CHECK(buddy_pool_query_ranks(pool, tail) == 2);
+    CHECK(buddy_pool_query_ranks(pool, tail + 2 * TEST_PAGE_SIZE) == 1);
+    CHECK(buddy_pool_free(pool, tail + TEST_PAGE_SIZE) == -EINVAL);
+    CHECK(buddy_pool_free(pool, tail + 3 * TEST_PAGE_SIZE) == -EINVAL);
+    
+    while (n > 0) {
+        n--;
+        ok &= buddy_pool_free(pool, blocks[n]) == OK;
+        model_release(&model, blocks[n], ranks[n]);
+    }
+    CHECK(ok);
+    CHECK(model_matches(&model, pool));
+    CHECK(buddy_pool_get_stats(pool, &st) == OK);
+    CHECK(st.free_pages == PAGES - carved);
+    
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+}
+
+int main(void) {
+    char *mem = mmap(NULL, PAGES * TEST_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    CHECK(mem != MAP_FAILED);
+    if (mem != MAP_FAILED) {
+        for (int e = 0; e < TEST_ENGINES; e++) {
+            test_engine(mem, test_engines[e].engine);
+        }
+        munmap(mem, PAGES * TEST_PAGE_SIZE);
+    }
+    return test_done("large");
+}
@@ -0,0 +1,151 @@
+/*
+ * Lazy coalescing: frees under the watermark stay unmerged and are counted
+ * at their own rank, frees past it merge, and a coalesce, an allocation
+ * that finds nothing large enough, or a bulk free bring the counts back to
+ * those of eager merging.
+ */
+#include "test.h"
+
+#define PAGES 16
+
+static struct model model;
+
+static void *page(char *mem, long idx) {
+    return mem + idx * TEST_PAGE_SIZE;
+}
+
+static int counts_are(buddy_pool_t *pool, int rank1, int rank2) {
+    int counts[MAX_RANK + 1];
+    buddy_pool_query_all_page_counts(pool, counts);
+    return counts[1] == rank1 && counts[2] == rank2;
+}
+
+// Free the pages in order, taking them out of the model
+static int free_pages(buddy_pool_t *pool, char *mem, const long *idx, int n) {
+    int ok = 1;
+    for (int i = 0; i < n; i++) {
+        ok &= buddy_pool_free(pool, page(mem, idx[i])) == OK;
+        model_release(&model, page(mem, idx[i]), 1);
+    }
+    return ok;
+}
+
+static void test_list(char *mem) {
+    buddy_pool_t *pool = buddy_pool_create_engine(mem, PAGES, 0,
+                                                  BUDDY_ENGINE_LIST);
+    model_init(&model, mem, PAGES);
+    CHECK(buddy_pool_set_lazy(pool, -1) == -EINVAL);
+    CHECK(buddy_pool_set_lazy(pool, 4) == OK);
+    int ok = 1;
+    for (long i = 0; i < PAGES; i++) {
+        ok &= buddy_pool_alloc(pool, 1) == page(mem, i) &&
+              model_take(&model, page(mem, i), 1);
+    }
+    CHECK(ok);
+    
+    // Under the watermark buddies stay apart
+    CHECK(free_pages(pool, mem, (const long[]){0, 1}, 2));
+    CHECK(counts_are(pool, 2, 0));
+    CHECK(buddy_pool_query_largest_free_rank(pool) == 1);
+    CHECK(buddy_pool_query_ranks(pool, page(mem, 1)) == 1);
+    CHECK(buddy_pool_free(pool, page(mem, 1)) == -EINVAL);
+    
+    // An allocation that finds nothing large enough merges them first
+    CHECK(buddy_pool_alloc(pool, 2) == page(mem, 0));
+    CHECK(model_take(&model, page(mem, 0), 2));
+    CHECK(model_matches(&model, pool));
+    CHECK(buddy_pool_free(pool, page(mem, 0)) == OK);
+    model_release(&model, page(mem, 0), 2);
+    
+    // Once high blocks of the rank are free, a free merges again, also
+    // with an unmerged buddy
+    CHECK(buddy_pool_coalesce_all(pool) == OK);
+    CHECK(buddy_pool_alloc(pool, 1) == page(mem, 0));
+    CHECK(buddy_pool_alloc(pool, 1) == page(mem, 1));
+    CHECK(free_pages(pool, mem, (const long[]){0, 2, 4, 6}, 4));
+    CHECK(counts_are(pool, 4, 0));
+    CHECK(free_pages(pool, mem, (const long[]){1}, 1));
+    CHECK(model_matches(&model, pool));
+    
+    // Back under it, and a coalesce gives the eager counts
+    CHECK(free_pages(pool, mem, (const long[]){3}, 1));
+    CHECK(counts_are(pool, 4, 1));
+    CHECK(buddy_pool_coalesce_all(pool) == OK);
+    CHECK(model_matches(&model, pool));
+    
+    // Turning it off merges new frees; earlier ones wait for a coalesce
+    CHECK(free_pages(pool, mem, (const long[]){5}, 1));
+    CHECK(counts_are(pool, 3, 0));
+    CHECK(buddy_pool_set_lazy(pool, 0) == OK);
+    CHECK(free_pages(pool, mem, (const long[]){9}, 1));
+    CHECK(counts_are(pool, 4, 0));
+    CHECK(buddy_pool_coalesce_all(pool) == OK);
+    CHECK(model_matches(&model, pool));
+    
+    // Bulk frees always merge
+    CHECK(buddy_pool_set_lazy(pool, 4) == OK);
+    void *ptrs[] = {page(mem, 7), page(mem, 8)};
+    CHECK(buddy_pool_free_bulk(pool, ptrs, 2) == OK);
+    model_release(&model, ptrs[0], 1);
+    model_release(&model, ptrs[1], 1);
+    CHECK(model_matches(&model, pool));
+    
+    CHECK(free_pages(pool, mem, (const long[]){10, 11, 12, 13, 14, 15}, 6));
+    CHECK(buddy_pool_coalesce_all(pool) == OK);
+    CHECK(buddy_pool_set_lazy(pool, 0) == OK);
+    check_reusable(&model, pool);
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+}
+
+// Arenas: a fully lazily freed pool still serves its largest block
+static void test_arena(void) {
+    enum { ARENA_PAGES = 1024 };
+    char *big = aligned_alloc(TEST_PAGE_SIZE, ARENA_PAGES * TEST_PAGE_SIZE);
+    buddy_pool_t *pool = buddy_pool_create_arenas(big, ARENA_PAGES, 0, 4);
+    model_init(&model, big, ARENA_PAGES);
+    model.top = 9;
+    CHECK(buddy_pool_set_lazy(pool, ARENA_PAGES) == OK);
+    void *pages[ARENA_PAGES];
+    int ok = 1;
+    for (int i = 0; i < ARENA_PAGES; i++) {
+        pages[i] = buddy_pool_alloc(pool, 1);
+        ok &= !IS_ERR(pages[i]);
+    }
+    for (int i = 0; i < ARENA_PAGES; i++) {
+        ok &= buddy_pool_free(pool, pages[i]) == OK;
+    }
+    CHECK(ok);
+    CHECK(buddy_pool_query_largest_free_rank(pool) == 1);
+    void *block = buddy_pool_alloc(pool, 9);
+    CHECK(!IS_ERR(block));
+    CHECK(buddy_pool_free(pool, block) == OK);
+    CHECK(buddy_pool_coalesce_all(pool) == OK);
+    CHECK(model_matches(&model, pool));
+    CHECK(buddy_pool_set_lazy(pool, 0) == OK);
+    check_reusable(&model, pool);
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+    free(big);
+}
+
+int main(void) {
+    char *mem = aligned_alloc(TEST_PAGE_SIZE, PAGES * TEST_PAGE_SIZE);
+    
+    // Only the list and arena engines are lazy
+    for (int e = 0; e < TEST_ENGINES; e++) {
+        int engine = test_engines[e].engine;
+        buddy_pool_t *p = buddy_pool_create_engine(mem, PAGES, 0, engine);
+        int lazy = engine == BUDDY_ENGINE_LIST || engine == BUDDY_ENGINE_ARENA;
+        CHECK(buddy_pool_set_lazy(p, 4) == (lazy ? OK : -EINVAL));
+        CHECK(buddy_pool_set_lazy(p, 0) == OK);
+        CHECK(buddy_pool_coalesce_all(p) == OK);
+        buddy_pool_destroy(p);
+    }
+    
+    test_list(mem);
+    test_arena();
+    
+    free(mem);
+    return test_done("lazy");
+}
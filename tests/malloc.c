@@ -0,0 +1,139 @@
+/*
+ * buddy_malloc() and buddy_free() on the default pool: objects are aligned,
+ * disjoint and keep their contents, frees of anything but a live object or
+ * block fail, and after a trim the pool has every page back.
+ */
+#include "test.h"
+#include "../slab.h"
+
+#define PAGES 4096
+#define OBJECTS 3000
+
+static struct model model;
+
+struct object {
+    char *p;
+    size_t size;                // Bytes it takes up, after rounding
+};
+
+static struct object objs[OBJECTS];
+
+static int object_cmp(const void *a, const void *b) {
+    const struct object *x = a, *y = b;
+    return x->p < y->p ? -1 : x->p > y->p;
+}
+
+static size_t rounded(size_t size) {
+    size_t round = size > BUDDY_MALLOC_MAX_SMALL ? TEST_PAGE_SIZE : 8;
+    while (round < size) {
+        round *= 2;
+    }
+    return round;
+}
+
+static int default_matches(void) {
+    int want[MAX_RANK + 1], got[MAX_RANK + 1];
+    model_counts(&model, want);
+    query_all_page_counts(got);
+    return memcmp(want + 1, got + 1, sizeof(int) * MAX_RANK) == 0;
+}
+
+static size_t pick_size(int i) {
+    static const size_t large[] = {2049, 4096, 4097, 3 * 4096 + 1, 40000};
+    if (i % 50 == 0) {
+        return large[i / 50 % 5];
+    }
+    return 1 + (size_t)i * 7919 % BUDDY_MALLOC_MAX_SMALL;
+}
+
+int main(void) {
+    char *mem = aligned_alloc(TEST_PAGE_SIZE, (size_t)PAGES * TEST_PAGE_SIZE);
+    CHECK(init_page(mem, PAGES) == OK);
+    model_init(&model, mem, PAGES);
+    
+    CHECK(PTR_ERR(buddy_malloc(0)) == -EINVAL);
+    
+    int ok = 1, n;
+    for (n = 0; n < OBJECTS; n++) {
+        size_t size = pick_size(n);
+        char *p = buddy_malloc(size);
+        if (IS_ERR(p)) {
+            break;
+        }
+        unsigned long align = size > BUDDY_MALLOC_MAX_SMALL ? TEST_PAGE_SIZE
+                              : size > 8 ? 16 : 8;
+        ok &= (unsigned long)p % align == 0 && p >= mem &&
+              p + size <= mem + (long)PAGES * TEST_PAGE_SIZE;
+        objs[n].p = p;
+        objs[n].size = rounded(size);
+        memset(p, n & 0xff, size);
+    }
+    CHECK(ok);
+    CHECK(n == OBJECTS);
+    for (int i = 0; i < n; i++) {
+        size_t size = pick_size(i);
+        for (size_t b = 0; b < size; b++) {
+            ok &= (unsigned char)objs[i].p[b] == (i & 0xff);
+        }
+    }
+    CHECK(ok);
+    struct object sorted[OBJECTS];
+    memcpy(sorted, objs, sizeof(struct object) * n);
+    qsort(sorted, n, sizeof(struct object), object_cmp);
+    for (int i = 1; i < n; i++) {
+        ok &= sorted[i - 1].p + sorted[i - 1].size <= sorted[i].p;
+    }
+    CHECK(ok);
+    
+    // Only live objects and the heads of large blocks can be freed
+    char *small = objs[1].p, *big = objs[0].p;
+    CHECK(buddy_free(NULL) == -EINVAL);
+    CHECK(buddy_free(small + 1) == -EINVAL);
+    CHECK(buddy_free(big + TEST_PAGE_SIZE) == -EINVAL);
+    slab_cache_t *cache = slab_cache_create("not-malloc", 64, 0);
+    void *foreign = slab_alloc(cache);
+    CHECK(buddy_free(foreign) == -EINVAL);
+    CHECK(slab_free(cache, foreign) == OK);
+    slab_cache_destroy(cache);
+    CHECK(buddy_free(small) == OK);
+    CHECK(buddy_free(small) == -EINVAL);
+    CHECK(buddy_free(big) == OK);
+    CHECK(buddy_free(big) == -EINVAL);
+    
+    for (int i = 2; i < n; i++) {
+        ok &= buddy_free(objs[i].p) == OK;
+    }
+    CHECK(ok);
+    CHECK(buddy_malloc_trim() > 0);
+    CHECK(default_matches());
+    
+    // Every page can be allocated again and comes back
+    void **pages = malloc(sizeof(void*) * (PAGES + 1));
+    long got = 0;
+    for (;;) {
+        void *p = alloc_pages(1);
+        if (IS_ERR(p)) {
+            ok &= PTR_ERR(p) == -ENOSPC;
+            break;
+        }
+        if (got == PAGES || !model_take(&model, p, 1)) {
+            ok = 0;
+            break;
+        }
+        pages[got++] = p;
+    }
+    CHECK(ok);
+    CHECK(got == PAGES);
+    while (got > 0) {
+        got--;
+        ok &= return_pages(pages[got]) == OK;
+        model_release(&model, pages[got], 1);
+    }
+    CHECK(ok);
+    CHECK(default_matches());
+    
+    free(pages);
+    model_free_all(&model);
+    free(mem);
+    return test_done("malloc");
+}
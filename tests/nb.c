@@ -0,0 +1,107 @@
+/*
+ * Scan hints of the lock-free engine.  The engine is built into this
+ * driver with a hook that frees a block in the window between a scan
+ * passing it and the scan publishing its raised hint, the interleaving
+ * that used to hide the block until a free below it.
+ */
+static void scan_hook(void *pool, int rank);
+
+#define NB_SCAN_HOOK(pool, rank) scan_hook(pool, rank)
+#include "../buddy_nb.c"
+
+#include "test.h"
+
+#define PAGES 8
+
+static char *mem;
+static long hook_page = -1;
+
+// Free hook_page, once, from inside the next rank-1 scan
+static void scan_hook(void *pool, int rank) {
+    if (rank == 1 && hook_page >= 0) {
+        long idx = hook_page;
+        hook_page = -1;
+        CHECK(nb_free(pool, mem + idx * TEST_PAGE_SIZE) == OK);
+    }
+}
+
+static long alloc_page(buddy_pool_t *pool) {
+    void *p = buddy_pool_alloc(pool, 1);
+    return IS_ERR(p) ? PTR_ERR(p) : ((char*)p - mem) / TEST_PAGE_SIZE;
+}
+
+static int all_used(buddy_pool_t *pool) {
+    int counts[MAX_RANK + 1];
+    buddy_pool_query_all_page_counts(pool, counts);
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        if (counts[rank] != 0) {
+            return 0;
+        }
+    }
+    return alloc_page(pool) == -ENOSPC;
+}
+
+// A block freed behind a scan that then finds a block
+static void test_found(void) {
+    buddy_pool_t *pool = buddy_pool_create_engine(mem, PAGES, 0,
+                                                  BUDDY_ENGINE_NB);
+    int ok = 1;
+    for (long i = 0; i < 6; i++) {
+        ok &= alloc_page(pool) == i;
+    }
+    CHECK(ok);
+    CHECK(buddy_pool_free(pool, mem + 1 * TEST_PAGE_SIZE) == OK);
+    CHECK(alloc_page(pool) == 1);      // The hint is now page 2
+    
+    // Scans from page 2, takes page 6 and frees page 2 before publishing
+    hook_page = 2;
+    CHECK(alloc_page(pool) == 6);
+    CHECK(hook_page == -1);
+    CHECK(alloc_page(pool) == 2);
+    CHECK(alloc_page(pool) == 7);
+    CHECK(all_used(pool));
+    buddy_pool_destroy(pool);
+}
+
+// A block freed behind a scan that runs off the end
+static void test_exhausted(void) {
+    buddy_pool_t *pool = buddy_pool_create_engine(mem, PAGES, 0,
+                                                  BUDDY_ENGINE_NB);
+    int ok = 1;
+    for (long i = 0; i < PAGES; i++) {
+        ok &= alloc_page(pool) == i;
+    }
+    CHECK(ok);
+    CHECK(buddy_pool_free(pool, mem + 3 * TEST_PAGE_SIZE) == OK);
+    CHECK(alloc_page(pool) == 3);      // The hint is now page 4
+    
+    hook_page = 5;
+    CHECK(alloc_page(pool) == -ENOSPC);
+    CHECK(hook_page == -1);
+    CHECK(alloc_page(pool) == 5);
+    CHECK(all_used(pool));
+    buddy_pool_destroy(pool);
+}
+
+// A free that merges lowers the hints of the ranks it formed
+static void test_merged(void) {
+    buddy_pool_t *pool = buddy_pool_create_engine(mem, PAGES, 0,
+                                                  BUDDY_ENGINE_NB);
+    void *a = buddy_pool_alloc(pool, 2);
+    void *b = buddy_pool_alloc(pool, 2);
+    CHECK(buddy_pool_alloc(pool, 3) == mem + 4 * TEST_PAGE_SIZE);
+    CHECK(PTR_ERR(buddy_pool_alloc(pool, 3)) == -ENOSPC);
+    CHECK(buddy_pool_free(pool, a) == OK);
+    CHECK(buddy_pool_free(pool, b) == OK);
+    CHECK(buddy_pool_alloc(pool, 3) == mem);
+    buddy_pool_destroy(pool);
+}
+
+int main(void) {
+    mem = aligned_alloc(TEST_PAGE_SIZE, PAGES * TEST_PAGE_SIZE);
+    test_found();
+    test_exhausted();
+    test_merged();
+    free(mem);
+    return test_done("nb");
+}
@@ -0,0 +1,159 @@
+/*
+ * Per-thread page caches: cached and remote-freed blocks count as
+ * allocated, double and interior frees of cached blocks fail, and every
+ * block comes back to the buddy lists on a drain, at thread exit, or when
+ * another thread frees it and its owner is gone.
+ */
+#include <pthread.h>
+
+#include "test.h"
+
+#define PAGES 4096
+#define THREADS 4
+#define PER_THREAD 512
+
+static buddy_pool_t *pool;
+static struct model model;
+static void *held[THREADS][PER_THREAD];
+static pthread_barrier_t barrier;
+
+static buddy_pool_t *create(char *mem, int engine) {
+    buddy_pool_t *p = engine == BUDDY_ENGINE_ARENA
+                      ? buddy_pool_create_arenas(mem, PAGES, 0, THREADS)
+                      : buddy_pool_create_engine(mem, PAGES, 0, engine);
+    model_init(&model, mem, PAGES);
+    if (engine == BUDDY_ENGINE_ARENA) {
+        model.top = 11;             // PAGES / THREADS pages per arena
+    }
+    return p;
+}
+
+// Cached blocks stay allocated in the counts until drained
+static void test_counting(char *mem, int engine) {
+    pool = create(mem, engine);
+    CHECK(buddy_pool_set_pcp(pool, 8, 4) == OK);
+    
+    void *blocks[64];
+    int ok = 1;
+    for (int i = 0; i < 64; i++) {
+        int rank = 1 + i % BUDDY_PCP_MAX_RANK;
+        blocks[i] = buddy_pool_alloc(pool, rank);
+        ok &= !IS_ERR(blocks[i]) && model_take(&model, blocks[i], rank);
+    }
+    CHECK(ok);
+    for (int i = 0; i < 64; i++) {
+        ok &= buddy_pool_free(pool, blocks[i]) == OK;
+        model_release(&model, blocks[i], 1 + i % BUDDY_PCP_MAX_RANK);
+    }
+    CHECK(ok);
+    
+    // A cached block cannot be freed twice, nor through an inner page
+    void *p = buddy_pool_alloc(pool, 2);
+    CHECK(!IS_ERR(p));
+    CHECK(buddy_pool_free(pool, (char*)p + TEST_PAGE_SIZE) == -EINVAL);
+    CHECK(buddy_pool_free(pool, p) == OK);
+    CHECK(buddy_pool_free(pool, p) == -EINVAL);
+    CHECK(buddy_pool_query_ranks(pool, p) == 2);
+    
+    buddy_pool_drain_pcp(pool);
+    CHECK(buddy_pool_set_pcp(pool, 0, 0) == OK);
+    check_reusable(&model, pool);
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+}
+
+// Each thread frees the blocks of the next one, then exits
+static void *cross_free(void *arg) {
+    long t = (long)arg;
+    for (int i = 0; i < PER_THREAD; i++) {
+        held[t][i] = buddy_pool_alloc(pool, 1);
+    }
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < PER_THREAD; i++) {
+        buddy_pool_free(pool, held[(t + 1) % THREADS][i]);
+    }
+    return NULL;
+}
+
+static void *cache_and_exit(void *arg) {
+    (void)arg;
+    for (int i = 0; i < PER_THREAD; i++) {
+        held[0][i] = buddy_pool_alloc(pool, 1 + i % BUDDY_PCP_MAX_RANK);
+    }
+    for (int i = 0; i < PER_THREAD; i++) {
+        buddy_pool_free(pool, held[0][i]);
+    }
+    return NULL;
+}
+
+static void test_threads(char *mem, int engine) {
+    pool = create(mem, engine);
+    CHECK(buddy_pool_set_pcp(pool, 16, 8) == OK);
+    
+    // Exiting drains the thread's own cache
+    pthread_t tid[THREADS];
+    pthread_create(&tid[0], NULL, cache_and_exit, NULL);
+    pthread_join(tid[0], NULL);
+    CHECK(model_matches(&model, pool));
+    
+    // Blocks freed onto the queue of a thread that has exited come back
+    // on a drain from any thread
+    pthread_barrier_init(&barrier, NULL, THREADS);
+    for (long t = 0; t < THREADS; t++) {
+        pthread_create(&tid[t], NULL, cross_free, (void*)t);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(tid[t], NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+    int ok = 1;
+    for (int t = 0; t < THREADS; t++) {
+        for (int i = 0; i < PER_THREAD; i++) {
+            ok &= !IS_ERR(held[t][i]);
+        }
+    }
+    CHECK(ok);
+    buddy_pool_drain_pcp(pool);
+    CHECK(model_matches(&model, pool));
+    
+    // And on a coalesce
+    pthread_barrier_init(&barrier, NULL, THREADS);
+    for (long t = 0; t < THREADS; t++) {
+        pthread_create(&tid[t], NULL, cross_free, (void*)t);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(tid[t], NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+    CHECK(buddy_pool_coalesce_all(pool) == OK);
+    CHECK(model_matches(&model, pool));
+    
+    CHECK(buddy_pool_set_pcp(pool, 0, 0) == OK);
+    check_reusable(&model, pool);
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+}
+
+int main(void) {
+    char *mem = aligned_alloc(TEST_PAGE_SIZE, (size_t)PAGES * TEST_PAGE_SIZE);
+    
+    // Engines without caches refuse them
+    for (int e = 0; e < TEST_ENGINES; e++) {
+        buddy_pool_t *p = buddy_pool_create_engine(mem, PAGES, 0,
+                                                   test_engines[e].engine);
+        int has_pcp = test_engines[e].engine == BUDDY_ENGINE_LIST ||
+                      test_engines[e].engine == BUDDY_ENGINE_ARENA;
+        CHECK(buddy_pool_set_pcp(p, 8, 4) == (has_pcp ? OK : -EINVAL));
+        CHECK(buddy_pool_set_pcp(p, 0, 0) == OK);
+        buddy_pool_destroy(p);
+    }
+    CHECK(buddy_set_pcp(-1, 0) == -EINVAL);
+    
+    test_counting(mem, BUDDY_ENGINE_LIST);
+    test_counting(mem, BUDDY_ENGINE_ARENA);
+    test_threads(mem, BUDDY_ENGINE_LIST);
+    test_threads(mem, BUDDY_ENGINE_ARENA);
+    
+    free(mem);
+    return test_done("pcp");
+}
@@ -0,0 +1,139 @@
+/*
+ * Independent pools: one pool of every engine and the default pool behind
+ * init_page() are used side by side, and each one's counts follow only
+ * what is done to it.  Destroying a pool leaves the others as they were,
+ * and bad creation arguments are rejected.
+ */
+#include "test.h"
+
+#define PAGES 256
+#define STEPS 4000
+#define LIVE 32
+
+struct pool {
+    char *mem;
+    buddy_pool_t *pool;
+    struct model model;
+    void *live[LIVE];
+    int rank[LIVE];
+    int n;
+};
+
+static struct pool pools[TEST_ENGINES + 1];
+
+#define DEFAULT TEST_ENGINES
+
+static void *pool_alloc(struct pool *p, int rank) {
+    return p->pool != NULL ? buddy_pool_alloc(p->pool, rank)
+                           : alloc_pages(rank);
+}
+
+static int pool_free(struct pool *p, void *block) {
+    return p->pool != NULL ? buddy_pool_free(p->pool, block)
+                           : return_pages(block);
+}
+
+// The default pool has no handle; compare its counts through the wrappers
+static int pool_matches(struct pool *p) {
+    if (p->pool != NULL) {
+        return model_matches(&p->model, p->pool);
+    }
+    int want[MAX_RANK + 1], got[MAX_RANK + 1];
+    model_counts(&p->model, want);
+    query_all_page_counts(got);
+    return memcmp(want + 1, got + 1, sizeof(int) * MAX_RANK) == 0;
+}
+
+static void test_errors(char *mem) {
+    CHECK(PTR_ERR(buddy_pool_create(NULL, 8, 0)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_create(mem, 0, 0)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_create(mem, -1, 0)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_create(mem, 8, 0x100)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_create_engine(mem, 8, 0, -1)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_create_engine(mem, 8, 0, 99)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_create_arenas(mem, 8, 0, 0)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_create_arenas(mem, 8, 0,
+                                           BUDDY_MAX_ARENAS + 1)) == -EINVAL);
+}
+
+int main(void) {
+    for (int i = 0; i <= DEFAULT; i++) {
+        struct pool *p = &pools[i];
+        p->mem = aligned_alloc(TEST_PAGE_SIZE, PAGES * TEST_PAGE_SIZE);
+        model_init(&p->model, p->mem, PAGES);
+        if (i == DEFAULT) {
+            CHECK(init_page(p->mem, PAGES) == OK);
+        } else if (test_engines[i].engine == BUDDY_ENGINE_ARENA) {
+            p->pool = buddy_pool_create_arenas(p->mem, PAGES, 0, 1);
+        } else {
+            p->pool = buddy_pool_create_engine(p->mem, PAGES, 0,
+                                               test_engines[i].engine);
+        }
+        CHECK(!IS_ERR(p->pool));
+    }
+    test_errors(pools[0].mem);
+    
+    // Each step works on one pool; all of them must still match
+    int ok = 1;
+    srand(5);
+    for (int step = 0; step < STEPS; step++) {
+        struct pool *p = &pools[rand() % (DEFAULT + 1)];
+        if (p->n < LIVE && (p->n == 0 || rand() % 2)) {
+            int rank = 1 + rand() % 5;
+            void *block = pool_alloc(p, rank);
+            if (IS_ERR(block)) {
+                ok &= PTR_ERR(block) == -ENOSPC;
+                continue;
+            }
+            ok &= model_take(&p->model, block, rank);
+            p->live[p->n] = block;
+            p->rank[p->n++] = rank;
+        } else {
+            int i = rand() % p->n;
+            ok &= pool_free(p, p->live[i]) == OK;
+            model_release(&p->model, p->live[i], p->rank[i]);
+            p->n--;
+            p->live[i] = p->live[p->n];
+            p->rank[i] = p->rank[p->n];
+        }
+        if (step % 100 == 0) {
+            for (int i = 0; i <= DEFAULT; i++) {
+                ok &= pool_matches(&pools[i]);
+            }
+        }
+    }
+    CHECK(ok);
+    
+    // A block of one pool is not a block of another
+    for (int i = 0; i <= DEFAULT; i++) {
+        struct pool *next = &pools[(i + 1) % (DEFAULT + 1)];
+        if (pools[i].n > 0) {
+            ok &= pool_free(next, pools[i].live[0]) == -EINVAL;
+        }
+    }
+    CHECK(ok);
+    
+    // Tearing the pools down one at a time leaves the rest untouched
+    for (int i = 0; i <= DEFAULT; i++) {
+        struct pool *p = &pools[i];
+        while (p->n > 0) {
+            p->n--;
+            ok &= pool_free(p, p->live[p->n]) == OK;
+            model_release(&p->model, p->live[p->n], p->rank[p->n]);
+        }
+        ok &= pool_matches(p);
+        if (p->pool != NULL) {
+            buddy_pool_destroy(p->pool);
+        }
+        for (int j = i + 1; j <= DEFAULT; j++) {
+            ok &= pool_matches(&pools[j]);
+        }
+    }
+    CHECK(ok);
+    
+    for (int i = 0; i <= DEFAULT; i++) {
+        model_free_all(&pools[i].model);
+        free(pools[i].mem);
+    }
+    return test_done("pools");
+}
@@ -0,0 +1,112 @@
+/*
+ * Page ranks on every engine: as blocks of mixed ranks come and go, every
+ * page of the pool reports the rank of the allocated block holding it or
+ * of the largest free block holding it, and only block heads can be freed.
+ */
+#include "test.h"
+
+#define PAGES 512
+#define LIVE 40
+#define STEPS 3000
+
+static struct model model;
+static int owner[PAGES];            // Rank of the allocated block, or 0
+
+// Rank the model gives page idx: its block's, or the largest free one's
+static int model_rank(long idx) {
+    if (owner[idx]) {
+        return owner[idx];
+    }
+    for (int rank = model.top; rank > 1; rank--) {
+        long pages = 1L << (rank - 1);
+        if (model_block_free(&model, idx & ~(pages - 1), rank)) {
+            return rank;
+        }
+    }
+    return 1;
+}
+
+// Every page reports the model's rank, and no page but a head is freed
+static int pages_match(buddy_pool_t *pool, char *mem) {
+    int ok = 1;
+    for (long idx = 0; idx < PAGES; idx++) {
+        char *p = mem + idx * TEST_PAGE_SIZE;
+        ok &= buddy_pool_query_ranks(pool, p) == model_rank(idx);
+        if (owner[idx] == 0 || (idx & ((1L << (owner[idx] - 1)) - 1))) {
+            ok &= buddy_pool_free(pool, p) == -EINVAL;
+        }
+    }
+    return ok;
+}
+
+static void test_engine(char *mem, int engine) {
+    buddy_pool_t *pool = engine == BUDDY_ENGINE_ARENA
+                         ? buddy_pool_create_arenas(mem, PAGES, 0, 2)
+                         : buddy_pool_create_engine(mem, PAGES, 0, engine);
+    CHECK(!IS_ERR(pool));
+    model_init(&model, mem, PAGES);
+    if (engine == BUDDY_ENGINE_ARENA) {
+        model.top = 9;              // PAGES / 2 pages per arena
+    }
+    memset(owner, 0, sizeof(owner));
+    CHECK(pages_match(pool, mem));
+    CHECK(buddy_pool_query_ranks(pool, NULL) == -EINVAL);
+    CHECK(buddy_pool_query_ranks(pool, mem + PAGES * TEST_PAGE_SIZE) ==
+          -EINVAL);
+    
+    char *live[LIVE];
+    int rank[LIVE];
+    int n = 0, ok = 1;
+    srand(2);
+    for (int step = 0; step < STEPS; step++) {
+        if (n < LIVE && (n == 0 || rand() % 2)) {
+            rank[n] = 1 + rand() % 6;
+            live[n] = buddy_pool_alloc(pool, rank[n]);
+            if (IS_ERR(live[n])) {
+                ok &= PTR_ERR(live[n]) == -ENOSPC;
+                continue;
+            }
+            ok &= model_take(&model, live[n], rank[n]);
+            long idx = model_page(&model, live[n]);
+            for (long i = idx; i < idx + (1L << (rank[n] - 1)); i++) {
+                owner[i] = rank[n];
+            }
+            n++;
+        } else {
+            int i = rand() % n;
+            ok &= buddy_pool_free(pool, live[i]) == OK;
+            model_release(&model, live[i], rank[i]);
+            long idx = model_page(&model, live[i]);
+            memset(owner + idx, 0, sizeof(int) << (rank[i] - 1));
+            n--;
+            live[i] = live[n];
+            rank[i] = rank[n];
+        }
+        if (step % 50 == 0) {
+            ok &= pages_match(pool, mem) && model_matches(&model, pool);
+        }
+    }
+    CHECK(ok);
+    
+    while (n > 0) {
+        n--;
+        ok &= buddy_pool_free(pool, live[n]) == OK;
+        model_release(&model, live[n], rank[n]);
+        long idx = model_page(&model, live[n]);
+        memset(owner + idx, 0, sizeof(int) << (rank[n] - 1));
+    }
+    CHECK(ok);
+    CHECK(pages_match(pool, mem));
+    check_reusable(&model, pool);
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+}
+
+int main(void) {
+    char *mem = aligned_alloc(TEST_PAGE_SIZE, (size_t)PAGES * TEST_PAGE_SIZE);
+    for (int e = 0; e < TEST_ENGINES; e++) {
+        test_engine(mem, test_engines[e].engine);
+    }
+    free(mem);
+    return test_done("ranks");
+}
@@ -0,0 +1,252 @@
+/*
+ * Shared-memory pools: a pool created by one process is attached by forked
+ * children at addresses of their own, blocks pass between the processes as
+ * offsets, and the counts the parent sees match the model for whatever
+ * either side holds.  The list engine is built into this driver so that it
+ * can check the carved pool header and have a child die holding one of the
+ * pool's locks.
+ */
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../buddy_list.c"
+
+#include "test.h"
+
+#define PAGES 512
+#define KEPT 24
+#define OWN 8
+
+struct record {
+    long offset;
+    int rank;
+};
+
+static char name[64];
+static struct model model;
+
+static unsigned long total_frees(buddy_pool_t *pool) {
+    struct buddy_stats st;
+    buddy_pool_get_counters(pool, &st);
+    unsigned long n = 0;
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        n += st.frees[rank];
+    }
+    return n;
+}
+
+static pid_t start_child(void) {
+    fflush(stdout);
+    fflush(stderr);
+    return fork();
+}
+
+// The child exited normally with status 0
+static int child_ok(pid_t pid) {
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0;
+}
+
+// Create the segment and model it; the carved pages stay in use for good
+static buddy_pool_t *create(void) {
+    buddy_pool_t *pool = buddy_pool_create_shared(name, PAGES);
+    CHECK(!IS_ERR(pool));
+    
+    // The pool header and its metadata sit in the first pages, and nothing
+    // else is in use
+    list_pool_t *shared = buddy_shared_ptr(pool, TEST_PAGE_SIZE);
+    CHECK(shared->total_pages == PAGES);
+    long carved = (((sizeof(*shared) + 7) & ~7L) + meta_size(PAGES) +
+                   TEST_PAGE_SIZE - 1) / TEST_PAGE_SIZE;
+    struct buddy_pool_stats st;
+    CHECK(buddy_pool_get_stats(pool, &st) == OK);
+    CHECK(st.free_pages == PAGES - carved);
+    
+    model_init(&model, shared, PAGES);
+    memset(model.used, 1, carved);
+    CHECK(model_matches(&model, pool));
+    return pool;
+}
+
+static void destroy(buddy_pool_t *pool) {
+    buddy_pool_destroy(pool);
+    CHECK(buddy_pool_unlink_shared(name) == OK);
+    model_free_all(&model);
+}
+
+static void test_errors(void) {
+    CHECK(PTR_ERR(buddy_pool_create_shared(name, 0)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_create_shared(NULL, 8)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_attach_shared(name)) == -EINVAL);
+    CHECK(init_page_shared(name, 0) == -EINVAL);
+    CHECK(init_page_shared(name, -1) == -EINVAL);
+    
+    buddy_pool_t *pool = buddy_pool_create_shared(name, 8);
+    CHECK(!IS_ERR(pool));
+    CHECK(PTR_ERR(buddy_pool_create_shared(name, 8)) == -EINVAL);
+    CHECK(buddy_shared_offset(pool, NULL) == -EINVAL);
+    CHECK(PTR_ERR(buddy_shared_ptr(pool, 0)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_shared_ptr(pool, 9L * TEST_PAGE_SIZE)) == -EINVAL);
+    CHECK(buddy_pool_set_pcp(pool, 8, 4) == -EINVAL);
+    buddy_pool_destroy(pool);
+    CHECK(buddy_pool_unlink_shared(name) == OK);
+    CHECK(buddy_pool_unlink_shared(name) == -EINVAL);
+    
+    // Offsets only exist for shared pools
+    char *mem = aligned_alloc(TEST_PAGE_SIZE, 8 * TEST_PAGE_SIZE);
+    pool = buddy_pool_create_engine(mem, 8, 0, BUDDY_ENGINE_LIST);
+    CHECK(buddy_shared_offset(pool, mem) == -EINVAL);
+    CHECK(PTR_ERR(buddy_shared_ptr(pool, TEST_PAGE_SIZE)) == -EINVAL);
+    buddy_pool_destroy(pool);
+    free(mem);
+}
+
+// The child attaches at an address of its own, keeps some blocks and
+// frees two of the parent's; the parent sees all of it
+static void test_fork(void) {
+    buddy_pool_t *pool = create();
+    void *own[OWN];
+    int ok = 1;
+    for (int i = 0; i < OWN; i++) {
+        own[i] = buddy_pool_alloc(pool, 1 + i % 4);
+        ok &= !IS_ERR(own[i]) && model_take(&model, own[i], 1 + i % 4);
+    }
+    CHECK(ok);
+    unsigned long frees = total_frees(pool);
+    
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    pid_t pid = start_child();
+    if (pid == 0) {
+        close(fds[0]);
+        buddy_pool_t *child = buddy_pool_attach_shared(name);
+        if (IS_ERR(child) || buddy_shared_ptr(child, TEST_PAGE_SIZE) ==
+                                 buddy_shared_ptr(pool, TEST_PAGE_SIZE)) {
+            _exit(1);
+        }
+        
+        srand(20);
+        for (int i = 0; i < KEPT * 3 / 2; i++) {
+            struct record r = {0, 1 + rand() % 5};
+            void *p = buddy_pool_alloc(child, r.rank);
+            if (IS_ERR(p) || buddy_pool_query_ranks(child, p) != r.rank) {
+                _exit(1);
+            }
+            if (i % 3 == 2) {
+                ok &= buddy_pool_free(child, p) == OK;
+                continue;
+            }
+            r.offset = buddy_shared_offset(child, p);
+            ok &= write(fds[1], &r, sizeof(r)) == sizeof(r);
+        }
+        
+        // The parent's blocks, found by the offsets it would pass
+        void *theirs[2];
+        for (int i = 0; i < 2; i++) {
+            theirs[i] = buddy_shared_ptr(child,
+                                         buddy_shared_offset(pool, own[i]));
+        }
+        ok &= buddy_pool_free_bulk(child, theirs, 2) == OK;
+        buddy_pool_destroy(child);
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    
+    struct record kept[KEPT + 1];
+    int n = 0;
+    while (n <= KEPT && read(fds[0], &kept[n], sizeof(kept[n])) ==
+                            sizeof(kept[n])) {
+        void *p = buddy_shared_ptr(pool, kept[n].offset);
+        ok &= !IS_ERR(p) && model_take(&model, p, kept[n].rank);
+        n++;
+    }
+    close(fds[0]);
+    CHECK(child_ok(pid));
+    CHECK(ok);
+    CHECK(n == KEPT);
+    model_release(&model, own[0], 1);
+    model_release(&model, own[1], 2);
+    CHECK(model_matches(&model, pool));
+    CHECK(total_frees(pool) == frees + KEPT / 2 + 2);
+    CHECK(buddy_pool_free(pool, own[0]) == -EINVAL);
+    
+    // Everything the child left goes back through the parent's mapping
+    for (int i = 0; i < n; i++) {
+        void *p = buddy_shared_ptr(pool, kept[i].offset);
+        ok &= buddy_pool_free(pool, p) == OK;
+        model_release(&model, p, kept[i].rank);
+    }
+    for (int i = 2; i < OWN; i++) {
+        ok &= buddy_pool_free(pool, own[i]) == OK;
+        model_release(&model, own[i], 1 + i % 4);
+    }
+    CHECK(ok);
+    CHECK(model_matches(&model, pool));
+    destroy(pool);
+}
+
+// A child that attaches with init_page_shared() works on the pool through
+// alloc_pages() and friends
+static void test_default_pool(void) {
+    buddy_pool_t *pool = create();
+    unsigned long frees = total_frees(pool);
+    
+    pid_t pid = start_child();
+    if (pid == 0) {
+        int ok = init_page_shared(name, 0) == OK;
+        void *p[MAX_RANK];
+        for (int rank = 1; rank < 8; rank++) {
+            p[rank] = alloc_pages(rank);
+            ok &= !IS_ERR(p[rank]) && query_ranks(p[rank]) == rank;
+        }
+        for (int rank = 1; rank < 8; rank++) {
+            ok &= return_pages(p[rank]) == OK;
+        }
+        _exit(ok ? 0 : 1);
+    }
+    CHECK(child_ok(pid));
+    CHECK(model_matches(&model, pool));
+    CHECK(total_frees(pool) == frees + 7);
+    destroy(pool);
+}
+
+// A child that dies holding a lock does not stop the parent
+static void test_robust(void) {
+    buddy_pool_t *pool = create();
+    
+    pid_t pid = start_child();
+    if (pid == 0) {
+        buddy_pool_t *child = buddy_pool_attach_shared(name);
+        if (IS_ERR(child)) {
+            _exit(1);
+        }
+        list_pool_t *shared = buddy_shared_ptr(child, TEST_PAGE_SIZE);
+        _exit(pthread_mutex_lock(&shared->rank_lock[1]) == 0 ? 0 : 1);
+    }
+    CHECK(child_ok(pid));
+    
+    // A hang here would be a lock that never came back
+    alarm(10);
+    int ok = 1;
+    for (int i = 0; i < 2; i++) {
+        void *p = buddy_pool_alloc(pool, 1);
+        ok &= !IS_ERR(p) && model_take(&model, p, 1);
+        ok &= model_matches(&model, pool);
+        ok &= buddy_pool_free(pool, p) == OK;
+        model_release(&model, p, 1);
+    }
+    alarm(0);
+    CHECK(ok);
+    CHECK(model_matches(&model, pool));
+    destroy(pool);
+}
+
+int main(void) {
+    snprintf(name, sizeof(name), "/buddy-test-%d", (int)getpid());
+    test_errors();
+    test_fork();
+    test_default_pool();
+    test_robust();
+    return test_done("shm");
+}
@@ -0,0 +1,119 @@
+/*
+ * Slab caches over a pool: objects are distinct, aligned and keep their
+ * contents, frees of anything but a live object of the cache fail, and the
+ * pool gets every page back once the slabs are released.
+ */
+#include "test.h"
+#include "../slab.h"
+
+#define PAGES 512
+#define OBJECTS 2000
+
+static struct model model;
+static void *objs[OBJECTS];
+
+static int addr_cmp(const void *a, const void *b) {
+    const char *x = *(void* const*)a;
+    const char *y = *(void* const*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void test_create(buddy_pool_t *pool) {
+    CHECK(PTR_ERR(slab_cache_create_pool(pool, "zero", 0, 0)) == -EINVAL);
+    CHECK(PTR_ERR(slab_cache_create_pool(pool, "align", 64, 24)) == -EINVAL);
+    CHECK(PTR_ERR(slab_cache_create_pool(pool, "page", 64,
+                                         2 * TEST_PAGE_SIZE)) == -EINVAL);
+    size_t huge = (size_t)TEST_PAGE_SIZE << MAX_RANK;
+    CHECK(PTR_ERR(slab_cache_create_pool(pool, "huge", huge, 0)) == -EINVAL);
+}
+
+static void test_cache(buddy_pool_t *pool, size_t size, size_t align, int n) {
+    slab_cache_t *cache = slab_cache_create_pool(pool, "test", size, align);
+    CHECK(!IS_ERR(cache));
+    struct slab_cache_stats st;
+    CHECK(slab_cache_get_stats(cache, &st) == OK);
+    size_t step = st.object_size;
+    CHECK(step >= size && step % align == 0);
+    
+    // Distinct, aligned objects in the pool, each filled with its index
+    int ok = 1;
+    for (int i = 0; i < n; i++) {
+        objs[i] = slab_alloc(cache);
+        if (IS_ERR(objs[i])) {
+            CHECK(!IS_ERR(objs[i]));
+            return;
+        }
+        ok &= (unsigned long)objs[i] % align == 0 &&
+              (char*)objs[i] >= model.base &&
+              (char*)objs[i] + size <=
+              model.base + model.pgcount * TEST_PAGE_SIZE &&
+              slab_cache_of(objs[i]) == cache;
+        memset(objs[i], i & 0xff, size);
+    }
+    CHECK(ok);
+    for (int i = 0; i < n; i++) {
+        const unsigned char *p = objs[i];
+        for (size_t b = 0; b < size; b++) {
+            ok &= p[b] == (i & 0xff);
+        }
+    }
+    CHECK(ok);
+    void *sorted[OBJECTS];
+    memcpy(sorted, objs, sizeof(void*) * n);
+    qsort(sorted, n, sizeof(void*), addr_cmp);
+    for (int i = 1; i < n; i++) {
+        ok &= (char*)sorted[i] - (char*)sorted[i - 1] >= (long)step;
+    }
+    CHECK(ok);
+    CHECK(slab_cache_get_stats(cache, &st) == OK);
+    CHECK(st.active_objects == n && st.allocs == (unsigned long)n);
+    
+    // Only live objects of this cache can be freed
+    slab_cache_t *other = slab_cache_create_pool(pool, "other", size, align);
+    void *foreign = slab_alloc(other);
+    CHECK(slab_free(cache, foreign) == -EINVAL);
+    CHECK(slab_free(other, objs[0]) == -EINVAL);
+    CHECK(slab_free(cache, (char*)objs[0] + 1) == -EINVAL);
+    CHECK(slab_free(cache, NULL) == -EINVAL);
+    CHECK(slab_free(cache, objs[0]) == OK);
+    CHECK(slab_free(cache, objs[0]) == -EINVAL);
+    CHECK(slab_free(other, foreign) == OK);
+    slab_cache_destroy(other);
+    
+    for (int i = 1; i < n; i++) {
+        ok &= slab_free(cache, objs[i]) == OK;
+    }
+    CHECK(ok);
+    CHECK(slab_cache_get_stats(cache, &st) == OK);
+    CHECK(st.active_objects == 0 && st.frees == (unsigned long)n);
+    CHECK(st.full_slabs == 0 && st.partial_slabs == 0);
+    CHECK(st.empty_slabs <= SLAB_EMPTY_KEEP);
+    CHECK(slab_cache_shrink(cache) == st.empty_slabs);
+    CHECK(st.slabs_created > 1);
+    CHECK(model_matches(&model, pool));
+    
+    // Destroying a cache releases slabs with live objects too
+    for (int i = 0; i < n / 2; i++) {
+        objs[i] = slab_alloc(cache);
+    }
+    slab_cache_destroy(cache);
+    CHECK(model_matches(&model, pool));
+}
+
+int main(void) {
+    char *mem = aligned_alloc(TEST_PAGE_SIZE, (size_t)PAGES * TEST_PAGE_SIZE);
+    buddy_pool_t *pool = buddy_pool_create(mem, PAGES, 0);
+    model_init(&model, mem, PAGES);
+    
+    test_create(pool);
+    test_cache(pool, 8, 8, OBJECTS);
+    test_cache(pool, 100, 64, OBJECTS);
+    test_cache(pool, 600, 8, OBJECTS);
+    test_cache(pool, 3000, 512, 200);
+    check_reusable(&model, pool);
+    
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+    free(mem);
+    return test_done("slab");
+}
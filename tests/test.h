@@ -0,0 +1,195 @@
+#ifndef BUDDY_TEST_H
+#define BUDDY_TEST_H
+
+/*
+ * Helpers shared by the test drivers.  Each driver in tests/ is a program
+ * of its own that runs a group of checks and exits non-zero if any failed;
+ * `make test` builds and runs them all.
+ *
+ * The reference model tracks which pages of a pool are in use and derives
+ * the free block counts an eagerly merging buddy allocator must report:
+ * an aligned block of rank r is counted when all its pages lie in the pool
+ * and are free and its rank r + 1 parent is not wholly free, or r is
+ * the model's top rank.  The top rank is MAX_RANK, or the arena rank for
+ * arena pools, whose blocks never span two arenas.  Blocks held by
+ * per-thread caches, chunks and lazy frees are outside this model until
+ * they are drained or coalesced.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../buddy.h"
+
+#define TEST_PAGE_SIZE 4096
+
+static int test_checks, test_failed;
+
+#define CHECK(cond) do {                                                    \
+        test_checks++;                                                      \
+        if (!(cond)) {                                                      \
+            test_failed++;                                                  \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__,     \
+                    __LINE__, __func__, #cond);                             \
+        }                                                                   \
+    } while (0)
+
+/* Report and return the exit status for main() */
+static inline int test_done(const char *name) {
+    printf("%s: %d checks, %d failed\n", name, test_checks, test_failed);
+    return test_failed != 0;
+}
+
+static const struct {
+    const char *name;
+    int engine;
+} test_engines[] = {
+    {"list", BUDDY_ENGINE_LIST},
+    {"nb", BUDDY_ENGINE_NB},
+    {"tree", BUDDY_ENGINE_TREE},
+    {"arena", BUDDY_ENGINE_ARENA},
+};
+
+#define TEST_ENGINES ((int)(sizeof(test_engines) / sizeof(test_engines[0])))
+
+struct model {
+    char *base;
+    long pgcount;
+    int top;
+    unsigned char *used;
+};
+
+static inline void model_init(struct model *m, void *base, long pgcount) {
+    m->base = base;
+    m->pgcount = pgcount;
+    m->top = MAX_RANK;
+    m->used = calloc(pgcount > 0 ? pgcount : 1, 1);
+}
+
+static inline void model_free_all(struct model *m) {
+    free(m->used);
+}
+
+static inline long model_page(struct model *m, void *p) {
+    return ((char*)p - m->base) / TEST_PAGE_SIZE;
+}
+
+/* Mark the block of the given rank at p in use; 0 if it overlaps another */
+static inline int model_take(struct model *m, void *p, int rank) {
+    long idx = model_page(m, p);
+    long pages = 1L << (rank - 1);
+    if (idx < 0 || idx + pages > m->pgcount ||
+        ((char*)p - m->base) % TEST_PAGE_SIZE != 0) {
+        return 0;
+    }
+    for (long i = idx; i < idx + pages; i++) {
+        if (m->used[i]) {
+            return 0;
+        }
+    }
+    memset(m->used + idx, 1, pages);
+    return 1;
+}
+
+static inline void model_release(struct model *m, void *p, int rank) {
+    memset(m->used + model_page(m, p), 0, 1L << (rank - 1));
+}
+
+/* Block of the given rank at idx is wholly inside the pool and free */
+static inline int model_block_free(struct model *m, long idx, int rank) {
+    long pages = 1L << (rank - 1);
+    if (idx + pages > m->pgcount) {
+        return 0;
+    }
+    for (long i = idx; i < idx + pages; i++) {
+        if (m->used[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline void model_counts(struct model *m, int out[MAX_RANK + 1]) {
+    for (int rank = 0; rank <= MAX_RANK; rank++) {
+        out[rank] = 0;
+    }
+    for (int rank = 1; rank <= m->top; rank++) {
+        long pages = 1L << (rank - 1);
+        for (long idx = 0; idx + pages <= m->pgcount; idx += pages) {
+            if (model_block_free(m, idx, rank) &&
+                (rank == m->top ||
+                 !model_block_free(m, idx & ~(2 * pages - 1), rank + 1))) {
+                out[rank]++;
+            }
+        }
+    }
+}
+
+/*
+ * The pool reports the free block counts the model predicts, in a snapshot
+ * and rank by rank, and the largest rank with a free block
+ */
+static inline int model_matches(struct model *m, buddy_pool_t *pool) {
+    int want[MAX_RANK + 1], got[MAX_RANK + 1];
+    model_counts(m, want);
+    buddy_pool_query_all_page_counts(pool, got);
+    int largest = 0;
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        if (want[rank] > 0) {
+            largest = rank;
+        }
+    }
+    if (buddy_pool_query_largest_free_rank(pool) != largest) {
+        fprintf(stderr, "  largest free rank %d, model says %d\n",
+                buddy_pool_query_largest_free_rank(pool), largest);
+        return 0;
+    }
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        if (want[rank] != got[rank]) {
+            fprintf(stderr, "  rank %d: %d free, model says %d\n", rank,
+                    got[rank], want[rank]);
+            return 0;
+        }
+        if (buddy_pool_query_page_counts(pool, rank) != got[rank]) {
+            fprintf(stderr, "  rank %d: snapshot says %d free, query %d\n",
+                    rank, got[rank], buddy_pool_query_page_counts(pool, rank));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * With every block freed: the counts match the model, every page can be
+ * allocated again as a rank-1 block and freed, and the counts come back.
+ */
+static inline void check_reusable(struct model *m, buddy_pool_t *pool) {
+    CHECK(model_matches(m, pool));
+    void **pages = malloc(sizeof(void*) * (m->pgcount + 1));
+    long n = 0;
+    int ok = 1;
+    for (;;) {
+        void *p = buddy_pool_alloc(pool, 1);
+        if (IS_ERR(p)) {
+            ok &= PTR_ERR(p) == -ENOSPC;
+            break;
+        }
+        if (n == m->pgcount || !model_take(m, p, 1)) {
+            ok = 0;
+            break;
+        }
+        pages[n++] = p;
+    }
+    CHECK(ok);
+    CHECK(n == m->pgcount);
+    while (n > 0) {
+        n--;
+        ok &= buddy_pool_free(pool, pages[n]) == OK;
+        model_release(m, pages[n], 1);
+    }
+    CHECK(ok);
+    CHECK(model_matches(m, pool));
+    free(pages);
+}
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ * Concurrent allocation and free on every engine: threads allocate, free
+ * and bulk free blocks of mixed ranks in the same pool, each stamping its
+ * blocks and checking the stamps before freeing them, so no block is ever
+ * handed to two threads at once.  Once all have finished, every page is
+ * free and reusable.
+ */
+#include <pthread.h>
+
+#include "test.h"
+
+#define PAGES 2048
+#define THREADS 4
+#define LIVE 64
+#define STEPS 100000
+
+static buddy_pool_t *pool;
+static struct model model;
+static pthread_barrier_t barrier;
+
+struct block {
+    long *p;
+    int rank;
+    long tag;
+};
+
+// Write a stamp no other block gets into its first and last word
+static void stamp(struct block *b, long id, long *count) {
+    long words = (TEST_PAGE_SIZE << (b->rank - 1)) / sizeof(long);
+    b->tag = id << 32 | ++*count;
+    b->p[0] = b->tag;
+    b->p[words - 1] = b->tag;
+}
+
+static int stamped(struct block *b) {
+    long words = (TEST_PAGE_SIZE << (b->rank - 1)) / sizeof(long);
+    return b->p[0] == b->tag && b->p[words - 1] == b->tag;
+}
+
+static void *worker(void *arg) {
+    long id = (long)arg;
+    unsigned int seed = id + 1;
+    struct block live[LIVE];
+    long count = 0;
+    int n = 0, ok = 1;
+    pthread_barrier_wait(&barrier);
+    
+    for (int step = 0; step < STEPS; step++) {
+        int op = rand_r(&seed) % 8;
+        if (n < LIVE - 4 && op < 3) {
+            live[n].rank = 1 + rand_r(&seed) % 4;
+            live[n].p = buddy_pool_alloc(pool, live[n].rank);
+            if (IS_ERR(live[n].p)) {
+                ok &= PTR_ERR(live[n].p) == -ENOSPC;
+                continue;
+            }
+            stamp(&live[n++], id, &count);
+        } else if (n < LIVE - 4 && op == 3) {
+            // A few rank-1 blocks in one call
+            void *got[4];
+            int got_n = buddy_pool_alloc_bulk(pool, 1, 4, got);
+            for (int i = 0; i < got_n; i++) {
+                live[n].p = got[i];
+                live[n].rank = 1;
+                stamp(&live[n++], id, &count);
+            }
+        } else if (n >= 4 && op == 4) {
+            // The last four in one call
+            void *ptrs[4];
+            for (int i = 0; i < 4; i++) {
+                n--;
+                ok &= stamped(&live[n]);
+                ptrs[i] = live[n].p;
+            }
+            ok &= buddy_pool_free_bulk(pool, ptrs, 4) == OK;
+        } else if (n > 0) {
+            int i = rand_r(&seed) % n;
+            ok &= stamped(&live[i]);
+            ok &= buddy_pool_free(pool, live[i].p) == OK;
+            live[i] = live[--n];
+        }
+    }
+    while (n > 0) {
+        n--;
+        ok &= stamped(&live[n]);
+        ok &= buddy_pool_free(pool, live[n].p) == OK;
+    }
+    return (void*)(long)ok;
+}
+
+static void test_engine(char *mem, int engine) {
+    pool = engine == BUDDY_ENGINE_ARENA
+           ? buddy_pool_create_arenas(mem, PAGES, 0, THREADS)
+           : buddy_pool_create_engine(mem, PAGES, 0, engine);
+    CHECK(!IS_ERR(pool));
+    model_init(&model, mem, PAGES);
+    if (engine == BUDDY_ENGINE_ARENA) {
+        model.top = 10;             // PAGES / THREADS pages per arena
+    }
+    
+    // With page caches too, where the engine has them
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1 && buddy_pool_set_pcp(pool, 32, 8) != OK) {
+            break;
+        }
+        pthread_t tid[THREADS];
+        pthread_barrier_init(&barrier, NULL, THREADS);
+        for (long t = 0; t < THREADS; t++) {
+            pthread_create(&tid[t], NULL, worker, (void*)t);
+        }
+        int ok = 1;
+        for (int t = 0; t < THREADS; t++) {
+            void *ret;
+            pthread_join(tid[t], &ret);
+            ok &= ret != NULL;
+        }
+        pthread_barrier_destroy(&barrier);
+        CHECK(ok);
+        
+        buddy_pool_set_pcp(pool, 0, 0);
+        buddy_pool_drain_pcp(pool);
+        check_reusable(&model, pool);
+    }
+    buddy_pool_destroy(pool);
+    model_free_all(&model);
+}
+
+int main(void) {
+    char *mem = aligned_alloc(TEST_PAGE_SIZE, (size_t)PAGES * TEST_PAGE_SIZE);
+    for (int e = 0; e < TEST_ENGINES; e++) {
+        test_engine(mem, test_engines[e].engine);
+    }
+    free(mem);
+    return test_done("threads");
+}
@@ -0,0 +1,256 @@
+/*
+ * TLSF engine: lengths map to bins of the documented widths, a search
+ * finds a fitting run whenever one is free, a free merges with both
+ * neighbours, alloc_npages() hands out exactly the pages asked for, and
+ * bad frees are rejected.  The engine is built into this driver so that
+ * its bin mapping and search can be checked directly.
+ */
+#include <limits.h>
+
+#include "../buddy_tlsf.c"
+
+#include "test.h"
+
+#define PAGES 256
+#define STEPS 4000
+#define LIVE 32
+
+static char *mem;
+
+static void *page(long idx) {
+    return mem + idx * TEST_PAGE_SIZE;
+}
+
+static long free_pages(buddy_pool_t *pool) {
+    struct buddy_pool_stats st;
+    buddy_pool_get_stats(pool, &st);
+    return st.free_pages;
+}
+
+// Lengths below SL_COUNT get a bin each; above, each power-of-two range is
+// cut into SL_COUNT bins of equal width, in increasing order
+static void test_bins(void) {
+    int ok = 1, fl, sl, last_fl = -1, last_sl = 0;
+    long start = 1;
+    for (long n = 1; n <= 1L << 20; n++) {
+        bin_of(n, &fl, &sl);
+        ok &= fl == floor_log2(n) && sl >= 0 && sl < SL_COUNT;
+        if (fl == last_fl && sl == last_sl) {
+            continue;
+        }
+        
+        // n starts a new bin; the previous one held lengths start..n - 1
+        ok &= fl > last_fl || (fl == last_fl && sl > last_sl);
+        if (last_fl >= 0) {
+            long width = last_fl < SL_SHIFT ? 1 : 1L << (last_fl - SL_SHIFT);
+            ok &= n - start == width;
+        }
+        start = n;
+        last_fl = fl;
+        last_sl = sl;
+    }
+    CHECK(ok);
+    
+    bin_of(1L << 40, &fl, &sl);
+    CHECK(fl == 40 && sl == 0);
+    bin_of((1L << 41) - 1, &fl, &sl);
+    CHECK(fl == 40 && sl == SL_COUNT - 1);
+}
+
+// Free runs of the given lengths, each followed by one allocated page
+static buddy_pool_t *runs(const long *lengths, int n) {
+    buddy_pool_t *pool = buddy_pool_create_engine(mem, PAGES, 0,
+                                                  BUDDY_ENGINE_TLSF);
+    void *held[16];
+    for (int i = 0; i < n; i++) {
+        held[i] = buddy_pool_alloc_npages(pool, lengths[i]);
+        CHECK(!IS_ERR(held[i]));
+        CHECK(!IS_ERR(buddy_pool_alloc_npages(pool, 1)));
+    }
+    CHECK(!IS_ERR(buddy_pool_alloc_npages(pool, free_pages(pool))));
+    for (int i = 0; i < n; i++) {
+        CHECK(buddy_pool_free(pool, held[i]) == OK);
+    }
+    return pool;
+}
+
+// A search finds a run of at least n pages exactly when one is free
+static void test_find(void) {
+    const long lengths[] = {1, 3, 5, 16, 17, 32, 40, 47};
+    int count = sizeof(lengths) / sizeof(lengths[0]);
+    buddy_pool_t *bp = runs(lengths, count);
+    tlsf_pool_t *pool = to_tlsf(bp);
+    int ok = 1;
+    for (long n = 1; n <= 48; n++) {
+        int fits = 0;
+        for (int i = 0; i < count; i++) {
+            fits |= lengths[i] >= n;
+        }
+        long idx = run_find(pool, n);
+        ok &= fits ? idx != NO_PAGE && pool->state[idx] == RUN_FREE &&
+                     pool->length[idx] >= n
+                   : idx == NO_PAGE;
+    }
+    CHECK(ok);
+    buddy_pool_destroy(bp);
+    
+    // 33 rounds up past a bin holding only 32 and 33; the walk of that bin
+    // must find 33 and must not hand out 32
+    const long one[] = {33};
+    bp = runs(one, 1);
+    CHECK(run_find(to_tlsf(bp), 33) == 0);
+    CHECK(run_find(to_tlsf(bp), 34) == NO_PAGE);
+    buddy_pool_destroy(bp);
+    const long other[] = {32};
+    bp = runs(other, 1);
+    CHECK(run_find(to_tlsf(bp), 33) == NO_PAGE);
+    CHECK(run_find(to_tlsf(bp), 32) == 0);
+    buddy_pool_destroy(bp);
+}
+
+// A free merges with the free runs on both sides of it
+static void test_merge(void) {
+    buddy_pool_t *pool = buddy_pool_create_engine(mem, 64, 0,
+                                                  BUDDY_ENGINE_TLSF);
+    char *a = buddy_pool_alloc_npages(pool, 3);
+    char *b = buddy_pool_alloc_npages(pool, 5);
+    char *c = buddy_pool_alloc_npages(pool, 7);
+    char *d = buddy_pool_alloc_npages(pool, 49);
+    CHECK(a == page(0) && b == page(3) && c == page(8) && d == page(15));
+    CHECK(free_pages(pool) == 0);
+    
+    CHECK(buddy_pool_free(pool, a) == OK);
+    CHECK(buddy_pool_free(pool, c) == OK);
+    CHECK(buddy_pool_query_ranks(pool, a) == 2);    // A run of 3
+    CHECK(buddy_pool_query_ranks(pool, c) == 3);    // A run of 7
+    CHECK(buddy_pool_query_page_counts(pool, 2) == 1);
+    CHECK(buddy_pool_query_page_counts(pool, 3) == 1);
+    
+    // b joins a, b and c into one run of 15 pages
+    CHECK(buddy_pool_free(pool, b) == OK);
+    CHECK(free_pages(pool) == 15);
+    CHECK(buddy_pool_query_ranks(pool, a) == 4);
+    CHECK(buddy_pool_query_ranks(pool, b) == -EINVAL);
+    CHECK(buddy_pool_query_ranks(pool, c) == -EINVAL);
+    CHECK(buddy_pool_query_page_counts(pool, 2) == 0);
+    CHECK(buddy_pool_query_page_counts(pool, 3) == 0);
+    CHECK(buddy_pool_query_page_counts(pool, 4) == 1);
+    
+    // and d the rest, back to a single run
+    CHECK(buddy_pool_free(pool, d) == OK);
+    CHECK(buddy_pool_query_largest_free_rank(pool) == 7);
+    CHECK(buddy_pool_query_page_counts(pool, 4) == 0);
+    CHECK(!IS_ERR(buddy_pool_alloc_npages(pool, 64)));
+    buddy_pool_destroy(pool);
+}
+
+// Odd sizes take exactly their pages, unaligned, and all come back
+static void test_npages(void) {
+    buddy_pool_t *pool = buddy_pool_create_engine(mem, PAGES, 0,
+                                                  BUDDY_ENGINE_TLSF);
+    CHECK(PTR_ERR(buddy_pool_alloc_npages(pool, 0)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_alloc_npages(pool, -1)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_alloc_npages(pool, PAGES + 1)) == -ENOSPC);
+    CHECK(PTR_ERR(buddy_pool_alloc_npages(pool, 1L << 62)) == -ENOSPC);
+    CHECK(PTR_ERR(buddy_pool_alloc_npages(pool, LONG_MAX)) == -ENOSPC);
+    
+    char *p = buddy_pool_alloc_npages(pool, 3);
+    char *q = buddy_pool_alloc_npages(pool, 1);
+    CHECK(p == page(0) && q == page(3));
+    CHECK(buddy_pool_query_ranks(pool, p) == 3);    // Smallest rank for 3
+    CHECK(buddy_pool_free(pool, p) == OK);
+    CHECK(buddy_pool_free(pool, q) == OK);
+    
+    unsigned char used[PAGES] = {0};
+    char *live[LIVE];
+    long len[LIVE];
+    int n = 0, ok = 1;
+    long held = 0;
+    srand(13);
+    for (int step = 0; step < STEPS; step++) {
+        if (n < LIVE && (n == 0 || rand() % 3 != 0)) {
+            long want = 1 + 2 * (rand() % 12);
+            char *r = buddy_pool_alloc_npages(pool, want);
+            if (IS_ERR(r)) {
+                ok &= PTR_ERR(r) == -ENOSPC;
+                continue;
+            }
+            long idx = (r - mem) / TEST_PAGE_SIZE;
+            ok &= idx >= 0 && idx + want <= PAGES;
+            for (long i = idx; i < idx + want && i < PAGES; i++) {
+                ok &= !used[i];
+                used[i] = 1;
+            }
+            ok &= buddy_pool_query_ranks(pool, r) == block_rank(want);
+            live[n] = r;
+            len[n++] = want;
+            held += want;
+        } else {
+            int i = rand() % n;
+            long idx = (live[i] - mem) / TEST_PAGE_SIZE;
+            memset(used + idx, 0, len[i]);
+            ok &= buddy_pool_free(pool, live[i]) == OK;
+            held -= len[i];
+            live[i] = live[--n];
+            len[i] = len[n];
+        }
+        ok &= free_pages(pool) == PAGES - held;
+    }
+    CHECK(ok);
+    while (n > 0) {
+        n--;
+        ok &= buddy_pool_free(pool, live[n]) == OK;
+    }
+    CHECK(ok);
+    
+    struct buddy_pool_stats st;
+    CHECK(buddy_pool_get_stats(pool, &st) == OK);
+    CHECK(st.free_pages == PAGES && st.largest_free_pages == PAGES);
+    buddy_pool_destroy(pool);
+}
+
+static void test_bad_frees(void) {
+    buddy_pool_t *pool = buddy_pool_create_engine(mem, 64, 0,
+                                                  BUDDY_ENGINE_TLSF);
+    char *p = buddy_pool_alloc_npages(pool, 5);
+    char *q = buddy_pool_alloc_npages(pool, 2);
+    CHECK(buddy_pool_free(pool, NULL) == -EINVAL);
+    CHECK(buddy_pool_free(pool, mem - TEST_PAGE_SIZE) == -EINVAL);
+    CHECK(buddy_pool_free(pool, page(64)) == -EINVAL);
+    CHECK(buddy_pool_free(pool, p + 1) == -EINVAL);
+    CHECK(buddy_pool_free(pool, p + TEST_PAGE_SIZE) == -EINVAL);
+    CHECK(buddy_pool_free(pool, page(7)) == -EINVAL);   // The free run
+    CHECK(free_pages(pool) == 57);
+    
+    // A bulk free with a duplicate or inner page frees nothing
+    void *ptrs[3] = {p, q, p};
+    CHECK(buddy_pool_free_bulk(pool, ptrs, 3) == -EINVAL);
+    ptrs[2] = q + TEST_PAGE_SIZE;
+    CHECK(buddy_pool_free_bulk(pool, ptrs, 3) == -EINVAL);
+    CHECK(free_pages(pool) == 57);
+    ptrs[0] = p;
+    ptrs[1] = q;
+    CHECK(buddy_pool_free_bulk(pool, ptrs, 2) == OK);
+    CHECK(free_pages(pool) == 64);
+    CHECK(buddy_pool_free(pool, p) == -EINVAL);
+    buddy_pool_destroy(pool);
+    
+    // Carved metadata pages are not blocks
+    pool = buddy_pool_create_engine(mem, 64, BUDDY_POOL_CARVE_METADATA,
+                                    BUDDY_ENGINE_TLSF);
+    CHECK(!IS_ERR(pool));
+    CHECK(buddy_pool_free(pool, mem) == -EINVAL);
+    CHECK(buddy_pool_query_ranks(pool, mem) == -EINVAL);
+    buddy_pool_destroy(pool);
+}
+
+int main(void) {
+    mem = aligned_alloc(TEST_PAGE_SIZE, PAGES * TEST_PAGE_SIZE);
+    test_bins();
+    test_find();
+    test_merge();
+    test_npages();
+    test_bad_frees();
+    free(mem);
+    return test_done("tlsf");
+}
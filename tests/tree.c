@@ -0,0 +1,119 @@
+/*
+ * Tree engine against the list engine: one random mix of allocations,
+ * frees and queries, run on a pool of each, gets the same answers from
+ * both, and each pool's counts match a model of its own blocks.  The tree
+ * engine places blocks best fit, so the addresses and the shape of the
+ * free space differ, but never the ranks, the errors or the free pages.
+ * The live set stays small enough that neither pool can run out.
+ */
+#include "test.h"
+
+#define PAGES 1024
+#define LIVE 48
+#define STEPS 20000
+
+struct side {
+    char *mem;
+    buddy_pool_t *pool;
+    struct model model;
+    char *live[LIVE];
+};
+
+static struct side list, tree;
+
+static long free_pages(buddy_pool_t *pool) {
+    struct buddy_pool_stats st;
+    buddy_pool_get_stats(pool, &st);
+    return st.free_pages;
+}
+
+static void setup(struct side *s, int engine) {
+    s->mem = aligned_alloc(TEST_PAGE_SIZE, PAGES * TEST_PAGE_SIZE);
+    s->pool = buddy_pool_create_engine(s->mem, PAGES, 0, engine);
+    CHECK(!IS_ERR(s->pool));
+    model_init(&s->model, s->mem, PAGES);
+}
+
+static void teardown(struct side *s) {
+    buddy_pool_destroy(s->pool);
+    model_free_all(&s->model);
+    free(s->mem);
+}
+
+int main(void) {
+    setup(&list, BUDDY_ENGINE_LIST);
+    setup(&tree, BUDDY_ENGINE_TREE);
+    int rank[LIVE];
+    int n = 0, same = 1, ok = 1;
+    srand(12);
+    for (int step = 0; step < STEPS; step++) {
+        int op = rand() % 4;
+        if (n < LIVE && (n == 0 || op < 2)) {
+            rank[n] = 1 + rand() % 4;
+            list.live[n] = buddy_pool_alloc(list.pool, rank[n]);
+            tree.live[n] = buddy_pool_alloc(tree.pool, rank[n]);
+            ok &= !IS_ERR(list.live[n]) && !IS_ERR(tree.live[n]) &&
+                  model_take(&list.model, list.live[n], rank[n]) &&
+                  model_take(&tree.model, tree.live[n], rank[n]);
+            if (!ok) {
+                break;
+            }
+            n++;
+        } else if (op == 2) {
+            // Any page of a live block reports the rank of the block
+            int i = rand() % n;
+            long page = rand() % (1L << (rank[i] - 1));
+            int got = buddy_pool_query_ranks(list.pool, list.live[i] +
+                                             page * TEST_PAGE_SIZE);
+            same &= got == rank[i];
+            same &= got == buddy_pool_query_ranks(tree.pool, tree.live[i] +
+                                                  page * TEST_PAGE_SIZE);
+        } else {
+            int i = rand() % n;
+            if (rank[i] > 1) {
+                same &= buddy_pool_free(list.pool, list.live[i] +
+                                        TEST_PAGE_SIZE) == -EINVAL;
+                same &= buddy_pool_free(tree.pool, tree.live[i] +
+                                        TEST_PAGE_SIZE) == -EINVAL;
+            }
+            same &= buddy_pool_free(list.pool, list.live[i]) == OK;
+            same &= buddy_pool_free(tree.pool, tree.live[i]) == OK;
+            same &= buddy_pool_free(list.pool, list.live[i]) == -EINVAL;
+            same &= buddy_pool_free(tree.pool, tree.live[i]) == -EINVAL;
+            model_release(&list.model, list.live[i], rank[i]);
+            model_release(&tree.model, tree.live[i], rank[i]);
+            n--;
+            list.live[i] = list.live[n];
+            tree.live[i] = tree.live[n];
+            rank[i] = rank[n];
+        }
+        same &= free_pages(list.pool) == free_pages(tree.pool);
+        if (step % 100 == 0) {
+            ok &= model_matches(&list.model, list.pool) &&
+                  model_matches(&tree.model, tree.pool);
+        }
+    }
+    CHECK(ok);
+    CHECK(same);
+    
+    // Both merge all the way back
+    while (n > 0) {
+        n--;
+        ok &= buddy_pool_free(list.pool, list.live[n]) == OK;
+        ok &= buddy_pool_free(tree.pool, tree.live[n]) == OK;
+        model_release(&list.model, list.live[n], rank[n]);
+        model_release(&tree.model, tree.live[n], rank[n]);
+    }
+    CHECK(ok);
+    int a[MAX_RANK + 1], b[MAX_RANK + 1];
+    buddy_pool_query_all_page_counts(list.pool, a);
+    buddy_pool_query_all_page_counts(tree.pool, b);
+    CHECK(memcmp(a, b, sizeof(a)) == 0);
+    CHECK(buddy_pool_query_largest_free_rank(tree.pool) == 11);
+    check_reusable(&list.model, list.pool);
+    check_reusable(&tree.model, tree.pool);
+    
+    teardown(&list);
+    teardown(&tree);
+    return test_done("tree");
+}